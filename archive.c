@@ -0,0 +1,305 @@
+/*
+ * Archive handle for long running users of the library
+ *
+ * The archive is opened, mapped and its TOC decoded once, after that every call
+ * only reads shared state, so any number of threads can extract from one handle.
+ * Nothing here prints, problems come back as azpError_t codes.
+ *
+ * Licenced under GPLv3
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "azp.h"
+
+#define AZP_SINK_CHUNK (64 * 1024)
+
+struct azpArchive_t {
+    int fd;
+    uint8_t *map;
+    size_t size;
+    azpHeader_t header;
+    azpIndex_t index;
+    azpReader_t *reader;
+};
+
+static const char *azpErrors[] = {
+    "ok",
+    "input/output error",
+    "out of memory",
+    "not an AZP archive or broken TOC",
+    "no such entry",
+    "corrupt entry data",
+    "buffer too small",
+    "output sink failed"
+};
+
+const char *azp_strerror(int error) {
+    if(error > 0 || -error >= (int)(sizeof(azpErrors) / sizeof(azpErrors[0]))) {
+        return "unknown error";
+    }
+    return azpErrors[-error];
+}
+
+/*
+ * zlib result as an error code
+ */
+static int azp_zlib_error(int ret) {
+    switch(ret) {
+    case Z_OK:
+        return AZP_OK;
+    case Z_MEM_ERROR:
+        return AZP_ERR_NOMEM;
+    case Z_ERRNO:
+        return AZP_ERR_IO;
+    default:
+        return AZP_ERR_DATA;
+    }
+}
+
+int azp_archive_open(azpArchive_t **archive, const char *filename, unsigned flags) {
+    azpArchive_t *handle = calloc(1, sizeof(azpArchive_t));
+    if(handle == NULL) {
+        return AZP_ERR_NOMEM;
+    }
+    handle->map = MAP_FAILED;
+    handle->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(handle->fd == -1 || fstat(handle->fd, &st) != 0) {
+        int saved = errno;
+        azp_archive_close(handle);
+        errno = saved;
+        return AZP_ERR_IO;
+    }
+    handle->size = st.st_size;
+    if(handle->size < sizeof(azpHeader_t)) {
+        azp_archive_close(handle);
+        return AZP_ERR_FORMAT;
+    }
+    handle->map = mmap(NULL, handle->size, PROT_READ, MAP_PRIVATE, handle->fd, 0);
+    if(handle->map == MAP_FAILED) {
+        int saved = errno;
+        azp_archive_close(handle);
+        errno = saved;
+        return AZP_ERR_IO;
+    }
+    if(!azp_check_header(&handle->header, handle->map, handle->size)) {
+        azp_archive_close(handle);
+        return AZP_ERR_FORMAT;
+    }
+
+    bool decoded = false;
+    char *idx_path = NULL;
+    if(flags & AZP_OPEN_SIDECAR) {
+        idx_path = malloc(strlen(filename) + sizeof(".idx"));
+        if(idx_path == NULL) {
+            azp_archive_close(handle);
+            return AZP_ERR_NOMEM;
+        }
+        sprintf(idx_path, "%s.idx", filename);
+        decoded = azp_index_load(&handle->index, idx_path, &handle->header, handle->fd);
+    }
+    if(!decoded) {
+        if(!azp_index_decode(&handle->index, &handle->header, handle->map, handle->size, NULL, 0)) {
+            free(idx_path);
+            azp_archive_close(handle);
+            return AZP_ERR_FORMAT;
+        }
+        /* Stale sidecar is only a cache, failing to refresh it is not an error */
+        if(idx_path != NULL) {
+            (void)azp_index_save(&handle->index, idx_path, &handle->header, handle->fd);
+        }
+    }
+    free(idx_path);
+
+    handle->reader = azp_reader_open(&handle->index, handle->map, handle->size, 0);
+    if(handle->reader == NULL) {
+        azp_archive_close(handle);
+        return AZP_ERR_NOMEM;
+    }
+    *archive = handle;
+    return AZP_OK;
+}
+
+void azp_archive_close(azpArchive_t *archive) {
+    if(archive == NULL) {
+        return;
+    }
+    azp_reader_close(archive->reader);
+    if(archive->index.mem != NULL) {
+        azp_index_free(&archive->index);
+    }
+    if(archive->map != MAP_FAILED) {
+        munmap(archive->map, archive->size);
+    }
+    if(archive->fd != -1) {
+        close(archive->fd);
+    }
+    free(archive);
+}
+
+const azpIndex_t *azp_archive_index(const azpArchive_t *archive) {
+    return &archive->index;
+}
+
+const azpHeader_t *azp_archive_header(const azpArchive_t *archive) {
+    return &archive->header;
+}
+
+const uint8_t *azp_archive_data(const azpArchive_t *archive, size_t *size) {
+    if(size != NULL) {
+        *size = archive->size;
+    }
+    return archive->map;
+}
+
+int azp_archive_fd(const azpArchive_t *archive) {
+    return archive->fd;
+}
+
+int azp_archive_find(const azpArchive_t *archive, const char *name, uint32_t *entry) {
+    uint32_t found = azp_index_find(&archive->index, name);
+    if(found == AZP_NOT_FOUND) {
+        return AZP_ERR_NOT_FOUND;
+    }
+    *entry = found;
+    return AZP_OK;
+}
+
+/*
+ * Checks the entry exists and its data lies inside the archive
+ * returns AZP_OK or an error code
+ */
+static int azp_archive_entry(const azpArchive_t *archive, uint32_t entry) {
+    if(entry >= archive->index.count) {
+        return AZP_ERR_NOT_FOUND;
+    }
+    if((size_t)archive->index.offset[entry] + archive->index.compressed_size[entry] > archive->size) {
+        return AZP_ERR_DATA;
+    }
+    return AZP_OK;
+}
+
+int64_t azp_archive_read(azpArchive_t *archive, uint32_t entry, size_t offset, size_t len, void *buf) {
+    int ret = azp_archive_entry(archive, entry);
+    if(ret != AZP_OK) {
+        return ret;
+    }
+    int64_t n = azp_read(archive->reader, entry, offset, len, buf);
+    return n < 0 ? AZP_ERR_DATA : n;
+}
+
+int azp_archive_extract_mem(const azpArchive_t *archive, uint32_t entry, void *buf, size_t buf_sz) {
+    int ret = azp_archive_entry(archive, entry);
+    if(ret != AZP_OK) {
+        return ret;
+    }
+    const azpIndex_t *index = &archive->index;
+    if(buf_sz < index->uncompressed_size[entry]) {
+        return AZP_ERR_SIZE;
+    }
+    return azp_zlib_error(azp_codec_inflate(buf, index->uncompressed_size[entry],
+                                            archive->map + index->offset[entry], index->compressed_size[entry]));
+}
+
+int azp_archive_extract_sink(const azpArchive_t *archive, uint32_t entry, const azpSink_t *sink) {
+    int ret = azp_archive_entry(archive, entry);
+    if(ret != AZP_OK) {
+        return ret;
+    }
+    const azpIndex_t *index = &archive->index;
+    uint8_t *out = malloc(AZP_SINK_CHUNK);
+    if(out == NULL) {
+        return AZP_ERR_NOMEM;
+    }
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    ret = inflateInit(&strm);
+    if(ret != Z_OK) {
+        free(out);
+        return azp_zlib_error(ret);
+    }
+
+    /* The whole blob is mapped, only the output goes through the chunk */
+    strm.next_in = archive->map + index->offset[entry];
+    strm.avail_in = index->compressed_size[entry];
+    int result = AZP_OK;
+    do {
+        strm.next_out = out;
+        strm.avail_out = AZP_SINK_CHUNK;
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if(ret != Z_OK && ret != Z_STREAM_END) {
+            result = AZP_ERR_DATA;
+            break;
+        }
+        size_t have = AZP_SINK_CHUNK - strm.avail_out;
+        if(strm.total_out > index->uncompressed_size[entry]) {
+            result = AZP_ERR_DATA;
+            break;
+        }
+        if(have > 0 && sink->write(sink->ctx, out, have) != 0) {
+            result = AZP_ERR_SINK;
+            break;
+        }
+    } while(ret != Z_STREAM_END);
+    if(result == AZP_OK && strm.total_out != index->uncompressed_size[entry]) {
+        result = AZP_ERR_DATA;
+    }
+    (void)inflateEnd(&strm);
+    free(out);
+    return result;
+}
+
+static int azp_fd_sink(void *ctx, const void *data, size_t len) {
+    int fd = *(int*)ctx;
+    const uint8_t *p = data;
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int azp_archive_extract_fd(const azpArchive_t *archive, uint32_t entry, int fd) {
+    azpSink_t sink = {
+        .write = azp_fd_sink,
+        .ctx = &fd
+    };
+    int ret = azp_archive_extract_sink(archive, entry, &sink);
+    return ret == AZP_ERR_SINK ? AZP_ERR_IO : ret;
+}
+
+int azp_archive_extract_path(const azpArchive_t *archive, uint32_t entry, const char *path) {
+    int ret = azp_archive_entry(archive, entry);
+    if(ret != AZP_OK) {
+        return ret;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1) {
+        return AZP_ERR_IO;
+    }
+    /* Same path as extraction, big files are preallocated and inflated into a mapping */
+    ret = azp_zlib_error(azp_write_entry(fd, &archive->index, entry, archive->map, archive->size));
+    if(close(fd) != 0 && ret == AZP_OK) {
+        ret = AZP_ERR_IO;
+    }
+    return ret;
+}
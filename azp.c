@@ -1,262 +1,3681 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <zlib.h>
 #include <assert.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include "azp.h"
+#include "pool.h"
+#include "outdir.h"
+#include "stats.h"
+#include "scan.h"
+#include "sha256.h"
 
 const uint32_t azpHeaderMagic = 0x01505A41;
 #define CHUNK_SZ 16384
 #define CIPHER_KEY 0xF69DA025
 #define AZP_VERSION 0x00000006
+/* Memory compression workers hold for input, output and finished blobs before
+   waiting or spilling to a temporary file */
+#ifndef AZP_COMPRESS_MEMORY
+#define AZP_COMPRESS_MEMORY (256u * 1024 * 1024)
+#endif
+/* Entries bigger than this are deflated in chunks into the spill file instead of in memory */
+#define AZP_STREAM_THRESHOLD (AZP_COMPRESS_MEMORY / 4)
+/* Read size when hashing files for deduplication */
+#define AZP_HASH_BLOCK (256 * 1024)
+/* Entries up to this size are extracted in batches of AZP_BATCH files */
+#define AZP_BATCH_FILE_MAX (64u * 1024)
+#define AZP_BATCH 256
+/* Entries bigger than this are tested through a fixed buffer instead of a whole one */
+#define AZP_TEST_WHOLE_MAX (16u * 1024 * 1024)
+#define AZP_TEST_CHUNK (1024 * 1024)
+/* Largest name table, a TOC of at most 4 GiB has under 2^28 entries */
+#define AZP_HASH_SLOTS_MAX (1u << 31)
+
+static void azp_cipher(uint8_t *output, const uint8_t *data, size_t len, uint32_t *key);
+
+bool azp_check_header(azpHeader_t *header, uint8_t *archive, size_t archive_sz) {
+    if(archive == NULL || archive_sz < sizeof(azpHeader_t)) {
+        return false;
+    }
+    azpSpan_t span;
+    azp_span_begin(&span);
+    memcpy(header->data, archive, sizeof(azpHeader_t));
+    bool ok = azpHeaderMagic == header->fields.magic;
+    azp_span_end(&span, AZP_PHASE_HEADER, sizeof(azpHeader_t), 0, 0);
+    return ok;
+}
+
+/*
+ *       E X T R A C T I O N    F U N C S
+ */
+
+/*
+ * Positional write of the whole buffer
+ * returns 0 if ok
+ */
+static int azp_pwrite(int fd, const void *data, size_t len, off_t offset) {
+    const uint8_t *p = data;
+    while(len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if(n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static uint32_t azp_read_u32(const uint8_t *data) {
+    return (uint32_t)(data[3] << 24) | (data[2] << 16) | (data[1] << 8) | (data[0]);
+}
+
+/*
+ * Filename character as compared by lookups, both slashes are the same and case is ignored
+ */
+static inline uint8_t azp_name_char(char c) {
+    if(c == '/') {
+        return '\\';
+    }
+    if(c >= 'A' && c <= 'Z') {
+        return c - 'A' + 'a';
+    }
+    return c;
+}
+
+/*
+ * FNV-1a of the normalized filename
+ */
+static uint32_t azp_name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for(; *name != '\0'; ++name) {
+        hash ^= azp_name_char(*name);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool azp_name_equal(const char *a, const char *b) {
+    for(; *a != '\0' && *b != '\0'; ++a, ++b) {
+        if(azp_name_char(*a) != azp_name_char(*b)) {
+            return false;
+        }
+    }
+    return *a == *b;
+}
+
+/*
+ * Number of hash slots for count entries, power of two and at most half full
+ * Counts over AZP_HASH_SLOTS_MAX / 2 can't come from a valid TOC, they get the cap
+ */
+static uint32_t azp_hash_slots(uint32_t count) {
+    size_t slots = 2;
+    while(slots < (size_t)count * 2 && slots < AZP_HASH_SLOTS_MAX) {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+size_t azp_index_size(const azpHeader_t *header) {
+    /* Every entry takes at least 16 bytes of TOC, anything claiming more is broken */
+    if(header->fields.data_offset < sizeof(azpHeader_t)
+       || header->fields.file_count > (header->fields.data_offset - sizeof(azpHeader_t)) / 16) {
+        return 0;
+    }
+    /* offset, compressed size, uncompressed size and name arrays, hash slots, then the filename pool */
+    return (size_t)header->fields.file_count * sizeof(uint32_t) * 4
+           + (size_t)azp_hash_slots(header->fields.file_count) * sizeof(uint32_t)
+           + (header->fields.data_offset - sizeof(azpHeader_t));
+}
+
+/*
+ * Points the index arrays into mem, laid out as azp_index_size describes
+ */
+static void azp_index_layout(azpIndex_t *index, uint32_t count, void *mem) {
+    index->mem = mem;
+    index->count = count;
+    index->offset = mem;
+    index->compressed_size = index->offset + count;
+    index->uncompressed_size = index->compressed_size + count;
+    index->name = index->uncompressed_size + count;
+    index->hash_slots = azp_hash_slots(count);
+    index->hash = index->name + count;
+    index->names = (char*)(index->hash + index->hash_slots);
+}
+
+bool azp_index_decode(azpIndex_t *index, const azpHeader_t *header, const uint8_t *archive, size_t archive_sz, void *mem, size_t mem_sz) {
+    uint32_t count = header->fields.file_count;
+    size_t toc_sz = header->fields.data_offset - sizeof(azpHeader_t);
+    size_t need = azp_index_size(header);
+
+    /* need is 0 if the TOC can't hold count entries */
+    if(archive == NULL || need == 0 || header->fields.data_offset > archive_sz || toc_sz / 16 < count) {
+        return false;
+    }
+    index->owned = false;
+    if(mem == NULL) {
+        mem = malloc(need);
+        if(mem == NULL) {
+            return false;
+        }
+        index->owned = true;
+    } else if(mem_sz < need) {
+        return false;
+    }
+    azpSpan_t span;
+    azp_span_begin(&span);
+    index->map = NULL;
+    index->map_sz = 0;
+    azp_index_layout(index, count, mem);
+
+    /* Decipher the whole TOC region in one go into the filename pool */
+    uint8_t *toc = (uint8_t*)index->names;
+    uint32_t next_key = CIPHER_KEY;
+    azp_cipher(toc, archive + sizeof(azpHeader_t), toc_sz, &next_key);
+
+    /* Then compact the filenames towards the start of the pool,
+     * every record shrinks from 16 + len to len + 1 bytes so writes never pass reads */
+    size_t addr = 0;
+    size_t pool = 0;
+    for(uint32_t i = 0; i < count; ++i) {
+        if(toc_sz - addr < 16) {
+            goto fail;
+        }
+        /* Older azptool versions left junk in the upper bytes, names are never over MAX_FILENAME */
+        uint32_t filename_length = toc[addr];
+        addr += 4;
+        if(toc_sz - addr < (size_t)filename_length + 12) {
+            goto fail;
+        }
+        const uint8_t *fields = toc + addr + filename_length;
+        index->offset[i] = azp_read_u32(fields);
+        index->compressed_size[i] = azp_read_u32(fields + 4);
+        index->uncompressed_size[i] = azp_read_u32(fields + 8);
+
+        memmove(toc + pool, toc + addr, filename_length);
+        index->name[i] = pool;
+        pool += filename_length;
+        toc[pool++] = '\0';
+        addr += filename_length + 12;
+    }
+    index->names_size = pool;
+
+    /* Name lookup table, slots hold entry nr. + 1 and 0 when empty, first of duplicate names wins */
+    memset(index->hash, 0, index->hash_slots * sizeof(uint32_t));
+    for(uint32_t i = 0; i < count; ++i) {
+        const char *name = azp_index_name(index, i);
+        uint32_t slot = azp_name_hash(name) & (index->hash_slots - 1);
+        while(index->hash[slot] != 0 && !azp_name_equal(azp_index_name(index, index->hash[slot] - 1), name)) {
+            slot = (slot + 1) & (index->hash_slots - 1);
+        }
+        if(index->hash[slot] == 0) {
+            index->hash[slot] = i + 1;
+        }
+    }
+    azp_span_end(&span, AZP_PHASE_TOC, toc_sz, pool, count);
+    return true;
+
+fail:
+    azp_index_free(index);
+    return false;
+}
+
+void azp_index_free(azpIndex_t *index) {
+    if(index->owned) {
+        free(index->mem);
+    }
+    if(index->map != NULL) {
+        munmap(index->map, index->map_sz);
+    }
+    index->map = NULL;
+    index->map_sz = 0;
+    index->mem = NULL;
+    index->owned = false;
+    index->count = 0;
+}
+
+uint32_t azp_index_find(const azpIndex_t *index, const char *name) {
+    uint32_t slot = azp_name_hash(name) & (index->hash_slots - 1);
+    while(index->hash[slot] != 0) {
+        uint32_t i = index->hash[slot] - 1;
+        if(azp_name_equal(azp_index_name(index, i), name)) {
+            return i;
+        }
+        slot = (slot + 1) & (index->hash_slots - 1);
+    }
+    return AZP_NOT_FOUND;
+}
+
+bool azp_glob_match(const char *pattern, const char *name) {
+    const char *star = NULL;  // last '*' seen in pattern
+    const char *resume = NULL; // name position to retry from after it
+
+    while(*name != '\0') {
+        if(*pattern == '*') {
+            star = pattern++;
+            resume = name;
+        } else if(*pattern != '\0' && (*pattern == '?' || azp_name_char(*pattern) == azp_name_char(*name))) {
+            ++pattern;
+            ++name;
+        } else if(star != NULL) {
+            /* Let the last star eat one more character and retry */
+            pattern = star + 1;
+            name = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while(*pattern == '*') {
+        ++pattern;
+    }
+    return *pattern == '\0';
+}
+
+/*
+ *       I N D E X    C A C H E
+ */
+
+#define AZP_INDEX_FILE_MAGIC 0x49505A41 // { 'A' , 'Z' , 'P' , 'I' }
+#define AZP_INDEX_FILE_VERSION 1
+
+/*
+ * Sidecar index file header, followed by the index block
+ */
+typedef struct azpIndexFile_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_crc;   // crc32 of the archive header
+    uint32_t count;
+    uint64_t archive_size;
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    uint64_t block_size;   // bytes of index block that follow
+} azpIndexFile_t;
+
+/*
+ * Fills in what identifies the archive the index was made from
+ * returns true if ok
+ */
+static bool azp_index_file_key(azpIndexFile_t *key, const azpHeader_t *header, int archive_fd) {
+    struct stat st;
+    if(fstat(archive_fd, &st) != 0) {
+        return false;
+    }
+    memset(key, 0, sizeof(azpIndexFile_t));
+    key->magic = AZP_INDEX_FILE_MAGIC;
+    key->version = AZP_INDEX_FILE_VERSION;
+    key->header_crc = crc32(0L, (const Bytef*)header->data, sizeof(azpHeader_t));
+    key->count = header->fields.file_count;
+    key->archive_size = st.st_size;
+    key->archive_mtime_sec = st.st_mtim.tv_sec;
+    key->archive_mtime_nsec = st.st_mtim.tv_nsec;
+    return true;
+}
+
+/*
+ * Checks that a loaded index only points inside itself
+ * Every name must start in the pool, which ends with a NUL, and the hash may only
+ * hold entry nrs. with at least one empty slot left so lookups end
+ * returns false if the sidecar is damaged
+ */
+static bool azp_index_check(const azpIndex_t *index) {
+    for(uint32_t i = 0; i < index->count; ++i) {
+        if(index->name[i] >= index->names_size) {
+            return false;
+        }
+    }
+    uint32_t used = 0;
+    for(uint32_t slot = 0; slot < index->hash_slots; ++slot) {
+        if(index->hash[slot] > index->count) {
+            return false;
+        }
+        used += index->hash[slot] != 0;
+    }
+    return used <= index->count && used < index->hash_slots;
+}
+
+bool azp_index_load(azpIndex_t *index, const char *idx_path, const azpHeader_t *header, int archive_fd) {
+    azpIndexFile_t key;
+    if(azp_index_size(header) == 0 || !azp_index_file_key(&key, header, archive_fd)) {
+        return false;
+    }
+    azpSpan_t span;
+    azp_span_begin(&span);
+    int fd = open(idx_path, O_RDONLY);
+    if(fd == -1) {
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(azpIndexFile_t)) {
+        close(fd);
+        return false;
+    }
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        return false;
+    }
+
+    /* Stale or foreign sidecar, the caller decodes the TOC again */
+    azpIndexFile_t *stored = (azpIndexFile_t*)map;
+    key.block_size = stored->block_size;
+    size_t arrays_sz = ((size_t)key.count * 4 + azp_hash_slots(key.count)) * sizeof(uint32_t);
+    if(memcmp(&key, stored, sizeof(azpIndexFile_t)) != 0
+       || stored->block_size != st.st_size - sizeof(azpIndexFile_t)
+       || stored->block_size > azp_index_size(header)
+       || stored->block_size < arrays_sz
+       || (stored->block_size > arrays_sz && map[st.st_size - 1] != '\0')) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    azp_index_layout(index, stored->count, map + sizeof(azpIndexFile_t));
+    index->names_size = (uint8_t*)(map + st.st_size) - (uint8_t*)index->names;
+    if(!azp_index_check(index)) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    index->owned = false;
+    index->map = map;
+    index->map_sz = st.st_size;
+    azp_span_end(&span, AZP_PHASE_TOC, st.st_size, 0, stored->count);
+    return true;
+}
+
+bool azp_index_save(const azpIndex_t *index, const char *idx_path, const azpHeader_t *header, int archive_fd) {
+    azpIndexFile_t key;
+    if(!azp_index_file_key(&key, header, archive_fd)) {
+        return false;
+    }
+    key.block_size = ((uint8_t*)index->names - (uint8_t*)index->mem) + index->names_size;
+
+    /* Write next to it and rename over, so concurrent readers never see half a file */
+    size_t tmp_sz = strlen(idx_path) + 32;
+    char *tmp_path = malloc(tmp_sz);
+    if(tmp_path == NULL) {
+        return false;
+    }
+    snprintf(tmp_path, tmp_sz, "%s.%ld.tmp", idx_path, (long)getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        free(tmp_path);
+        return false;
+    }
+    bool ok = azp_pwrite(fd, &key, sizeof(azpIndexFile_t), 0) == 0
+              && azp_pwrite(fd, index->mem, key.block_size, sizeof(azpIndexFile_t)) == 0;
+    if(close(fd) != 0) {
+        ok = false;
+    }
+    if(ok && rename(tmp_path, idx_path) != 0) {
+        ok = false;
+    }
+    if(!ok) {
+        remove(tmp_path);
+    }
+    free(tmp_path);
+    return ok;
+}
+
+/*
+ * Shared state of extraction workers
+ * Jobs below big are single entries, the rest are batches of small entries
+ */
+typedef struct azpExtractJob_t {
+    pthread_mutex_t lock; // guards error output
+    const azpIndex_t *index;
+    const uint8_t *archive;
+    size_t archive_sz;
+    azpOutDir_t *out;
+    uint32_t *order;       // entries, biggest first
+    uint32_t big;          // entries extracted one by one
+    uint32_t total;
+    azpProgress_t *progress;
+} azpExtractJob_t;
+
+/*
+ * Work order entry, sorted largest first
+ */
+typedef struct azpWorkItem_t {
+    size_t size;
+    uint32_t index;
+} azpWorkItem_t;
+
+static int azp_work_cmp(const void *a, const void *b) {
+    const azpWorkItem_t *wa = a;
+    const azpWorkItem_t *wb = b;
+    if(wa->size != wb->size) {
+        return wa->size < wb->size ? 1 : -1;
+    }
+    /* Keep TOC order between equal sizes */
+    return wa->index < wb->index ? -1 : (wa->index > wb->index);
+}
+
+static void azp_extract_report(azpExtractJob_t *job, uint32_t index, int ret) {
+    if(ret != 0) {
+        pthread_mutex_lock(&job->lock);
+        fprintf(stderr, "Error extracting file %s (%d)\n", azp_index_name(job->index, index), ret);
+        pthread_mutex_unlock(&job->lock);
+        return;
+    }
+    azp_progress_step(job->progress, azp_index_name(job->index, index), job->index->uncompressed_size[index]);
+}
+
+/*
+ * Extracts one entry into its output file
+ * returns 0 if ok, zlib errors if not
+ */
+static int azp_extract_one(const azpOutDir_t *out, const azpIndex_t *idx, uint32_t index, const uint8_t *archive, size_t archive_sz) {
+    azpSpan_t span;
+    azp_span_begin(&span);
+    int outfd = azp_outdir_create(out, index);
+    azp_span_end(&span, AZP_PHASE_FILES, 0, 0, 1);
+    if(outfd == -1) {
+        return -1;
+    }
+    int ret = azp_write_entry(outfd, idx, index, archive, archive_sz);
+    azp_span_begin(&span);
+    if(close(outfd) != 0 && ret == Z_OK) {
+        ret = Z_ERRNO;
+    }
+    azp_span_end(&span, AZP_PHASE_FILES, 0, 0, 0);
+    return ret;
+}
+
+/*
+ * Inflates a batch of small entries into memory and hands them to the output in one go
+ * returns 0 if all ok, otherwise the first error
+ */
+static int azp_extract_batch(azpExtractJob_t *job, const uint32_t *entries, uint32_t count) {
+    const azpIndex_t *idx = job->index;
+    uint32_t *ready = malloc(count * sizeof(uint32_t));
+    uint8_t **data = calloc(count, sizeof(uint8_t*));
+    int *results = malloc(count * sizeof(int));
+    if(ready == NULL || data == NULL || results == NULL) {
+        free(ready);
+        free(data);
+        free(results);
+        return Z_MEM_ERROR;
+    }
+
+    int error = 0;
+    uint32_t ready_count = 0;
+    for(uint32_t i = 0; i < count; ++i) {
+        uint32_t index = entries[i];
+        int ret = Z_DATA_ERROR;
+        if((size_t)idx->offset[index] + idx->compressed_size[index] <= job->archive_sz) {
+            data[ready_count] = malloc(idx->uncompressed_size[index] + 1);
+            ret = data[ready_count] == NULL ? Z_MEM_ERROR
+                : azp_codec_inflate(data[ready_count], idx->uncompressed_size[index], job->archive + idx->offset[index], idx->compressed_size[index]);
+        }
+        if(ret != Z_OK) {
+            free(data[ready_count]);
+            data[ready_count] = NULL;
+            azp_extract_report(job, index, ret);
+            error = error != 0 ? error : ret;
+            continue;
+        }
+        ready[ready_count++] = index;
+    }
+
+    if(ready_count > 0) {
+        azpSpan_t span;
+        azp_span_begin(&span);
+        azp_outdir_write(job->out, ready, ready_count, data, results);
+        uint64_t bytes = 0;
+        for(uint32_t i = 0; i < ready_count; ++i) {
+            bytes += idx->uncompressed_size[ready[i]];
+        }
+        azp_span_end(&span, AZP_PHASE_FILES, bytes, bytes, ready_count);
+    }
+    for(uint32_t i = 0; i < ready_count; ++i) {
+        azp_extract_report(job, ready[i], results[i] == 0 ? 0 : Z_ERRNO);
+        if(results[i] != 0 && error == 0) {
+            error = Z_ERRNO;
+        }
+        free(data[i]);
+    }
+    free(ready);
+    free(data);
+    free(results);
+    return error;
+}
+
+static int azp_extract_job(void *ctx, uint32_t job_nr) {
+    azpExtractJob_t *job = ctx;
+    if(job_nr < job->big) {
+        uint32_t index = job->order[job_nr];
+        int ret = azp_extract_one(job->out, job->index, index, job->archive, job->archive_sz);
+        azp_extract_report(job, index, ret);
+        return ret;
+    }
+
+    uint32_t first = job->big + (job_nr - job->big) * AZP_BATCH;
+    uint32_t count = job->total - first < AZP_BATCH ? job->total - first : AZP_BATCH;
+    return azp_extract_batch(job, job->order + first, count);
+}
+
+/*
+ * Orders the listed entries biggest first and creates their directories
+ * root - directory to extract into, NULL for the current one
+ * list - entry numbers, NULL for all entries
+ * count - number of entries in list
+ * returns number of pool jobs, -1 on error
+ */
+static int64_t azp_extract_prepare(azpExtractJob_t *job, const char *root, const azpIndex_t *index, const uint32_t *list, uint32_t count,
+                                   const uint8_t *archive, size_t archive_sz, azpProgress_t *progress) {
+    /* Hand out the biggest entries first so one of them does not end up as the long tail */
+    azpWorkItem_t *items = malloc((count + 1) * sizeof(azpWorkItem_t));
+    uint32_t *order = malloc((count + 1) * sizeof(uint32_t));
+    if(items == NULL || order == NULL) {
+        free(items);
+        free(order);
+        return -1;
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        items[i].index = list != NULL ? list[i] : i;
+        items[i].size = index->uncompressed_size[items[i].index];
+    }
+    qsort(items, count, sizeof(azpWorkItem_t), azp_work_cmp);
+    uint32_t big = 0;
+    for(uint32_t i = 0; i < count; ++i) {
+        order[i] = items[i].index;
+        big += items[i].size > AZP_BATCH_FILE_MAX;
+    }
+    free(items);
+
+    /* All directories made up front */
+    azpSpan_t span;
+    azp_span_begin(&span);
+    azpOutDir_t *out = azp_outdir_open(root, index, list, count);
+    azp_span_end(&span, AZP_PHASE_FILES, 0, 0, 0);
+    if(out == NULL) {
+        free(order);
+        return -1;
+    }
+
+    job->index = index;
+    job->archive = archive;
+    job->archive_sz = archive_sz;
+    job->out = out;
+    job->order = order;
+    job->big = big;
+    job->total = count;
+    job->progress = progress;
+    if(pthread_mutex_init(&job->lock, NULL) != 0) {
+        azp_outdir_close(out);
+        free(order);
+        return -1;
+    }
+    return big + (count - big + AZP_BATCH - 1) / AZP_BATCH;
+}
+
+static void azp_extract_finish(azpExtractJob_t *job) {
+    pthread_mutex_destroy(&job->lock);
+    azp_outdir_close(job->out);
+    free(job->order);
+}
+
+/*
+ * Extracts the listed entries on the worker pool, biggest first
+ * root - directory to extract into, NULL for the current one
+ * list - entry numbers, NULL for all entries
+ * count - number of entries in list
+ */
+static bool azp_extract_list(const char *root, const azpIndex_t *index, const uint32_t *list, uint32_t count, const uint8_t *archive, size_t archive_sz, unsigned threads) {
+    if(count == 0) {
+        return true;
+    }
+
+    azpExtractJob_t job;
+    azpProgress_t progress;
+    int64_t jobs = azp_extract_prepare(&job, root, index, list, count, archive, archive_sz, &progress);
+    if(jobs < 0) {
+        return false;
+    }
+    azp_progress_start(&progress, "Extracted", count);
+    int ret = azp_pool_run(threads, NULL, jobs, azp_extract_job, &job);
+    azp_progress_end(&progress);
+    azp_extract_finish(&job);
+    return ret == 0;
+}
+
+bool azp_extract_all(const azpIndex_t *index, const uint8_t *archive, size_t archive_sz, unsigned threads) {
+    return azp_extract_list(NULL, index, NULL, index->count, archive, archive_sz, threads);
+}
+
+uint32_t *azp_index_select(const azpIndex_t *index, char **patterns, size_t pattern_count, uint32_t *count, bool *matched) {
+    /* + 1 so an empty archive does not look like a failed allocation */
+    bool *selected = calloc(index->count + 1, sizeof(bool));
+    uint32_t *list = malloc((index->count + 1) * sizeof(uint32_t));
+    if(selected == NULL || list == NULL) {
+        free(selected);
+        free(list);
+        return NULL;
+    }
+
+    *count = 0;
+    for(size_t p = 0; p < pattern_count; ++p) {
+        bool found = false;
+        if(strpbrk(patterns[p], "*?") == NULL) {
+            /* Plain name, straight from the hash table */
+            uint32_t i = azp_index_find(index, patterns[p]);
+            if(i != AZP_NOT_FOUND) {
+                found = true;
+                if(!selected[i]) {
+                    selected[i] = true;
+                    list[(*count)++] = i;
+                }
+            }
+        } else {
+            for(uint32_t i = 0; i < index->count; ++i) {
+                if(azp_glob_match(patterns[p], azp_index_name(index, i))) {
+                    found = true;
+                    if(!selected[i]) {
+                        selected[i] = true;
+                        list[(*count)++] = i;
+                    }
+                }
+            }
+        }
+        if(matched != NULL) {
+            matched[p] = found;
+        }
+    }
+    free(selected);
+    return list;
+}
+
+bool azp_extract_matching(const azpIndex_t *index, char **patterns, size_t pattern_count, const uint8_t *archive, size_t archive_sz, unsigned threads,
+                          bool *matched) {
+    uint32_t count;
+    uint32_t *list = azp_index_select(index, patterns, pattern_count, &count, matched);
+    if(list == NULL) {
+        return false;
+    }
+    bool ok = true;
+    for(size_t p = 0; matched != NULL && p < pattern_count; ++p) {
+        ok = ok && matched[p];
+    }
+    if(!azp_extract_list(NULL, index, list, count, archive, archive_sz, threads)) {
+        ok = false;
+    }
+    free(list);
+    return ok;
+}
+
+/*
+ * What the last update knew about an entry and the file it was written to
+ */
+typedef struct azpUpdateRecord_t {
+    uint8_t digest[AZP_SHA256_SIZE]; // SHA-256 of the compressed entry the file matched
+    uint32_t offset;                 // where that entry was in the archive
+    uint32_t compressed_size;
+    uint64_t size;                   // file size, times and inode when it matched
+    int64_t mtime;                   // ns
+    int64_t ctime;                   // ns, can't be set back like mtime
+    uint64_t inode;
+    bool valid;
+} azpUpdateRecord_t;
+
+/*
+ * What an archive looked like when its records were written
+ * An archive with the same path, size, mtime and header was not rewritten, so its
+ * entries are still where the records say
+ */
+typedef struct azpUpdateSource_t {
+    uint64_t size;
+    int64_t mtime;     // ns
+    uint32_t header_crc;
+} azpUpdateSource_t;
+
+/*
+ * State file of the previous updates into a directory
+ * The file has a section per archive, an "archive SIZE MTIME HEADER_CRC PATH" line
+ * followed by its records. Only the records of this archive are loaded, the lines of
+ * the other sections are written back as they were
+ */
+typedef struct azpUpdateState_t {
+    char *path;               // resolved path of this archive, names its section
+    azpUpdateSource_t source; // the archive as it is now
+    bool same_source;         // its section was written for the archive as it is now
+    azpUpdateRecord_t *records;
+    char **names;
+    uint32_t count;
+    uint32_t *hash;           // open addressed, record nr. + 1, 0 if empty
+    uint32_t hash_slots;
+    char **other;             // lines of the other archives' sections
+    size_t other_count;
+} azpUpdateState_t;
+
+/*
+ * Shared state of the workers checking files against the archive
+ */
+typedef struct azpUpdateJob_t {
+    const azpIndex_t *index;
+    const uint8_t *archive;
+    size_t archive_sz;
+    int root_fd;
+    const azpUpdateState_t *state;
+    azpUpdateRecord_t *records; // per entry, digest always set, valid if the file is up to date
+} azpUpdateJob_t;
+
+static int64_t azp_mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static int64_t azp_ctime_ns(const struct stat *st) {
+    return (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+}
+
+/*
+ * Fills in what a file looked like when it matched its entry
+ */
+static void azp_update_record_stat(azpUpdateRecord_t *record, const struct stat *st) {
+    record->size = st->st_size;
+    record->mtime = azp_mtime_ns(st);
+    record->ctime = azp_ctime_ns(st);
+    record->inode = st->st_ino;
+    record->valid = true;
+}
+
+/*
+ * A file is untouched since it matched if its size, both times and inode are the same
+ */
+static bool azp_update_record_current(const azpUpdateRecord_t *record, const struct stat *st) {
+    return record->size == (uint64_t)st->st_size && record->mtime == azp_mtime_ns(st)
+           && record->ctime == azp_ctime_ns(st) && record->inode == (uint64_t)st->st_ino;
+}
+
+static void azp_update_state_free(azpUpdateState_t *state) {
+    for(uint32_t i = 0; i < state->count; ++i) {
+        free(state->names[i]);
+    }
+    for(size_t i = 0; i < state->other_count; ++i) {
+        free(state->other[i]);
+    }
+    free(state->path);
+    free(state->names);
+    free(state->records);
+    free(state->hash);
+    free(state->other);
+}
+
+static bool azp_update_add_other(azpUpdateState_t *state, const char *line, size_t *cap) {
+    if(state->other_count == *cap) {
+        *cap = *cap == 0 ? 64 : *cap * 2;
+        char **other = realloc(state->other, *cap * sizeof(char*));
+        if(other == NULL) {
+            return false;
+        }
+        state->other = other;
+    }
+    state->other[state->other_count] = strdup(line);
+    return state->other[state->other_count++] != NULL;
+}
+
+static bool azp_update_add_record(azpUpdateState_t *state, const azpUpdateRecord_t *record, const char *name, uint32_t *cap) {
+    if(state->count == UINT32_MAX) {
+        return false;
+    }
+    if(state->count == *cap) {
+        *cap = *cap == 0 ? 1024 : *cap * 2;
+        azpUpdateRecord_t *records = realloc(state->records, *cap * sizeof(azpUpdateRecord_t));
+        char **names = realloc(state->names, *cap * sizeof(char*));
+        if(records != NULL) {
+            state->records = records;
+        }
+        if(names != NULL) {
+            state->names = names;
+        }
+        if(records == NULL || names == NULL) {
+            return false;
+        }
+    }
+    state->names[state->count] = strdup(name);
+    if(state->names[state->count] == NULL) {
+        return false;
+    }
+    state->records[state->count++] = *record;
+    return true;
+}
+
+/*
+ * Parses "SHA256 OFFSET CSIZE SIZE MTIME CTIME INODE NAME"
+ * returns the name or NULL if the line is not a record
+ */
+static const char *azp_update_parse_record(const char *line, azpUpdateRecord_t *record) {
+    for(int i = 0; i < AZP_SHA256_SIZE; ++i) {
+        unsigned byte;
+        if(sscanf(line + i * 2, "%2x", &byte) != 1) {
+            return NULL;
+        }
+        record->digest[i] = byte;
+    }
+    char *end = (char*)line + AZP_SHA256_SIZE * 2;
+    if(*end != ' ') {
+        return NULL;
+    }
+    unsigned long long offset = strtoull(end, &end, 10);
+    unsigned long long compressed_size = strtoull(end, &end, 10);
+    record->size = strtoull(end, &end, 10);
+    record->mtime = strtoll(end, &end, 10);
+    record->ctime = strtoll(end, &end, 10);
+    record->inode = strtoull(end, &end, 10);
+    if(*end != ' ' || end[1] == '\0' || offset > UINT32_MAX || compressed_size > UINT32_MAX) {
+        return NULL;
+    }
+    record->offset = offset;
+    record->compressed_size = compressed_size;
+    record->valid = true;
+    return end + 1;
+}
+
+/*
+ * Reads the sections of a state file, the one of this archive into records and the
+ * others as lines
+ * others_only - skip the records of this archive
+ * returns false if out of memory
+ */
+static bool azp_update_state_read(azpUpdateState_t *state, FILE *file, bool others_only) {
+    bool ok = true;
+    bool section = false;
+    bool ours = false;
+    size_t other_cap = 0;
+    uint32_t cap = 0;
+    char *line = NULL;
+    size_t line_sz = 0;
+    ssize_t len;
+    while(ok && (len = getline(&line, &line_sz, file)) != -1) {
+        while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if(strncmp(line, "archive ", 8) == 0) {
+            azpUpdateSource_t last;
+            char *end;
+            last.size = strtoull(line + 8, &end, 10);
+            last.mtime = strtoll(end, &end, 10);
+            last.header_crc = strtoul(end, &end, 16);
+            section = true;
+            ours = *end == ' ' && strcmp(end + 1, state->path) == 0;
+            if(ours) {
+                state->same_source = last.size == state->source.size && last.mtime == state->source.mtime
+                                     && last.header_crc == state->source.header_crc;
+                continue;
+            }
+        }
+        if(!ours) {
+            /* Lines before the first section are from an older format and dropped */
+            if(section) {
+                ok = azp_update_add_other(state, line, &other_cap);
+            }
+            continue;
+        }
+        azpUpdateRecord_t record;
+        const char *name = others_only ? NULL : azp_update_parse_record(line, &record);
+        if(name != NULL) {
+            ok = azp_update_add_record(state, &record, name, &cap);
+        }
+    }
+    free(line);
+    return ok;
+}
+
+/*
+ * Reads the state file of a directory and picks out the section of an archive
+ * A missing or unreadable file leaves the state empty, everything is then checked by content
+ * returns false if out of memory
+ */
+static bool azp_update_state_load(azpUpdateState_t *state, int root_fd, const char *archive_path, const azpUpdateSource_t *source) {
+    memset(state, 0, sizeof(azpUpdateState_t));
+    state->source = *source;
+    state->path = realpath(archive_path, NULL);
+    if(state->path == NULL) {
+        state->path = strdup(archive_path);
+    }
+    if(state->path == NULL) {
+        return false;
+    }
+
+    int fd = openat(root_fd, AZP_UPDATE_STATE, O_RDONLY | O_CLOEXEC);
+    FILE *file = fd != -1 ? fdopen(fd, "r") : NULL;
+    if(file == NULL) {
+        if(fd != -1) {
+            close(fd);
+        }
+        return true;
+    }
+    bool ok = azp_update_state_read(state, file, false);
+    fclose(file);
+    if(!ok) {
+        return false;
+    }
+
+    state->hash_slots = azp_hash_slots(state->count);
+    state->hash = calloc(state->hash_slots, sizeof(uint32_t));
+    if(state->hash == NULL) {
+        return false;
+    }
+    for(uint32_t i = 0; i < state->count; ++i) {
+        uint32_t slot = azp_name_hash(state->names[i]) & (state->hash_slots - 1);
+        while(state->hash[slot] != 0) {
+            slot = (slot + 1) & (state->hash_slots - 1);
+        }
+        state->hash[slot] = i + 1;
+    }
+    return true;
+}
+
+static const azpUpdateRecord_t *azp_update_state_find(const azpUpdateState_t *state, const char *name) {
+    if(state->hash == NULL) {
+        return NULL;
+    }
+    uint32_t slot = azp_name_hash(name) & (state->hash_slots - 1);
+    while(state->hash[slot] != 0) {
+        uint32_t i = state->hash[slot] - 1;
+        if(azp_name_equal(state->names[i], name)) {
+            return &state->records[i];
+        }
+        slot = (slot + 1) & (state->hash_slots - 1);
+    }
+    return NULL;
+}
+
+/*
+ * Opens the state file of a directory, creating it if needed, and locks it. The file is
+ * replaced by rename, a lock that was taken on one replaced meanwhile is taken again
+ * returns the locked fd, -1 on error
+ */
+static int azp_update_state_lock(int root_fd) {
+    for(;;) {
+        int fd = openat(root_fd, AZP_UPDATE_STATE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if(fd == -1) {
+            return -1;
+        }
+        struct stat locked;
+        struct stat current;
+        if(flock(fd, LOCK_EX) != 0 || fstat(fd, &locked) != 0) {
+            close(fd);
+            return -1;
+        }
+        if(fstatat(root_fd, AZP_UPDATE_STATE, &current, 0) == 0 && current.st_dev == locked.st_dev && current.st_ino == locked.st_ino) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+/*
+ * Writes the other archives' sections and a new one for this archive with the records
+ * of its entries, through a temporary file renamed into place. The other sections are
+ * read again under a lock on the state file, so concurrent runs for other archives
+ * into the same directory keep theirs.
+ * returns false on error
+ */
+static bool azp_update_state_save(azpUpdateState_t *state, int root_fd, const azpIndex_t *index, const azpUpdateRecord_t *records) {
+    int lock_fd = azp_update_state_lock(root_fd);
+    if(lock_fd == -1) {
+        return false;
+    }
+    for(size_t i = 0; i < state->other_count; ++i) {
+        free(state->other[i]);
+    }
+    state->other_count = 0;
+    int read_fd = dup(lock_fd);
+    FILE *current = read_fd != -1 ? fdopen(read_fd, "r") : NULL;
+    bool read = current != NULL && azp_update_state_read(state, current, true);
+    if(current != NULL) {
+        fclose(current);
+    } else if(read_fd != -1) {
+        close(read_fd);
+    }
+    if(!read) {
+        close(lock_fd);
+        return false;
+    }
+
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "%s.%ld", AZP_UPDATE_STATE, (long)getpid());
+    int fd = openat(root_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    FILE *file = fd != -1 ? fdopen(fd, "w") : NULL;
+    if(file == NULL) {
+        if(fd != -1) {
+            close(fd);
+            unlinkat(root_fd, tmp, 0);
+        }
+        close(lock_fd);
+        return false;
+    }
+    for(size_t i = 0; i < state->other_count; ++i) {
+        fprintf(file, "%s\n", state->other[i]);
+    }
+    /* A path with a line break could not be read back, its records are not kept */
+    if(strchr(state->path, '\n') == NULL) {
+        fprintf(file, "archive %llu %lld %08x %s\n", (unsigned long long)state->source.size, (long long)state->source.mtime,
+                state->source.header_crc, state->path);
+        for(uint32_t i = 0; i < index->count; ++i) {
+            const char *name = azp_index_name(index, i);
+            if(!records[i].valid || strchr(name, '\n') != NULL) {
+                continue;
+            }
+            for(int j = 0; j < AZP_SHA256_SIZE; ++j) {
+                fprintf(file, "%02x", records[i].digest[j]);
+            }
+            fprintf(file, " %u %u %llu %lld %lld %llu %s\n", records[i].offset, records[i].compressed_size,
+                    (unsigned long long)records[i].size, (long long)records[i].mtime, (long long)records[i].ctime,
+                    (unsigned long long)records[i].inode, name);
+        }
+    }
+    bool ok = !ferror(file);
+    if(fclose(file) != 0) {
+        ok = false;
+    }
+    if(ok && renameat(root_fd, tmp, root_fd, AZP_UPDATE_STATE) != 0) {
+        ok = false;
+    }
+    if(!ok) {
+        unlinkat(root_fd, tmp, 0);
+    }
+    /* Closing drops the lock, after the rename */
+    close(lock_fd);
+    return ok;
+}
+
+/*
+ * Path of an entry relative to the output directory
+ * returns malloc()'d path or NULL if the name is one extraction refuses
+ */
+static char *azp_update_path(const char *name) {
+    char *path = strdup(name);
+    if(path == NULL) {
+        return NULL;
+    }
+    char *part = path;
+    for(char *c = path;; ++c) {
+        bool end = *c == '\0';
+        if(end || *c == '\\' || *c == '/') {
+            size_t len = c - part;
+            if(len == 0 || (len == 1 && part[0] == '.') || (len == 2 && part[0] == '.' && part[1] == '.')) {
+                free(path);
+                return NULL;
+            }
+            if(end) {
+                break;
+            }
+            *c = '/';
+            part = c + 1;
+        }
+    }
+    return path;
+}
+
+/*
+ * adler32 of a file's contents
+ * returns false if it can't be read or its size changed
+ */
+static bool azp_update_file_adler(int fd, uint64_t size, uint32_t *adler) {
+    uint8_t *block = malloc(AZP_HASH_BLOCK);
+    uLong sum = adler32(0L, Z_NULL, 0);
+    uint64_t total = 0;
+    ssize_t n = 0;
+    azpSpan_t span;
+    azp_span_begin(&span);
+    while(block != NULL && (n = pread(fd, block, AZP_HASH_BLOCK, total)) > 0) {
+        sum = adler32(sum, block, n);
+        total += n;
+    }
+    azp_span_end(&span, AZP_PHASE_READ, total, 0, 1);
+    free(block);
+    *adler = sum;
+    return block != NULL && n == 0 && total == size;
+}
+
+/*
+ * adler32 of an entry's contents from the end of its zlib stream, nothing is inflated
+ */
+static uint32_t azp_entry_adler(const uint8_t *blob, size_t blob_sz) {
+    const uint8_t *trailer = blob + blob_sz - 4;
+    return (uint32_t)trailer[0] << 24 | (uint32_t)trailer[1] << 16 | (uint32_t)trailer[2] << 8 | trailer[3];
+}
+
+/*
+ * Inflates an entry and compares it with a file, for when the sums match
+ * returns true if the file holds exactly the entry's contents
+ */
+static bool azp_update_same_content(int fd, const uint8_t *blob, size_t blob_sz, uint64_t size) {
+    uint8_t *out = malloc(AZP_TEST_CHUNK);
+    uint8_t *file = malloc(AZP_TEST_CHUNK);
+    z_stream strm = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL, .next_in = (Bytef*)blob, .avail_in = blob_sz };
+    if(out == NULL || file == NULL || inflateInit(&strm) != Z_OK) {
+        free(out);
+        free(file);
+        return false;
+    }
+
+    bool same = true;
+    uint64_t pos = 0;
+    int ret = Z_OK;
+    while(same && ret == Z_OK) {
+        strm.next_out = out;
+        strm.avail_out = AZP_TEST_CHUNK;
+        ret = inflate(&strm, Z_NO_FLUSH);
+        size_t have = AZP_TEST_CHUNK - strm.avail_out;
+        if(ret != Z_OK && ret != Z_STREAM_END) {
+            same = false;
+            break;
+        }
+        for(size_t done = 0; same && done < have;) {
+            ssize_t n = pread(fd, file + done, have - done, pos + done);
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            same = n > 0;
+            done += n > 0 ? n : 0;
+        }
+        same = same && memcmp(out, file, have) == 0;
+        pos += have;
+    }
+    /* The file must end where the entry does */
+    same = same && ret == Z_STREAM_END && pos == size && pread(fd, file, 1, pos) == 0;
+    inflateEnd(&strm);
+    free(out);
+    free(file);
+    return same;
+}
+
+static int azp_update_job(void *ctx, uint32_t index) {
+    azpUpdateJob_t *job = ctx;
+    const azpIndex_t *idx = job->index;
+    azpUpdateRecord_t *record = &job->records[index];
+    record->valid = false;
+    record->offset = idx->offset[index];
+    record->compressed_size = idx->compressed_size[index];
+
+    size_t end = (size_t)idx->offset[index] + idx->compressed_size[index];
+    if(idx->compressed_size[index] < 6 || end > job->archive_sz) {
+        return 0;
+    }
+    const uint8_t *blob = job->archive + idx->offset[index];
+    size_t blob_sz = idx->compressed_size[index];
+    bool digested = false;
+
+    const char *name = azp_index_name(idx, index);
+    char *path = azp_update_path(name);
+    int fd = path != NULL ? openat(job->root_fd, path, O_RDONLY | O_CLOEXEC) : -1;
+    free(path);
+    struct stat st;
+    bool current = false;
+    if(fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size == idx->uncompressed_size[index]) {
+        /*
+         * Untouched since it matched an entry, the entry is the same if it still is where
+         * it was in an unchanged archive or has the same digest
+         */
+        const azpUpdateRecord_t *last = azp_update_state_find(job->state, name);
+        if(last != NULL && azp_update_record_current(last, &st)) {
+            if(job->state->same_source && last->offset == record->offset && last->compressed_size == record->compressed_size) {
+                memcpy(record->digest, last->digest, AZP_SHA256_SIZE);
+                digested = true;
+                current = true;
+            } else {
+                azpSha256_t sha;
+                azp_sha256_init(&sha);
+                azp_sha256_update(&sha, blob, blob_sz);
+                azp_sha256_final(&sha, record->digest);
+                digested = true;
+                current = memcmp(record->digest, last->digest, AZP_SHA256_SIZE) == 0;
+            }
+        }
+
+        /* The sum only rules files out, a match is confirmed by inflating */
+        uint32_t file_adler;
+        if(!current && azp_update_file_adler(fd, st.st_size, &file_adler) && file_adler == azp_entry_adler(blob, blob_sz)) {
+            current = azp_update_same_content(fd, blob, blob_sz, st.st_size);
+        }
+        if(current) {
+            azp_update_record_stat(record, &st);
+        }
+    }
+    if(fd != -1) {
+        close(fd);
+    }
+
+    /* Stale entries get their digest now too, they are recorded once extracted */
+    if(!digested) {
+        azpSha256_t sha;
+        azp_sha256_init(&sha);
+        azp_sha256_update(&sha, blob, blob_sz);
+        azp_sha256_final(&sha, record->digest);
+    }
+    return 0;
+}
+
+bool azp_extract_update(const azpArchive_t *archive, const char *archive_path, const char *root, unsigned threads, uint32_t *up_to_date) {
+    const azpIndex_t *index = azp_archive_index(archive);
+    size_t archive_sz;
+    const uint8_t *data = azp_archive_data(archive, &archive_sz);
+    *up_to_date = 0;
+
+    struct stat archive_st;
+    if(fstat(azp_archive_fd(archive), &archive_st) != 0) {
+        perror("Error reading archive");
+        return false;
+    }
+    azpUpdateSource_t source = {
+        .size = archive_st.st_size,
+        .mtime = azp_mtime_ns(&archive_st),
+        .header_crc = crc32(0L, (const Bytef*)azp_archive_header(archive)->data, sizeof(azpHeader_t))
+    };
+
+    /* The directory may not exist yet, then nothing in it is up to date */
+    int root_fd = open(root != NULL ? root : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    azpUpdateState_t state;
+    if(!azp_update_state_load(&state, root_fd, archive_path, &source)) {
+        perror("Error loading update state");
+        azp_update_state_free(&state);
+        if(root_fd != -1) {
+            close(root_fd);
+        }
+        return false;
+    }
+    azpUpdateRecord_t *records = calloc(index->count + 1, sizeof(azpUpdateRecord_t));
+    uint32_t *list = malloc((index->count + 1) * sizeof(uint32_t));
+    if(records == NULL || list == NULL) {
+        perror("Error allocating update list");
+        free(records);
+        free(list);
+        azp_update_state_free(&state);
+        if(root_fd != -1) {
+            close(root_fd);
+        }
+        return false;
+    }
+
+    azpUpdateJob_t job = {
+        .index = index,
+        .archive = data,
+        .archive_sz = archive_sz,
+        .root_fd = root_fd,
+        .state = &state,
+        .records = records
+    };
+    (void)azp_pool_run(threads, NULL, index->count, azp_update_job, &job);
+    uint32_t count = 0;
+    for(uint32_t i = 0; i < index->count; ++i) {
+        if(!records[i].valid) {
+            list[count++] = i;
+        }
+    }
+    *up_to_date = index->count - count;
+
+    bool ok = azp_extract_list(root, index, list, count, data, archive_sz, threads);
+    if(root_fd == -1) {
+        root_fd = open(root != NULL ? root : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    /*
+     * Written files go into the state with the digest of their entry, after a failed
+     * extraction they are all compared again next time
+     */
+    for(uint32_t i = 0; ok && root_fd != -1 && i < count; ++i) {
+        uint32_t entry = list[i];
+        char *path = azp_update_path(azp_index_name(index, entry));
+        struct stat st;
+        if(path != NULL && fstatat(root_fd, path, &st, 0) == 0 && (uint64_t)st.st_size == index->uncompressed_size[entry]) {
+            azp_update_record_stat(&records[entry], &st);
+        }
+        free(path);
+    }
+    if(root_fd == -1 || !azp_update_state_save(&state, root_fd, index, records)) {
+        fprintf(stderr, "Error writing %s\n", AZP_UPDATE_STATE);
+    }
+
+    if(root_fd != -1) {
+        close(root_fd);
+    }
+    free(records);
+    free(list);
+    azp_update_state_free(&state);
+    return ok;
+}
+
+/*
+ * Blob of an entry, for checking the data section layout
+ */
+typedef struct azpRange_t {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t index;
+} azpRange_t;
+
+static int azp_range_cmp(const void *a, const void *b) {
+    const azpRange_t *ra = a;
+    const azpRange_t *rb = b;
+    if(ra->offset != rb->offset) {
+        return ra->offset < rb->offset ? -1 : 1;
+    }
+    if(ra->size != rb->size) {
+        return ra->size < rb->size ? -1 : 1;
+    }
+    return ra->index < rb->index ? -1 : (ra->index > rb->index);
+}
+
+/*
+ * Checks every entry lies inside the data section and no two blobs partly overlap
+ * outside - set for entries whose data is not inside the archive
+ * returns number of problems found, UINT32_MAX if out of memory
+ */
+static uint32_t azp_test_ranges(const azpHeader_t *header, const azpIndex_t *index, size_t archive_sz, bool *outside) {
+    azpRange_t *ranges = malloc((index->count + 1) * sizeof(azpRange_t));
+    if(ranges == NULL) {
+        return UINT32_MAX;
+    }
+    uint32_t errors = 0;
+    for(uint32_t i = 0; i < index->count; ++i) {
+        ranges[i].offset = index->offset[i];
+        ranges[i].size = index->compressed_size[i];
+        ranges[i].index = i;
+        if(index->offset[i] < header->fields.data_offset || (size_t)index->offset[i] + index->compressed_size[i] > archive_sz) {
+            fprintf(stderr, "%s: data at 0x%08X-0x%08zX is outside the data section (0x%08X-0x%08zX)\n",
+                    azp_index_name(index, i), index->offset[i], (size_t)index->offset[i] + index->compressed_size[i],
+                    header->fields.data_offset, archive_sz);
+            outside[i] = true;
+            ++errors;
+        }
+    }
+    qsort(ranges, index->count, sizeof(azpRange_t), azp_range_cmp);
+
+    /* Compare each blob with the one reaching furthest so far, identical ones are shared on purpose */
+    const azpRange_t *last = NULL;
+    for(uint32_t i = 0; i < index->count; ++i) {
+        const azpRange_t *range = &ranges[i];
+        if(last != NULL && range->offset < (size_t)last->offset + last->size
+           && (range->offset != last->offset || range->size != last->size)) {
+            fprintf(stderr, "%s: data at 0x%08X-0x%08zX overlaps %s\n",
+                    azp_index_name(index, range->index), range->offset, (size_t)range->offset + range->size,
+                    azp_index_name(index, last->index));
+            ++errors;
+        }
+        if(last == NULL || (size_t)range->offset + range->size > (size_t)last->offset + last->size) {
+            last = range;
+        }
+    }
+    free(ranges);
+    return errors;
+}
+
+/*
+ * Inflates an entry through buf with zlib and works out what is wrong with it
+ * why - filled with a description of the problem
+ * returns true if the entry is ok
+ */
+static bool azp_test_stream(const azpIndex_t *idx, uint32_t index, const uint8_t *archive, uint8_t *buf, size_t buf_sz, char *why, size_t why_sz) {
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    int ret = inflateInit(&strm);
+    if(ret != Z_OK) {
+        snprintf(why, why_sz, "cannot start inflate (%d)", ret);
+        return false;
+    }
+
+    /* Output is thrown away, zlib checks the adler32 trailer before Z_STREAM_END */
+    strm.next_in = (uint8_t*)archive + idx->offset[index];
+    strm.avail_in = idx->compressed_size[index];
+    do {
+        strm.next_out = buf;
+        strm.avail_out = buf_sz;
+        ret = inflate(&strm, Z_NO_FLUSH);
+    } while(ret == Z_OK && strm.total_out <= idx->uncompressed_size[index]);
+
+    bool ok = false;
+    if(ret == Z_OK) {
+        snprintf(why, why_sz, "inflates to more than the %u bytes the TOC says", idx->uncompressed_size[index]);
+    } else if(ret == Z_BUF_ERROR) {
+        snprintf(why, why_sz, "truncated zlib stream, %lu bytes inflated", strm.total_out);
+    } else if(ret != Z_STREAM_END) {
+        snprintf(why, why_sz, "%s (%d)", strm.msg != NULL ? strm.msg : "inflate error", ret);
+    } else if(strm.total_out != idx->uncompressed_size[index]) {
+        snprintf(why, why_sz, "inflates to %lu bytes, the TOC says %u", strm.total_out, idx->uncompressed_size[index]);
+    } else if(strm.avail_in != 0) {
+        snprintf(why, why_sz, "%u bytes of junk after the zlib stream", strm.avail_in);
+    } else {
+        ok = true;
+    }
+    (void)inflateEnd(&strm);
+    return ok;
+}
+
+/*
+ * Shared state of test workers, jobs are laid out like extraction jobs
+ */
+typedef struct azpTestJob_t {
+    pthread_mutex_t lock;  // guards error output and count
+    const azpIndex_t *index;
+    const uint8_t *archive;
+    uint32_t *order;       // entries, biggest first
+    bool *outside;         // entries with data outside the archive, not inflated
+    uint32_t big;          // entries tested one by one
+    uint32_t total;
+    uint32_t errors;
+    azpProgress_t *progress;
+} azpTestJob_t;
+
+/*
+ * Tests one entry, buf holds at least AZP_TEST_CHUNK bytes or the whole entry
+ * returns 0 if ok
+ */
+static int azp_test_one(azpTestJob_t *job, uint32_t index, uint8_t *buf) {
+    const azpIndex_t *idx = job->index;
+    if(job->outside[index]) {
+        return -1;
+    }
+
+    char why[128];
+    bool ok;
+    if(idx->uncompressed_size[index] > AZP_TEST_WHOLE_MAX) {
+        ok = azp_test_stream(idx, index, job->archive, buf, AZP_TEST_CHUNK, why, sizeof(why));
+    } else {
+        /* Fast path through the codec, which also wants the exact size and checksum.
+         * Only a failed entry goes through zlib again to say why */
+        int ret = azp_codec_inflate(buf, idx->uncompressed_size[index], job->archive + idx->offset[index], idx->compressed_size[index]);
+        ok = ret == Z_OK;
+        if(!ok && azp_test_stream(idx, index, job->archive, buf, idx->uncompressed_size[index] + 1, why, sizeof(why))) {
+            snprintf(why, sizeof(why), "inflate failed (%d)", ret);
+        }
+    }
+
+    if(!ok) {
+        pthread_mutex_lock(&job->lock);
+        fprintf(stderr, "%s: %s\n", azp_index_name(idx, index), why);
+        ++job->errors;
+        pthread_mutex_unlock(&job->lock);
+        return -1;
+    }
+    azp_progress_step(job->progress, azp_index_name(idx, index), idx->uncompressed_size[index]);
+    return 0;
+}
+
+static int azp_test_job(void *ctx, uint32_t job_nr) {
+    azpTestJob_t *job = ctx;
+    const uint32_t *entries = job->order + job_nr;
+    uint32_t count = 1;
+    if(job_nr >= job->big) {
+        entries = job->order + job->big + (job_nr - job->big) * AZP_BATCH;
+        count = job->total - (entries - job->order) < AZP_BATCH ? job->total - (entries - job->order) : AZP_BATCH;
+    }
+
+    /* One scratch buffer for the whole job, the first entry is the biggest */
+    size_t buf_sz = job->index->uncompressed_size[entries[0]];
+    buf_sz = buf_sz > AZP_TEST_WHOLE_MAX ? AZP_TEST_CHUNK : buf_sz + 1;
+    uint8_t *buf = malloc(buf_sz);
+    if(buf == NULL) {
+        return Z_MEM_ERROR;
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        (void)azp_test_one(job, entries[i], buf);
+    }
+    free(buf);
+    /* Keep going after bad entries, the point is to find all of them */
+    return 0;
+}
+
+/*
+ * Checks the data layout and orders the entries for testing
+ * returns number of pool jobs, -1 if out of memory
+ */
+static int64_t azp_test_prepare(azpTestJob_t *job, const azpHeader_t *header, const azpIndex_t *index, const uint8_t *archive, size_t archive_sz,
+                                azpProgress_t *progress) {
+    bool *outside = calloc(index->count + 1, sizeof(bool));
+    azpWorkItem_t *items = malloc((index->count + 1) * sizeof(azpWorkItem_t));
+    uint32_t *order = malloc((index->count + 1) * sizeof(uint32_t));
+    uint32_t range_errors = outside != NULL ? azp_test_ranges(header, index, archive_sz, outside) : UINT32_MAX;
+    if(items == NULL || order == NULL || range_errors == UINT32_MAX) {
+        fprintf(stderr, "Out of memory\n");
+        free(outside);
+        free(items);
+        free(order);
+        return -1;
+    }
+
+    /* Same order and batching as extraction */
+    for(uint32_t i = 0; i < index->count; ++i) {
+        items[i].index = i;
+        items[i].size = index->uncompressed_size[i];
+    }
+    qsort(items, index->count, sizeof(azpWorkItem_t), azp_work_cmp);
+    uint32_t big = 0;
+    for(uint32_t i = 0; i < index->count; ++i) {
+        order[i] = items[i].index;
+        big += items[i].size > AZP_BATCH_FILE_MAX;
+    }
+    free(items);
+
+    job->index = index;
+    job->archive = archive;
+    job->order = order;
+    job->outside = outside;
+    job->big = big;
+    job->total = index->count;
+    job->errors = range_errors;
+    job->progress = progress;
+    pthread_mutex_init(&job->lock, NULL);
+    return big + (index->count - big + AZP_BATCH - 1) / AZP_BATCH;
+}
+
+/*
+ * returns true if no problems were found
+ */
+static bool azp_test_finish(azpTestJob_t *job) {
+    pthread_mutex_destroy(&job->lock);
+    free(job->order);
+    free(job->outside);
+    return job->errors == 0;
+}
+
+bool azp_test_archive(const azpHeader_t *header, const azpIndex_t *index, const uint8_t *archive, size_t archive_sz, unsigned threads) {
+    azpTestJob_t job;
+    azpProgress_t progress;
+    int64_t jobs = azp_test_prepare(&job, header, index, archive, archive_sz, &progress);
+    if(jobs < 0) {
+        return false;
+    }
+    azp_progress_start(&progress, "Tested", index->count);
+    int ret = azp_pool_run(threads, NULL, jobs, azp_test_job, &job);
+    azp_progress_end(&progress);
+    return azp_test_finish(&job) && ret == 0;
+}
+
+/*
+ *          L A Y O U T   F U N C S
+ */
+
+bool azp_profile_load(azpProfile_t *profile, const char *filename) {
+    profile->names = NULL;
+    profile->count = 0;
+    FILE *file = fopen(filename, "r");
+    if(file == NULL) {
+        fprintf(stderr, "Error opening profile %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+
+    bool ok = true;
+    char *line = NULL;
+    size_t line_sz = 0;
+    ssize_t len;
+    while((len = getline(&line, &line_sz, file)) != -1) {
+        while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if(len == 0 || line[0] == '#') {
+            continue;
+        }
+        char **names = realloc(profile->names, (profile->count + 1) * sizeof(char*));
+        if(names == NULL) {
+            ok = false;
+            break;
+        }
+        profile->names = names;
+        names[profile->count++] = line;
+        line = NULL;
+        line_sz = 0;
+    }
+    free(line);
+    if(ferror(file)) {
+        ok = false;
+    }
+    fclose(file);
+    if(!ok) {
+        fprintf(stderr, "Error reading profile %s\n", filename);
+        azp_profile_free(profile);
+    }
+    return ok;
+}
+
+void azp_profile_free(azpProfile_t *profile) {
+    for(size_t i = 0; i < profile->count; ++i) {
+        free(profile->names[i]);
+    }
+    free(profile->names);
+    profile->names = NULL;
+    profile->count = 0;
+}
+
+/*
+ * Sort key of an entry grouped by directory and extension
+ */
+typedef struct azpLayoutKey_t {
+    const char *name;
+    size_t dir_len;   // up to the last separator
+    const char *ext;  // after the last '.' of the file name, "" if none
+    uint32_t index;
+} azpLayoutKey_t;
+
+static int azp_name_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+    for(size_t i = 0; i < a_len && i < b_len; ++i) {
+        uint8_t ca = azp_name_char(a[i]);
+        uint8_t cb = azp_name_char(b[i]);
+        if(ca != cb) {
+            return ca < cb ? -1 : 1;
+        }
+    }
+    return a_len < b_len ? -1 : (a_len > b_len);
+}
+
+static int azp_layout_key_cmp(const void *a, const void *b) {
+    const azpLayoutKey_t *ka = a;
+    const azpLayoutKey_t *kb = b;
+    int ret = azp_name_cmp(ka->name, ka->dir_len, kb->name, kb->dir_len);
+    if(ret == 0) {
+        ret = azp_name_cmp(ka->ext, strlen(ka->ext), kb->ext, strlen(kb->ext));
+    }
+    if(ret == 0) {
+        ret = ka->index < kb->index ? -1 : (ka->index > kb->index);
+    }
+    return ret;
+}
+
+uint32_t *azp_layout_order(const azpEntry_t *root, uint32_t count, azpLayout_t layout, const azpProfile_t *profile) {
+    uint32_t *order = malloc(((size_t)count + 1) * sizeof(uint32_t));
+    if(order == NULL) {
+        perror("Error allocating layout");
+        return NULL;
+    }
+
+    if(layout == AZP_LAYOUT_GROUP) {
+        azpLayoutKey_t *keys = malloc(((size_t)count + 1) * sizeof(azpLayoutKey_t));
+        if(keys == NULL) {
+            perror("Error allocating layout");
+            free(order);
+            return NULL;
+        }
+        for(uint32_t i = 0; i < count; ++i) {
+            const char *name = root[i].filename;
+            const char *base = name;
+            for(const char *c = name; *c != '\0'; ++c) {
+                if(*c == '\\' || *c == '/') {
+                    base = c + 1;
+                }
+            }
+            const char *dot = strrchr(base, '.');
+            keys[i].name = name;
+            keys[i].dir_len = base - name;
+            keys[i].ext = dot != NULL ? dot + 1 : "";
+            keys[i].index = i;
+        }
+        qsort(keys, count, sizeof(azpLayoutKey_t), azp_layout_key_cmp);
+        for(uint32_t i = 0; i < count; ++i) {
+            order[i] = keys[i].index;
+        }
+        free(keys);
+        return order;
+    }
+
+    if(layout != AZP_LAYOUT_PROFILE || profile == NULL) {
+        for(uint32_t i = 0; i < count; ++i) {
+            order[i] = i;
+        }
+        return order;
+    }
+
+    /* Name table of the entries, the same open addressing as the index */
+    uint32_t slots = azp_hash_slots(count);
+    uint32_t *hash = calloc(slots, sizeof(uint32_t));
+    bool *placed = calloc((size_t)count + 1, sizeof(bool));
+    if(hash == NULL || placed == NULL) {
+        perror("Error allocating layout");
+        free(hash);
+        free(placed);
+        free(order);
+        return NULL;
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        uint32_t slot = azp_name_hash(root[i].filename) & (slots - 1);
+        while(hash[slot] != 0) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        hash[slot] = i + 1;
+    }
+
+    uint32_t pos = 0;
+    for(size_t p = 0; p < profile->count; ++p) {
+        uint32_t slot = azp_name_hash(profile->names[p]) & (slots - 1);
+        for(; hash[slot] != 0; slot = (slot + 1) & (slots - 1)) {
+            uint32_t i = hash[slot] - 1;
+            if(azp_name_equal(root[i].filename, profile->names[p])) {
+                if(!placed[i]) {
+                    placed[i] = true;
+                    order[pos++] = i;
+                }
+                break;
+            }
+        }
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        if(!placed[i]) {
+            order[pos++] = i;
+        }
+    }
+    free(hash);
+    free(placed);
+    return order;
+}
+
+/*
+ * Puts the entries in the order of the layout in options
+ * returns 0 if ok
+ */
+static int azp_layout_entries(azpEntry_t *root, uint32_t count, const azpCompressOptions_t *options) {
+    if(options->layout == AZP_LAYOUT_KEEP || count < 2) {
+        return 0;
+    }
+    uint32_t *order = azp_layout_order(root, count, options->layout, options->profile);
+    azpEntry_t *sorted = malloc((size_t)count * sizeof(azpEntry_t));
+    if(order == NULL || sorted == NULL) {
+        if(sorted == NULL) {
+            perror("Error allocating layout");
+        }
+        free(order);
+        free(sorted);
+        return -1;
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        sorted[i] = root[order[i]];
+    }
+    memcpy(root, sorted, (size_t)count * sizeof(azpEntry_t));
+    free(order);
+    free(sorted);
+    return 0;
+}
+
+/*
+ *          C O M P R E S S I O N   F U N C S
+ */
+
+/*
+ * Copies an entry name into the TOC entry
+ * returns false if it does not fit
+ */
+static bool azp_entry_name(azpEntry_t *entry, const char *name) {
+    size_t len = strlen(name);
+    if(len >= MAX_FILENAME) {
+        fprintf(stderr, "Filename too long: %s\n", name);
+        return false;
+    }
+    memcpy(entry->filename, name, len + 1);
+    entry->filename_length = len;
+    return true;
+}
+
+/*
+ * File the entry is read from when compressing
+ */
+static const char *azp_entry_path(const azpEntry_t *entry) {
+    return entry->path != NULL ? entry->path : entry->filename;
+}
+
+azpEntry_t *azp_make_file_list(azpHeader_t *header, char **file_list, size_t file_count) {
+    struct stat st;
+    azpEntry_t *out = NULL;
+    azpScan_t *scans = calloc(file_count + 1, sizeof(azpScan_t));
+    size_t *sizes = calloc(file_count + 1, sizeof(size_t));
+    bool *is_file = calloc(file_count + 1, sizeof(bool));
+    if(scans == NULL || sizes == NULL || is_file == NULL) {
+        perror("Error allocating file list");
+        goto cleanup;
+    }
+
+    /* One stat per parameter, directories are expanded where they stand */
+    size_t count = 0;
+    size_t path_sz = 0;
+    for(size_t i = 0; i < file_count; ++i) {
+        if(stat(file_list[i], &st) != 0) {
+            fprintf(stderr, "Error reading file %s: %s\n", file_list[i], strerror(errno));
+            goto cleanup;
+        }
+        if(S_ISDIR(st.st_mode)) {
+            if(azp_scan_dir(&scans[i], file_list[i], 0) != 0) {
+                goto cleanup;
+            }
+            /* A tree kept up to date with azp_extract_update has its state file at the top */
+            for(uint32_t j = 0; j < scans[i].count; ++j) {
+                if(strcmp(scans[i].files[j].path, AZP_UPDATE_STATE) == 0) {
+                    free(scans[i].files[j].path);
+                    memmove(&scans[i].files[j], &scans[i].files[j + 1], (scans[i].count - j - 1) * sizeof(azpScanFile_t));
+                    --scans[i].count;
+                    break;
+                }
+            }
+            size_t root_len = strlen(file_list[i]) + 1;
+            for(uint32_t j = 0; j < scans[i].count; ++j) {
+                path_sz += root_len + strlen(scans[i].files[j].path) + 1;
+            }
+            count += scans[i].count;
+        } else if(S_ISREG(st.st_mode)) {
+            sizes[i] = st.st_size;
+            is_file[i] = true;
+            ++count;
+        } else {
+            fprintf(stderr, "Skipping %s, not a file or directory\n", file_list[i]);
+        }
+    }
+    if(count > UINT32_MAX) {
+        fprintf(stderr, "Too many files\n");
+        goto cleanup;
+    }
+
+    /* Paths of scanned files go behind the entries */
+    out = calloc(1, (count + 1) * sizeof(azpEntry_t) + path_sz);
+    if(out == NULL) {
+        perror("Error allocating TOC");
+        goto cleanup;
+    }
+    char *paths = (char*)(out + count + 1);
+
+    /* name_len, offset, compressed size and uncompressed size */
+    size_t offset = (sizeof(uint32_t) * 4) * count;
+    size_t n = 0;
+    for(size_t i = 0; i < file_count; ++i) {
+        if(is_file[i]) {
+            if(!azp_entry_name(&out[n], file_list[i])) {
+                goto fail;
+            }
+            out[n].uncompressed_size = sizes[i];
+            offset += out[n].filename_length;
+            ++n;
+            continue;
+        }
+        size_t root_len = strlen(file_list[i]);
+        bool slash = root_len > 0 && file_list[i][root_len - 1] == '/';
+        for(uint32_t j = 0; j < scans[i].count; ++j) {
+            const azpScanFile_t *file = &scans[i].files[j];
+            if(!azp_entry_name(&out[n], file->path)) {
+                goto fail;
+            }
+            /* The game names files with backslashes */
+            for(char *c = out[n].filename; *c != '\0'; ++c) {
+                if(*c == '/') {
+                    *c = '\\';
+                }
+            }
+            out[n].path = paths;
+            paths += sprintf(paths, "%s%s%s", file_list[i], slash ? "" : "/", file->path) + 1;
+            out[n].uncompressed_size = file->size;
+            offset += out[n].filename_length;
+            ++n;
+        }
+    }
+
+    /* Fill known values of header */
+    header->fields.magic = azpHeaderMagic;
+    header->fields.version = AZP_VERSION;
+    header->fields.file_count = count;
+    header->fields.data_offset = offset + 16;
+#ifdef DEBUG
+    printf("offset: 0x%08X\n", header->fields.data_offset);
+#endif
+    goto cleanup;
+
+fail:
+    free(out);
+    out = NULL;
+cleanup:
+    for(size_t i = 0; scans != NULL && i < file_count; ++i) {
+        azp_scan_free(&scans[i]);
+    }
+    free(scans);
+    free(sizes);
+    free(is_file);
+    return out;
+}
+
+/*
+ * Checks that no two files got the same entry name, directories given together
+ * may hold the same relative paths. Names are compared like lookups do.
+ * returns true if some did, after naming them
+ */
+static bool azp_names_collide(const azpEntry_t *root, uint32_t count) {
+    uint32_t slots = azp_hash_slots(count);
+    uint32_t *hash = calloc(slots, sizeof(uint32_t));
+    if(hash == NULL) {
+        perror("Error allocating TOC");
+        return true;
+    }
+    bool collide = false;
+    for(uint32_t i = 0; i < count; ++i) {
+        uint32_t slot = azp_name_hash(root[i].filename) & (slots - 1);
+        while(hash[slot] != 0 && !azp_name_equal(root[hash[slot] - 1].filename, root[i].filename)) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        if(hash[slot] != 0) {
+            fprintf(stderr, "%s and %s would both be stored as %s\n", azp_entry_path(&root[hash[slot] - 1]),
+                    azp_entry_path(&root[i]), root[i].filename);
+            collide = true;
+        } else {
+            hash[slot] = i + 1;
+        }
+    }
+    free(hash);
+    return collide;
+}
+
+/*
+ * Compressed entry waiting for the writer
+ */
+typedef struct azpBlob_t {
+    uint8_t *data;      // compressed data in memory, NULL if spilled
+    size_t size;
+    off_t spill_offset; // position in the spill file if spilled
+    int level;          // zlib level picked for the entry
+    bool keyed;         // key is set, the blob goes through the cache
+    azpCacheKey_t key;
+    bool ready;
+} azpBlob_t;
+
+/*
+ * Memory budget of compression workers, shared by the archives of a batch
+ */
+typedef struct azpCompressMemory_t {
+    pthread_mutex_t lock; // guards this and the jobs using it
+    pthread_cond_t cond;  // signalled when a blob is ready, memory is freed or on failure
+    size_t used;          // compressed bytes held in memory
+    size_t work;          // input and output buffers of running workers
+    uint32_t waiting;     // workers waiting for memory
+} azpCompressMemory_t;
+
+/*
+ * Shared state of compression workers and the archive writer
+ */
+typedef struct azpCompressJob_t {
+    azpCompressMemory_t *mem; // its lock guards everything below
+    azpCompressMemory_t own;  // mem when the budget is not shared
+    azpEntry_t *root;
+    uint32_t count;
+    size_t offset;        // where the first blob goes
+    azpBlob_t *blobs;
+    const azpPolicy_t *policy;
+    azpCache_t *cache;
+    int outfd;
+    FILE *spill;          // anonymous temporary file, created on first spill
+    off_t spill_sz;
+    uint32_t next;        // entry the writer waits for
+    azpProgress_t *progress;
+    bool failed;
+    pthread_t writer;
+    bool writing;         // writer thread was started
+} azpCompressJob_t;
+
+/*
+ * Deflates a file straight into the archive, or copies it from the cache
+ * key - cache key of the file, NULL if not cached
+ * returns 0 if OK, zlib errors if not
+ */
+static int azp_compress_cached(azpCache_t *cache, const azpCacheKey_t *key, const char *filename, int level, int fd, size_t offset, size_t *compressed_sz) {
+    if(key != NULL && azp_cache_get_fd(cache, key, fd, offset, compressed_sz)) {
+        return Z_OK;
+    }
+    int ret = azp_compress_stream(filename, level, fd, offset, compressed_sz);
+    if(ret == Z_OK && key != NULL) {
+        azp_cache_put_fd(cache, key, fd, offset, *compressed_sz);
+    }
+    return ret;
+}
+
+/*
+ * Takes size bytes of the spill file, called with the lock held
+ * returns the offset, -1 if the file could not be created
+ */
+static off_t azp_compress_spill(azpCompressJob_t *job, size_t size) {
+    if(job->spill == NULL && (job->spill = tmpfile()) == NULL) {
+        perror("Error creating spill file");
+        return -1;
+    }
+    off_t spill_offset = job->spill_sz;
+    job->spill_sz += size;
+    return spill_offset;
+}
+
+static int azp_compress_job(void *ctx, uint32_t index) {
+    azpCompressJob_t *job = ctx;
+    azpEntry_t *entry = &job->root[index];
+    azpBlob_t *blob = &job->blobs[index];
+
+    int level = azp_policy_level(job->policy, azp_entry_path(entry));
+    /* Only this worker touches the blob until it is marked ready */
+    blob->keyed = job->cache != NULL && azp_cache_key(job->cache, azp_entry_path(entry), level, &blob->key);
+    blob->level = level;
+
+    /* Big entries are deflated in chunks into the spill file, the rest whole in memory */
+    bool stream = entry->uncompressed_size > AZP_STREAM_THRESHOLD;
+    size_t need = stream ? 0 : entry->uncompressed_size + azp_codec_bound(entry->uncompressed_size);
+    size_t reserved = azp_codec_bound(entry->uncompressed_size);
+    uint8_t *data = NULL;
+    size_t size = 0;
+    int ret = Z_OK;
+
+    /* Wait for memory before reading the input. The entry the writer waits for
+       goes ahead regardless, the memory held is only freed once it is written */
+    pthread_mutex_lock(&job->mem->lock);
+    while(!job->failed && index != job->next && job->mem->work + job->mem->used > 0
+          && job->mem->work + job->mem->used + need > AZP_COMPRESS_MEMORY) {
+        ++job->mem->waiting;
+        pthread_cond_wait(&job->mem->cond, &job->mem->lock);
+        --job->mem->waiting;
+    }
+    if(job->failed) {
+        pthread_mutex_unlock(&job->mem->lock);
+        return -1;
+    }
+    if(stream) {
+        /* Room for the worst case, the unused tail stays a hole in the file */
+        if((blob->spill_offset = azp_compress_spill(job, reserved)) < 0) {
+            goto fail_locked;
+        }
+    } else {
+        job->mem->work += need;
+    }
+    pthread_mutex_unlock(&job->mem->lock);
+
+    if(stream) {
+        ret = azp_compress_cached(job->cache, blob->keyed ? &blob->key : NULL, azp_entry_path(entry), level, fileno(job->spill), blob->spill_offset, &size);
+        if(ret == Z_OK && size > reserved) {
+            fprintf(stderr, "File %s changed while compressing\n", azp_entry_path(entry));
+            ret = Z_DATA_ERROR;
+        }
+    } else if(!blob->keyed || !azp_cache_get(job->cache, &blob->key, &data, &size)) {
+        ret = azp_compress_file(azp_entry_path(entry), level, &data, &size);
+        if(ret == Z_OK && blob->keyed) {
+            azp_cache_put(job->cache, &blob->key, data, size);
+        }
+    }
+
+    pthread_mutex_lock(&job->mem->lock);
+    job->mem->work -= need;
+    if(ret != Z_OK) {
+        fprintf(stderr, "Error compressing file %s (%d)\n", azp_entry_path(entry), ret);
+        goto fail_locked;
+    }
+
+    /* A blob held in memory blocks workers until the writer gets to it, park it in
+       the spill file instead when some are waiting */
+    if(data != NULL && index != job->next && job->mem->waiting > 0) {
+        off_t spill_offset = azp_compress_spill(job, size);
+        if(spill_offset < 0) {
+            goto fail_locked;
+        }
+        pthread_mutex_unlock(&job->mem->lock);
+
+        if(azp_pwrite(fileno(job->spill), data, size, spill_offset) != 0) {
+            perror("Error writing spill file");
+            pthread_mutex_lock(&job->mem->lock);
+            goto fail_locked;
+        }
+        free(data);
+        data = NULL;
+
+        pthread_mutex_lock(&job->mem->lock);
+        blob->spill_offset = spill_offset;
+    } else if(data != NULL) {
+        job->mem->used += size;
+    }
+    blob->data = data;
+    blob->size = size;
+    blob->ready = true;
+    pthread_cond_broadcast(&job->mem->cond);
+    pthread_mutex_unlock(&job->mem->lock);
+    return 0;
+
+fail_locked:
+    free(data);
+    job->failed = true;
+    pthread_cond_broadcast(&job->mem->cond);
+    pthread_mutex_unlock(&job->mem->lock);
+    return -1;
+}
+
+/*
+ * Writes one finished blob to the archive at offset
+ * returns 0 if ok
+ */
+static int azp_write_blob(azpCompressJob_t *job, const azpBlob_t *blob, off_t offset) {
+    if(blob->data != NULL) {
+        if(azp_pwrite(job->outfd, blob->data, blob->size, offset) != 0) {
+            perror("Error writing compressed archive");
+            return -1;
+        }
+        return 0;
+    }
+
+    /* Copy from spill file in chunks, some might be big */
+    uint8_t block[CHUNK_SZ];
+    size_t written = 0;
+    while(written < blob->size) {
+        size_t chunksize = CHUNK_SZ;
+        if(chunksize > blob->size - written) {
+            chunksize = blob->size - written;
+        }
+        if(pread(fileno(job->spill), block, chunksize, blob->spill_offset + written) != (ssize_t)chunksize) {
+            perror("Error reading spill file");
+            return -1;
+        }
+        if(azp_pwrite(job->outfd, block, chunksize, offset + written) != 0) {
+            perror("Error writing compressed archive");
+            return -1;
+        }
+        written += chunksize;
+    }
+    return 0;
+}
+
+/*
+ * Writer thread, appends blobs to the data section in TOC order as they finish
+ */
+static void *azp_compress_writer(void *arg) {
+    azpCompressJob_t *job = arg;
+    size_t offset = job->offset;
+
+    for(uint32_t i = 0; i < job->count; ++i) {
+        azpBlob_t *blob = &job->blobs[i];
+
+        pthread_mutex_lock(&job->mem->lock);
+        /* The worker of this entry may be waiting for memory */
+        job->next = i;
+        pthread_cond_broadcast(&job->mem->cond);
+        while(!blob->ready && !job->failed) {
+            pthread_cond_wait(&job->mem->cond, &job->mem->lock);
+        }
+        if(job->failed) {
+            pthread_mutex_unlock(&job->mem->lock);
+            break;
+        }
+        pthread_mutex_unlock(&job->mem->lock);
+
+        azpSpan_t span;
+        azp_span_begin(&span);
+        int ret = azp_write_blob(job, blob, offset);
+        azp_span_end(&span, AZP_PHASE_ARCHIVE, blob->size, blob->size, 1);
+        job->root[i].offset = offset;
+        job->root[i].compressed_size = blob->size;
+        offset += blob->size;
+        if(ret == 0) {
+            azp_progress_step(job->progress, job->root[i].filename, job->root[i].uncompressed_size);
+        }
+
+        pthread_mutex_lock(&job->mem->lock);
+        if(blob->data != NULL) {
+            job->mem->used -= blob->size;
+            free(blob->data);
+            blob->data = NULL;
+        }
+        if(ret != 0) {
+            job->failed = true;
+        }
+        pthread_cond_broadcast(&job->mem->cond);
+        pthread_mutex_unlock(&job->mem->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Sets up the shared state and starts the writer thread, workers are run on
+ * azp_compress_job afterwards
+ * mem - budget shared with other archives, NULL for one of its own
+ * returns 0 if OK
+ */
+static int azp_compress_begin(azpCompressJob_t *job, azpEntry_t *root, uint32_t count, size_t offset, int outfd,
+                              const azpCompressOptions_t *options, azpCompressMemory_t *mem, azpProgress_t *progress) {
+    memset(job, 0, sizeof(azpCompressJob_t));
+    job->mem = mem != NULL ? mem : &job->own;
+    if(mem == NULL) {
+        pthread_mutex_init(&job->own.lock, NULL);
+        pthread_cond_init(&job->own.cond, NULL);
+    }
+    job->root = root;
+    job->count = count;
+    job->offset = offset;
+    job->policy = options->policy;
+    job->cache = options->cache;
+    job->outfd = outfd;
+    job->progress = progress;
+    job->blobs = calloc(count + 1, sizeof(azpBlob_t));
+    if(job->blobs == NULL) {
+        perror("Error allocating compression state");
+        return -1;
+    }
+
+    if(pthread_create(&job->writer, NULL, azp_compress_writer, job) != 0) {
+        perror("Error starting writer thread");
+        job->failed = true;
+        return -1;
+    }
+    job->writing = true;
+    return 0;
+}
+
+/*
+ * Stops the writer once it is done or the job failed and frees the shared state
+ * failed - the workers did not finish
+ * returns 0 if OK
+ */
+static int azp_compress_end(azpCompressJob_t *job, bool failed) {
+    if(job->blobs != NULL) {
+        if(failed) {
+            pthread_mutex_lock(&job->mem->lock);
+            job->failed = true;
+            pthread_cond_broadcast(&job->mem->cond);
+            pthread_mutex_unlock(&job->mem->lock);
+        }
+        if(job->writing) {
+            pthread_join(job->writer, NULL);
+        }
+
+        /* Blobs the writer did not get to give their memory back */
+        pthread_mutex_lock(&job->mem->lock);
+        for(uint32_t i = 0; i < job->count; ++i) {
+            if(job->blobs[i].data != NULL) {
+                job->mem->used -= job->blobs[i].size;
+                free(job->blobs[i].data);
+            }
+        }
+        pthread_cond_broadcast(&job->mem->cond);
+        pthread_mutex_unlock(&job->mem->lock);
+        free(job->blobs);
+        job->blobs = NULL;
+        if(job->spill != NULL) {
+            fclose(job->spill);
+        }
+    }
+    if(job->mem == &job->own) {
+        pthread_cond_destroy(&job->own.cond);
+        pthread_mutex_destroy(&job->own.lock);
+    }
+
+    return job->failed || failed ? -1 : 0;
+}
+
+/*
+ * Runs compression workers and the writer thread
+ * returns 0 if OK
+ */
+static int azp_compress_parallel(azpEntry_t *root, uint32_t count, size_t offset, int outfd, const azpCompressOptions_t *options, azpProgress_t *progress) {
+    azpCompressJob_t job;
+    if(azp_compress_begin(&job, root, count, offset, outfd, options, NULL, progress) != 0) {
+        return azp_compress_end(&job, true);
+    }
+    /* Workers take entries in TOC order so the writer can drain them as they finish */
+    int ret = azp_pool_run(options->threads, NULL, count, azp_compress_job, &job);
+    return azp_compress_end(&job, ret != 0);
+}
+
+/*
+ * Backfills the encrypted TOC right after the header
+ * returns 0 if OK
+ */
+static int azp_write_toc(const azpHeader_t *header, const azpEntry_t *root, int outfd) {
+    size_t toc_sz = header->fields.data_offset - sizeof(azpHeader_t);
+    uint8_t *toc = malloc(toc_sz);
+    if(toc == NULL) {
+        perror("Error allocating TOC");
+        return -1;
+    }
+
+    size_t addr = 0;
+    for(uint32_t i = 0; i < header->fields.file_count; ++i) {
+        /* The TOC only has 32 bits for each, the blob must end below 4 GiB */
+        if(root[i].offset > UINT32_MAX || root[i].compressed_size > UINT32_MAX - root[i].offset
+           || root[i].uncompressed_size > UINT32_MAX) {
+            fprintf(stderr, "Archive is too big, %s does not fit below 4 GiB\n", root[i].filename);
+            free(toc);
+            return -1;
+        }
+        uint32_t fields[4] = {
+            root[i].filename_length,
+            root[i].offset,
+            root[i].compressed_size,
+            root[i].uncompressed_size
+        };
+
+        /* Filename len, filename, offset, compressed size and uncompressed size */
+        memcpy(toc + addr, &fields[0], 4);
+        addr += 4;
+        memcpy(toc + addr, root[i].filename, root[i].filename_length);
+        addr += root[i].filename_length;
+        memcpy(toc + addr, &fields[1], 12);
+        addr += 12;
+    }
+    assert(addr == toc_sz);
+
+    /* Encrypt the whole TOC in one go */
+    uint32_t next_key = CIPHER_KEY;
+    azp_cipher(toc, toc, toc_sz, &next_key);
+
+    azpSpan_t span;
+    azp_span_begin(&span);
+    int ret = azp_pwrite(outfd, toc, toc_sz, sizeof(azpHeader_t));
+    azp_span_end(&span, AZP_PHASE_ARCHIVE, toc_sz, toc_sz, 0);
+    if(ret != 0) {
+        perror("Error writing TOC");
+    }
+    free(toc);
+    return ret;
+}
+
+/*
+ * Compresses files into the archive one after another starting at offset
+ * Fills in offset and compressed size of each entry
+ * returns 0 if OK
+ */
+static int azp_compress_run(azpEntry_t *root, uint32_t count, size_t offset, int outfd, const azpCompressOptions_t *options) {
+    unsigned threads = options->threads;
+    if(threads == 0) {
+        threads = azp_pool_default_threads();
+    }
+    azpProgress_t progress;
+    azp_progress_start(&progress, "Compressed", count);
+    int ret = 0;
+    if(threads == 1) {
+        /* Single pass, deflate output goes straight into the archive at the running offset */
+        for(uint32_t i = 0; i < count; ++i) {
+            int level = azp_policy_level(options->policy, azp_entry_path(&root[i]));
+            azpCacheKey_t key;
+            bool keyed = options->cache != NULL && azp_cache_key(options->cache, azp_entry_path(&root[i]), level, &key);
+            ret = azp_compress_cached(options->cache, keyed ? &key : NULL, azp_entry_path(&root[i]), level, outfd, offset, &root[i].compressed_size);
+            if(ret != Z_OK) {
+                fprintf(stderr, "Error compressing file %s (%d)\n", azp_entry_path(&root[i]), ret);
+                ret = -1;
+                break;
+            }
+            root[i].offset = offset;
+            offset += root[i].compressed_size;
+            azp_progress_step(&progress, root[i].filename, root[i].uncompressed_size);
+        }
+    } else {
+        ret = azp_compress_parallel(root, count, offset, outfd, options, &progress);
+    }
+    azp_progress_end(&progress);
+    return ret;
+}
+
+/*
+ * Content hash of one input file
+ */
+typedef struct azpContent_t {
+    size_t size;
+    uint32_t crc;
+    uint32_t index;
+} azpContent_t;
+
+/*
+ * Shared state of hashing workers
+ */
+typedef struct azpHashJob_t {
+    const azpEntry_t *root;
+    azpContent_t *content;
+} azpHashJob_t;
+
+static int azp_hash_job(void *ctx, uint32_t index) {
+    azpHashJob_t *job = ctx;
+    azpContent_t *content = &job->content[index];
+    content->index = index;
+    content->size = 0;
+    content->crc = crc32(0L, Z_NULL, 0);
+
+    azpSpan_t span;
+    azp_span_begin(&span);
+    int fd = open(azp_entry_path(&job->root[index]), O_RDONLY);
+    if(fd == -1) {
+        fprintf(stderr, "Error reading file %s\n", azp_entry_path(&job->root[index]));
+        return -1;
+    }
+    uint8_t *block = malloc(AZP_HASH_BLOCK);
+    ssize_t n = -1;
+    while(block != NULL && (n = read(fd, block, AZP_HASH_BLOCK)) > 0) {
+        content->crc = crc32_z(content->crc, block, n);
+        content->size += n;
+    }
+    free(block);
+    close(fd);
+    azp_span_end(&span, AZP_PHASE_READ, content->size, 0, 1);
+    if(n != 0) {
+        fprintf(stderr, "Error reading file %s\n", azp_entry_path(&job->root[index]));
+        return -1;
+    }
+    return 0;
+}
+
+static int azp_content_cmp(const void *a, const void *b) {
+    const azpContent_t *ca = a;
+    const azpContent_t *cb = b;
+    if(ca->size != cb->size) {
+        return ca->size < cb->size ? -1 : 1;
+    }
+    if(ca->crc != cb->crc) {
+        return ca->crc < cb->crc ? -1 : 1;
+    }
+    return ca->index < cb->index ? -1 : (ca->index > cb->index);
+}
+
+/*
+ * Compares two files byte by byte, a matching hash is not proof enough
+ * returns true if they are the same
+ */
+static bool azp_same_content(const char *a, const char *b) {
+    bool same = false;
+    int fd_a = open(a, O_RDONLY);
+    int fd_b = open(b, O_RDONLY);
+    uint8_t *block = malloc(2 * AZP_HASH_BLOCK);
+    if(fd_a != -1 && fd_b != -1 && block != NULL) {
+        for(;;) {
+            ssize_t n_a = read(fd_a, block, AZP_HASH_BLOCK);
+            ssize_t n_b = read(fd_b, block + AZP_HASH_BLOCK, AZP_HASH_BLOCK);
+            if(n_a != n_b || n_a < 0 || memcmp(block, block + AZP_HASH_BLOCK, n_a) != 0) {
+                break;
+            }
+            if(n_a == 0) {
+                same = true;
+                break;
+            }
+        }
+    }
+    free(block);
+    if(fd_a != -1) {
+        close(fd_a);
+    }
+    if(fd_b != -1) {
+        close(fd_b);
+    }
+    return same;
+}
+
+/*
+ * Finds byte-identical files
+ * unique - filled with the first entry having the same content as each entry
+ * returns number of duplicates, -1 on error
+ */
+static int64_t azp_dedup(const azpEntry_t *root, uint32_t count, unsigned threads, uint32_t *unique) {
+    azpContent_t *content = malloc((count + 1) * sizeof(azpContent_t));
+    if(content == NULL) {
+        perror("Error allocating hashes");
+        return -1;
+    }
+    azpHashJob_t job = {
+        .root = root,
+        .content = content
+    };
+    if(azp_pool_run(threads, NULL, count, azp_hash_job, &job) != 0) {
+        free(content);
+        return -1;
+    }
+
+    /* Same size and hash end up next to each other, lowest entry nr. first */
+    qsort(content, count, sizeof(azpContent_t), azp_content_cmp);
+    int64_t duplicates = 0;
+    uint32_t group = 0;
+    for(uint32_t i = 0; i < count; ++i) {
+        uint32_t index = content[i].index;
+        unique[index] = index;
+        if(i == 0 || content[i].size != content[i-1].size || content[i].crc != content[i-1].crc) {
+            group = i;
+            continue;
+        }
+        /* Check against every distinct content of the group so far */
+        for(uint32_t j = group; j < i; ++j) {
+            uint32_t other = content[j].index;
+            if(unique[other] == other && azp_same_content(azp_entry_path(&root[other]), azp_entry_path(&root[index]))) {
+                unique[index] = other;
+                ++duplicates;
+                break;
+            }
+        }
+    }
+    free(content);
+    return duplicates;
+}
+
+/*
+ * Files of one archive that get compressed, byte-identical ones only once
+ */
+typedef struct azpDedup_t {
+    azpEntry_t *first;  // distinct files, root itself if there are no duplicates
+    uint32_t distinct;
+    uint32_t *unique;   // per entry, first entry with the same content, NULL if no duplicates
+    uint32_t *slot;     // per entry, place of its content in first
+    int64_t duplicates;
+} azpDedup_t;
+
+/*
+ * Hashes the files when deduplicating and picks the ones to compress
+ * returns 0 if OK
+ */
+static int azp_dedup_prepare(azpDedup_t *dedup, azpEntry_t *root, uint32_t count, const azpCompressOptions_t *options) {
+    memset(dedup, 0, sizeof(azpDedup_t));
+    dedup->first = root;
+    dedup->distinct = count;
+    if(!options->dedup || count < 2) {
+        return 0;
+    }
+
+    dedup->unique = malloc(count * sizeof(uint32_t));
+    if(dedup->unique == NULL) {
+        perror("Error allocating hashes");
+        return -1;
+    }
+    dedup->duplicates = azp_dedup(root, count, options->threads, dedup->unique);
+    if(dedup->duplicates <= 0) {
+        free(dedup->unique);
+        dedup->unique = NULL;
+        return dedup->duplicates == 0 ? 0 : -1;
+    }
+
+    /* Compress the distinct ones, the duplicates get pointed at their blobs afterwards */
+    dedup->distinct = count - dedup->duplicates;
+    dedup->first = malloc(dedup->distinct * sizeof(azpEntry_t));
+    dedup->slot = malloc(count * sizeof(uint32_t));
+    if(dedup->first == NULL || dedup->slot == NULL) {
+        perror("Error allocating hashes");
+        free(dedup->first);
+        free(dedup->slot);
+        free(dedup->unique);
+        return -1;
+    }
+    uint32_t n = 0;
+    for(uint32_t i = 0; i < count; ++i) {
+        if(dedup->unique[i] == i) {
+            dedup->slot[i] = n;
+            dedup->first[n++] = root[i];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Fills in offset and compressed size of the duplicates and frees the state
+ * ok - the distinct files were compressed
+ * result - gets what deduplication saved, NULL if not wanted
+ */
+static void azp_dedup_finish(azpDedup_t *dedup, azpEntry_t *root, uint32_t count, bool ok, azpCompressResult_t *result) {
+    if(dedup->unique == NULL) {
+        return;
+    }
+    if(ok) {
+        size_t saved = 0;
+        size_t saved_compressed = 0;
+        for(uint32_t i = 0; i < count; ++i) {
+            const azpEntry_t *blob = &dedup->first[dedup->slot[dedup->unique[i]]];
+            root[i].offset = blob->offset;
+            root[i].compressed_size = blob->compressed_size;
+            if(dedup->unique[i] != i) {
+                saved += root[i].uncompressed_size;
+                saved_compressed += root[i].compressed_size;
+            }
+        }
+        if(result != NULL) {
+            result->duplicates = dedup->duplicates;
+            result->saved = saved;
+            result->saved_compressed = saved_compressed;
+        }
+    }
+    free(dedup->first);
+    free(dedup->slot);
+    free(dedup->unique);
+}
+
+/*
+ * Compresses files into the archive starting at offset, byte-identical files
+ * only once when deduplicating
+ * Fills in offset and compressed size of each entry
+ * returns 0 if OK
+ */
+static int azp_compress_entries(azpEntry_t *root, uint32_t count, size_t offset, int outfd, const azpCompressOptions_t *options,
+                                azpCompressResult_t *result) {
+    azpDedup_t dedup;
+    if(azp_dedup_prepare(&dedup, root, count, options) != 0) {
+        return -1;
+    }
+    int ret = azp_compress_run(dedup.first, dedup.distinct, offset, outfd, options);
+    azp_dedup_finish(&dedup, root, count, ret == 0, result);
+    return ret;
+}
+
+int azp_compress_files(const azpHeader_t *header, azpEntry_t *root, const char *filename, const azpCompressOptions_t *options,
+                       azpCompressResult_t *result) {
+    if(result != NULL) {
+        memset(result, 0, sizeof(azpCompressResult_t));
+    }
+    if(azp_names_collide(root, header->fields.file_count) || azp_layout_entries(root, header->fields.file_count, options) != 0) {
+        return -1;
+    }
+    int outfd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(outfd == -1) {
+        perror("Error opening file");
+        return -1;
+    }
+
+    /* Write header */
+    if(azp_pwrite(outfd, header, sizeof(azpHeader_t), 0) != 0) {
+        perror("Error writing header");
+        goto fail_outfile;
+    }
+
+    /* Compressed sizes are not known yet, data goes in after the space reserved for the TOC */
+    if(azp_compress_entries(root, header->fields.file_count, header->fields.data_offset, outfd, options, result) != 0) {
+        goto fail_outfile;
+    }
+
+    /* All sizes known, backfill the reserved TOC region */
+    if(azp_write_toc(header, root, outfd) != 0) {
+        goto fail_outfile;
+    }
+
+    if(close(outfd) != 0) {
+        perror("Error closing archive");
+        unlink(filename);
+        return -1;
+    }
+    return 0;
+
+fail_outfile:
+    /* Don't leave a half written archive behind */
+    close(outfd);
+    unlink(filename);
+    return -1;
+}
+
+/*
+ * Copies len bytes of the old archive to the new one
+ * returns 0 if OK
+ */
+static int azp_copy_range(int in_fd, const uint8_t *archive, off_t src, int out_fd, off_t dst, size_t len) {
+    azpSpan_t span;
+    azp_span_begin(&span);
+    size_t total = len;
+#ifdef __linux__
+    /* Lets the filesystem share or clone the extents, no trip through user space */
+    loff_t in_off = src;
+    loff_t out_off = dst;
+    while(len > 0) {
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        len -= n;
+    }
+    src = in_off;
+    dst = out_off;
+#endif
+    /* Not supported between these files, copy the rest from the mapping */
+    int ret = len > 0 ? azp_pwrite(out_fd, archive + src, len, dst) : 0;
+    azp_span_end(&span, AZP_PHASE_ARCHIVE, total, total, 0);
+    return ret;
+}
+
+/*
+ * Kept entry and where its blob lives in the old archive
+ */
+typedef struct azpKeep_t {
+    uint32_t offset;
+    uint32_t index;
+} azpKeep_t;
+
+static int azp_keep_cmp(const void *a, const void *b) {
+    const azpKeep_t *ka = a;
+    const azpKeep_t *kb = b;
+    if(ka->offset != kb->offset) {
+        return ka->offset < kb->offset ? -1 : 1;
+    }
+    return ka->index < kb->index ? -1 : (ka->index > kb->index);
+}
+
+/*
+ * Creates the file a rewritten archive is written to before it is renamed over target,
+ * a new name in the same directory with the permissions of the old archive
+ * mode_fd - old archive
+ * path - returns the malloc()'d path of the file there
+ * returns its fd or -1 if it can't be created
+ */
+static int azp_open_replacement(const char *target, int mode_fd, char **path) {
+    *path = malloc(strlen(target) + sizeof(".XXXXXX"));
+    if(*path == NULL) {
+        perror("Error allocating path");
+        return -1;
+    }
+    sprintf(*path, "%s.XXXXXX", target);
+    int fd = mkstemp(*path);
+    if(fd == -1) {
+        perror("Error opening file");
+        free(*path);
+        *path = NULL;
+        return -1;
+    }
+    struct stat st;
+    if(fstat(mode_fd, &st) != 0 || fchmod(fd, st.st_mode & 07777) != 0) {
+        perror("Error setting archive permissions");
+        close(fd);
+        unlink(*path);
+        free(*path);
+        *path = NULL;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Drops added files whose name a later one has too, the last one wins
+ * count - number of entries, returns the number left there
+ * returns false if out of memory
+ */
+static bool azp_unique_names(azpEntry_t *entries, uint32_t *count) {
+    uint32_t slots = azp_hash_slots(*count);
+    uint32_t *hash = calloc(slots, sizeof(uint32_t));
+    bool *dropped = calloc((size_t)*count + 1, sizeof(bool));
+    if(hash == NULL || dropped == NULL) {
+        free(hash);
+        free(dropped);
+        return false;
+    }
+    for(uint32_t i = *count; i-- > 0;) {
+        uint32_t slot = azp_name_hash(entries[i].filename) & (slots - 1);
+        while(hash[slot] != 0 && !azp_name_equal(entries[hash[slot] - 1].filename, entries[i].filename)) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        if(hash[slot] != 0) {
+            dropped[i] = true;
+        } else {
+            hash[slot] = i + 1;
+        }
+    }
+    uint32_t left = 0;
+    for(uint32_t i = 0; i < *count; ++i) {
+        if(!dropped[i]) {
+            entries[left++] = entries[i];
+        }
+    }
+    *count = left;
+    free(hash);
+    free(dropped);
+    return true;
+}
+
+int azp_update_archive(const char *filename, const azpIndex_t *index, const uint8_t *archive, size_t archive_sz, int archive_fd,
+                       char **remove, size_t remove_count, char **add, size_t add_count, const azpCompressOptions_t *options,
+                       azpCompressResult_t *result) {
+    int ret = -1;
+    int outfd = -1;
+    azpHeader_t header;
+    azpEntry_t *added = NULL;
+    uint32_t added_count = 0;
+    uint32_t *removed = NULL;
+    uint32_t removed_count = 0;
+    char *tmp_path = NULL;
+    uint32_t *replaced = malloc((index->count + 1) * sizeof(uint32_t)); // per old entry, added file taking its place
+    uint32_t *source = NULL; // per new entry, added file or AZP_NOT_FOUND
+    azpKeep_t *keep = malloc((index->count + 1) * sizeof(azpKeep_t));
+    azpEntry_t *root = NULL;
+    bool *placed = NULL;
+    if(replaced == NULL || keep == NULL) {
+        perror("Error allocating TOC");
+        goto cleanup;
+    }
+    memset(replaced, 0xFF, (index->count + 1) * sizeof(uint32_t));
+
+    if(remove_count > 0) {
+        /* Every pattern has to remove something */
+        bool *matched = malloc(remove_count * sizeof(bool));
+        removed = matched != NULL ? azp_index_select(index, remove, remove_count, &removed_count, matched) : NULL;
+        bool all_matched = removed != NULL;
+        for(size_t p = 0; all_matched && p < remove_count; ++p) {
+            all_matched = matched[p];
+        }
+        free(matched);
+        if(!all_matched) {
+            goto cleanup;
+        }
+    }
+    if(add_count > 0) {
+        azpHeader_t add_header;
+        added = azp_make_file_list(&add_header, add, add_count);
+        if(added == NULL) {
+            goto cleanup;
+        }
+        added_count = add_header.fields.file_count;
+        if(!azp_unique_names(added, &added_count)) {
+            perror("Error allocating TOC");
+            goto cleanup;
+        }
+    }
+    /* Directories make the added count known only now */
+    source = malloc(((size_t)index->count + added_count + 1) * sizeof(uint32_t));
+    root = calloc((size_t)index->count + added_count + 1, sizeof(azpEntry_t));
+    placed = calloc(added_count + 1, sizeof(bool));
+    if(source == NULL || root == NULL || placed == NULL) {
+        perror("Error allocating TOC");
+        goto cleanup;
+    }
+
+    /* Added files take the TOC place of an entry with the same name */
+    uint32_t replaced_count = 0;
+    for(uint32_t i = 0; i < added_count; ++i) {
+        uint32_t old = azp_index_find(index, added[i].filename);
+        if(old != AZP_NOT_FOUND && replaced[old] == AZP_NOT_FOUND) {
+            replaced[old] = i;
+            placed[i] = true;
+            ++replaced_count;
+        }
+    }
+    for(uint32_t i = 0; i < removed_count; ++i) {
+        if(replaced[removed[i]] == AZP_NOT_FOUND) {
+            replaced[removed[i]] = AZP_NOT_FOUND - 1; // dropped
+        }
+    }
+
+    /* New TOC in the old order, the rest of the added files at the end */
+    uint32_t count = 0;
+    uint32_t keep_count = 0;
+    size_t toc_sz = 0;
+    for(uint32_t i = 0; i < index->count; ++i) {
+        if(replaced[i] == AZP_NOT_FOUND - 1) {
+            continue;
+        }
+        if(replaced[i] != AZP_NOT_FOUND) {
+            root[count] = added[replaced[i]];
+            source[count] = replaced[i];
+        } else {
+            if((size_t)index->offset[i] + index->compressed_size[i] > archive_sz) {
+                fprintf(stderr, "Entry %s is past the end of the archive\n", azp_index_name(index, i));
+                goto cleanup;
+            }
+            if(!azp_entry_name(&root[count], azp_index_name(index, i))) {
+                goto cleanup;
+            }
+            root[count].compressed_size = index->compressed_size[i];
+            root[count].uncompressed_size = index->uncompressed_size[i];
+            source[count] = AZP_NOT_FOUND;
+            keep[keep_count].offset = index->offset[i];
+            keep[keep_count].index = count;
+            ++keep_count;
+        }
+        toc_sz += (sizeof(uint32_t) * 4) + root[count].filename_length;
+        ++count;
+    }
+    for(uint32_t i = 0; i < added_count; ++i) {
+        if(!placed[i]) {
+            root[count] = added[i];
+            source[count] = i;
+            toc_sz += (sizeof(uint32_t) * 4) + root[count].filename_length;
+            ++count;
+        }
+    }
 
-static uint8_t *azp_cipher(const uint8_t *restrict data, const size_t len, uint32_t *key);
+    header.fields.magic = azpHeaderMagic;
+    header.fields.version = AZP_VERSION;
+    header.fields.file_count = count;
+    header.fields.data_offset = sizeof(azpHeader_t) + toc_sz;
 
-bool azp_check_header(azpHeader_t *header, uint8_t *archive, size_t archive_sz) {
-    if(archive == NULL || archive_sz < sizeof(azpHeader_t)) {
-        return false;
+    if(result != NULL) {
+        memset(result, 0, sizeof(azpCompressResult_t));
+        result->kept = keep_count;
+        result->added = added_count;
+        result->removed = index->count - keep_count - replaced_count;
     }
-    memcpy(header->data, archive, sizeof(azpHeader_t));
-    if(azpHeaderMagic != header->fields.magic) {
-        return false;
+
+    outfd = azp_open_replacement(filename, archive_fd, &tmp_path);
+    if(outfd == -1) {
+        goto cleanup;
     }
-    return true;
+    if(azp_pwrite(outfd, &header, sizeof(azpHeader_t), 0) != 0) {
+        perror("Error writing header");
+        goto cleanup;
+    }
+
+    /* Kept blobs go first in their old order, runs that were back to back are copied in one go */
+    qsort(keep, keep_count, sizeof(azpKeep_t), azp_keep_cmp);
+    size_t offset = header.fields.data_offset;
+    size_t run_src = 0;
+    size_t run_dst = offset;
+    size_t run_len = 0;
+    for(uint32_t k = 0; k < keep_count; ++k) {
+        azpEntry_t *entry = &root[keep[k].index];
+        /* Entries sharing one blob keep sharing it */
+        if(k > 0 && keep[k].offset == keep[k-1].offset && entry->compressed_size == root[keep[k-1].index].compressed_size) {
+            entry->offset = root[keep[k-1].index].offset;
+            continue;
+        }
+        if(keep[k].offset != run_src + run_len) {
+            if(run_len > 0 && azp_copy_range(archive_fd, archive, run_src, outfd, run_dst, run_len) != 0) {
+                perror("Error copying entries");
+                goto cleanup;
+            }
+            run_src = keep[k].offset;
+            run_dst = offset;
+            run_len = 0;
+        }
+        entry->offset = offset;
+        offset += entry->compressed_size;
+        run_len += entry->compressed_size;
+    }
+    if(run_len > 0 && azp_copy_range(archive_fd, archive, run_src, outfd, run_dst, run_len) != 0) {
+        perror("Error copying entries");
+        goto cleanup;
+    }
+
+    /* Only the added files get compressed */
+    if(added_count > 0 && azp_compress_entries(added, added_count, offset, outfd, options, result) != 0) {
+        goto cleanup;
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        if(source[i] != AZP_NOT_FOUND) {
+            root[i].offset = added[source[i]].offset;
+            root[i].compressed_size = added[source[i]].compressed_size;
+        }
+    }
+
+    if(azp_write_toc(&header, root, outfd) != 0) {
+        goto cleanup;
+    }
+    /* Old archive stays until the new one is safely on disk */
+    if(fsync(outfd) != 0 || close(outfd) != 0) {
+        outfd = -1;
+        perror("Error closing archive");
+        unlink(tmp_path);
+        goto cleanup;
+    }
+    outfd = -1;
+    if(rename(tmp_path, filename) != 0) {
+        perror("Error replacing archive");
+        unlink(tmp_path);
+        goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    if(outfd != -1) {
+        close(outfd);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(replaced);
+    free(source);
+    free(keep);
+    free(root);
+    free(placed);
+    free(removed);
+    free(added);
+    return ret;
 }
 
 /*
- *       E X T R A C T I O N    F U N C S
+ * Old blob of a repacked archive, entries sharing data share one
  */
+typedef struct azpRepackBlob_t {
+    uint32_t offset;            // in the old archive
+    uint32_t compressed_size;   // old size
+    uint32_t uncompressed_size;
+    uint32_t entry;             // first entry stored in it, picks the level
+    uint32_t rank;              // position of the first entry sharing it in the new TOC
+    uint8_t *data;              // recompressed blob, NULL to copy the old one
+    size_t size;
+    size_t mapped;              // data is a scratch file mapping of this size, 0 if malloc()'d
+} azpRepackBlob_t;
 
-azpEntry_t *azp_get_file_list(azpHeader_t *header, uint8_t *restrict archive, size_t archive_sz) {
-    if(archive == NULL || archive_sz < (header->fields.file_count * sizeof(azpEntry_t))) {
-        return NULL;
+static int azp_repack_blob_cmp(const void *a, const void *b) {
+    const azpRepackBlob_t *ba = a;
+    const azpRepackBlob_t *bb = b;
+    if(ba->offset != bb->offset) {
+        return ba->offset < bb->offset ? -1 : 1;
     }
-    /* Allocate entry TOC */
-    azpEntry_t *out = calloc(header->fields.file_count, sizeof(azpEntry_t));
-    if(out == NULL) {
-        return NULL;
+    if(ba->compressed_size != bb->compressed_size) {
+        return ba->compressed_size < bb->compressed_size ? -1 : 1;
     }
-    uint32_t addr = 0;
-    uint32_t next_key = CIPHER_KEY;
-
-    uint8_t *toc = archive + sizeof(azpHeader_t);
-    
-    for(uint32_t i = 0; i < header->fields.file_count; ++i) {
-        uint8_t *data_out = NULL;
-
-        /* Decode filename lenght */
-        data_out = azp_cipher(toc + addr, 4, &next_key);
-        out[i].filename_length = (data_out[3] << 24) | (data_out[2] << 16) | (data_out[1] << 8) | (data_out[0]);;
-        addr += 4;
+    return ba->entry < bb->entry ? -1 : (ba->entry > bb->entry);
+}
 
-        /* Decode filename */
-        data_out = azp_cipher(toc + addr, out[i].filename_length, &next_key);
-        snprintf(out[i].filename, out[i].filename_length + 1, "%s", data_out);
-        addr += out[i].filename_length;
+static int azp_repack_rank_cmp(const void *a, const void *b) {
+    const azpRepackBlob_t *ba = a;
+    const azpRepackBlob_t *bb = b;
+    return ba->rank < bb->rank ? -1 : (ba->rank > bb->rank);
+}
 
-        /* Decode data offset */
-        data_out = azp_cipher(toc + addr, 4, &next_key);
-        out[i].offset = (uint32_t)(data_out[3] << 24) | (data_out[2] << 16) | (data_out[1] << 8) | (data_out[0]);
-        addr += 4;
+/*
+ * Shared state of repack workers for one window of blobs
+ */
+typedef struct azpRepackJob_t {
+    const azpIndex_t *index;
+    const uint8_t *archive;
+    const azpRepackOptions_t *options;
+    azpRepackBlob_t *blobs;
+    int64_t cpu_limit;          // process CPU time after which blobs are copied, 0 for none
+    uint32_t skipped;
+    pthread_mutex_t lock;
+} azpRepackJob_t;
 
-        /* Decode compressed size */
-        data_out = azp_cipher(toc + addr, 4, &next_key);
-        out[i].compressed_size = (data_out[3] << 24) | (data_out[2] << 16) | (data_out[1] << 8) | (data_out[0]);
-        addr += 4;
+static int64_t azp_process_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
 
-        /* Decode uncompressed size */
-        data_out = azp_cipher(toc + addr, 4, &next_key);
-        out[i].uncompressed_size = (data_out[3] << 24) | (data_out[2] << 16) | (data_out[1] << 8) | (data_out[0]);
-        addr += 4;
+/*
+ * Level a blob is recompressed with, automatic means the best the codec has
+ */
+static int azp_repack_level(const azpRepackOptions_t *options, const char *name) {
+    int level = azp_policy_rule_level(options->policy, name);
+    if(options->policy == NULL || level == AZP_LEVEL_AUTO || level == AZP_LEVEL_MAX) {
+        level = azp_codec_max_level();
     }
-    return out;
+    return level;
 }
 
-bool azp_extract_all(const azpHeader_t *header, const azpEntry_t *root, uint8_t *archive, size_t archive_sz) {
-    for(uint32_t i = 0; i < header->fields.file_count; ++i) {
-        printf("%6u/%-6u Extracting file %s (%zu bytes)...\n", 
-               i + 1, header->fields.file_count, root[i].filename, root[i].uncompressed_size);
-        if(azp_extract_file(root, i, archive, archive_sz) != 0) {
-            return false;
-        }
+static void azp_repack_blob_free(azpRepackBlob_t *blob) {
+    if(blob->mapped != 0) {
+        munmap(blob->data, blob->mapped);
+    } else {
+        free(blob->data);
     }
-    return true;
+    blob->data = NULL;
+    blob->mapped = 0;
 }
 
 /*
- *          C O M P R E S S I O N   F U N C S
+ * Maps a scratch file with room for the new blob and the inflated data after it,
+ * for blobs too big to hold in memory. The kernel can write the pages back.
+ * data_at - returns where the inflated data starts, page aligned
+ * returns the mapping of data_at + uncompressed_sz bytes, NULL if it failed
  */
+static uint8_t *azp_repack_scratch(size_t bound, size_t uncompressed_sz, size_t *data_at, int *fd) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    *data_at = (bound + page - 1) / page * page;
+    FILE *scratch = tmpfile();
+    if(scratch == NULL) {
+        return NULL;
+    }
+    int scratch_fd = dup(fileno(scratch));
+    fclose(scratch);
+    if(scratch_fd == -1) {
+        return NULL;
+    }
+    void *map = MAP_FAILED;
+    if(ftruncate(scratch_fd, *data_at + uncompressed_sz) == 0) {
+        map = mmap(NULL, *data_at + uncompressed_sz, PROT_READ | PROT_WRITE, MAP_SHARED, scratch_fd, 0);
+    }
+    if(map == MAP_FAILED) {
+        close(scratch_fd);
+        return NULL;
+    }
+    *fd = scratch_fd;
+    return map;
+}
 
-azpEntry_t *azp_make_file_list(azpHeader_t *header, char **file_list, size_t file_count) {
-    struct stat st;
-
-    /* Fill known values of header */
-    header->fields.magic = azpHeaderMagic;
-    header->fields.version = AZP_VERSION;
-    header->fields.file_count = file_count;
+/*
+ * Recompresses one blob through the codec, keeps the result only if it is smaller.
+ * Blobs over AZP_STREAM_THRESHOLD are done in a scratch file instead of in memory.
+ * returns 0 if ok
+ */
+static int azp_repack_job(void *ctx, uint32_t job_nr) {
+    azpRepackJob_t *job = ctx;
+    azpRepackBlob_t *blob = &job->blobs[job_nr];
+    if(job->cpu_limit != 0 && azp_process_cpu_ns() > job->cpu_limit) {
+        __atomic_add_fetch(&job->skipped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
 
-    /* Check if folders
-     * Probably a better way but fugg
-     */
-    uint32_t folders = 0;
-    for(uint32_t i = 0; i < header->fields.file_count; ++i) {
-        int stat_ret = stat(file_list[i], &st);
-        if(stat_ret != 0) {
-            return NULL;
+    const char *name = azp_index_name(job->index, blob->entry);
+    size_t bound = azp_codec_bound(blob->uncompressed_size);
+    uint8_t *data = NULL;
+    uint8_t *out = NULL;
+    size_t data_at = 0;
+    int scratch_fd = -1;
+    if(blob->uncompressed_size > AZP_STREAM_THRESHOLD) {
+        if((out = azp_repack_scratch(bound, blob->uncompressed_size, &data_at, &scratch_fd)) != NULL) {
+            data = out + data_at;
         }
-        /* If is folder then dissapear the list entry */
-        if(!S_ISREG(st.st_mode)) {
-            ++folders;
+    } else {
+        data = malloc(blob->uncompressed_size + 1);
+        out = malloc(bound);
+    }
+    if(data == NULL || out == NULL) {
+        if(scratch_fd == -1) {
+            free(data);
+            free(out);
         }
+        pthread_mutex_lock(&job->lock);
+        fprintf(stderr, "Out of memory repacking %s\n", name);
+        pthread_mutex_unlock(&job->lock);
+        return -1;
+    }
+    int ret = azp_codec_inflate(data, blob->uncompressed_size, job->archive + blob->offset, blob->compressed_size);
+    size_t out_sz = bound;
+    if(ret == Z_OK) {
+        ret = azp_codec_deflate(out, &out_sz, data, blob->uncompressed_size, azp_repack_level(job->options, name));
+        ret = ret == Z_OK && out_sz < blob->compressed_size ? Z_OK : Z_BUF_ERROR;
+    } else {
+        pthread_mutex_lock(&job->lock);
+        fprintf(stderr, "Error inflating %s (%d)\n", name, ret);
+        pthread_mutex_unlock(&job->lock);
     }
-    header->fields.file_count -= folders;
 
-    /* name_len, offset, compressed size and uncompressed size */
-    uint32_t offset = (sizeof(uint32_t) * 4) * header->fields.file_count;
-    azpEntry_t *out = calloc(header->fields.file_count, sizeof(azpEntry_t));
+    if(scratch_fd != -1) {
+        /* Only the new blob is kept until the writer gets to it, the file goes with the mapping */
+        munmap(data, blob->uncompressed_size);
+        if(ftruncate(scratch_fd, ret == Z_OK ? out_sz : 0) != 0) {
+            ret = ret == Z_OK ? Z_BUF_ERROR : ret;
+        }
+        close(scratch_fd);
+        if(ret == Z_OK) {
+            blob->data = out;
+            blob->size = out_sz;
+            blob->mapped = data_at;
+        } else {
+            munmap(out, data_at);
+        }
+    } else {
+        free(data);
+        if(ret == Z_OK) {
+            uint8_t *shrunk = realloc(out, out_sz);
+            blob->data = shrunk != NULL ? shrunk : out;
+            blob->size = out_sz;
+        } else {
+            free(out);
+        }
+    }
+    return ret == Z_OK || ret == Z_BUF_ERROR ? 0 : -1;
+}
 
-    for(uint32_t i = 0; i < header->fields.file_count; ++i) {
-        /* Set filename and filename lenght */
-        sprintf(out[i].filename, "%s", file_list[i]);
-        out[i].filename_length = strlen(out[i].filename);
+int azp_repack_archive(const char *filename, const char *out_filename, const azpIndex_t *index, const uint8_t *archive, size_t archive_sz,
+                       int archive_fd, const azpRepackOptions_t *options, azpRepackResult_t *result) {
+    int ret = -1;
+    int outfd = -1;
+    const char *target = out_filename != NULL ? out_filename : filename;
+    char *tmp_path = NULL;
+    azpEntry_t *root = calloc(index->count + 1, sizeof(azpEntry_t));
+    azpRepackBlob_t *blobs = calloc(index->count + 1, sizeof(azpRepackBlob_t));
+    uint32_t *blob_of = malloc((index->count + 1) * sizeof(uint32_t)); // per entry, its blob
+    azpWorkItem_t *items = malloc((index->count + 1) * sizeof(azpWorkItem_t));
+    uint32_t *order = malloc((index->count + 1) * sizeof(uint32_t));
+    uint32_t *layout = NULL;   // entry nrs. in their new TOC order, NULL to keep the old one
+    azpEntry_t *sorted = NULL; // TOC in that order
+    if(root == NULL || blobs == NULL || blob_of == NULL || items == NULL || order == NULL) {
+        perror("Error allocating TOC");
+        goto cleanup;
+    }
 
-        /* Increment offset by filename len */
-        offset += out[i].filename_length;
+    /* Same names, only offsets and compressed sizes change */
+    size_t toc_sz = 0;
+    for(uint32_t i = 0; i < index->count; ++i) {
+        if((size_t)index->offset[i] + index->compressed_size[i] > archive_sz) {
+            fprintf(stderr, "Entry %s is past the end of the archive\n", azp_index_name(index, i));
+            goto cleanup;
+        }
+        if(!azp_entry_name(&root[i], azp_index_name(index, i))) {
+            goto cleanup;
+        }
+        root[i].uncompressed_size = index->uncompressed_size[i];
+        toc_sz += (sizeof(uint32_t) * 4) + root[i].filename_length;
+        blobs[i].offset = index->offset[i];
+        blobs[i].compressed_size = index->compressed_size[i];
+        blobs[i].uncompressed_size = index->uncompressed_size[i];
+        blobs[i].entry = i;
+        blobs[i].rank = i;
+    }
+    if(options->layout != AZP_LAYOUT_KEEP) {
+        layout = azp_layout_order(root, index->count, options->layout, options->profile);
+        sorted = malloc((index->count + 1) * sizeof(azpEntry_t));
+        if(layout == NULL || sorted == NULL) {
+            if(sorted == NULL) {
+                perror("Error allocating TOC");
+            }
+            goto cleanup;
+        }
+        for(uint32_t i = 0; i < index->count; ++i) {
+            blobs[layout[i]].rank = i;
+        }
+    }
 
-        /* Set uncompressed size */
-        int stat_ret = stat(out[i].filename, &st);
-        if(stat_ret != 0) {
-            perror("Error reading file");
-            return NULL;
+    /* Blobs in their old data order, entries sharing one are done once */
+    qsort(blobs, index->count, sizeof(azpRepackBlob_t), azp_repack_blob_cmp);
+    uint32_t blob_count = 0;
+    for(uint32_t i = 0; i < index->count; ++i) {
+        if(blob_count == 0 || blobs[i].offset != blobs[blob_count-1].offset
+           || blobs[i].compressed_size != blobs[blob_count-1].compressed_size) {
+            blobs[blob_count++] = blobs[i];
+        } else if(blobs[i].rank < blobs[blob_count-1].rank) {
+            blobs[blob_count-1].rank = blobs[i].rank;
+        }
+        blob_of[blobs[i].entry] = blob_count - 1;
+    }
+    /* Entries that share a blob but claim different sizes can't share the new one */
+    for(uint32_t i = 0; i < index->count; ++i) {
+        if(index->uncompressed_size[i] != blobs[blob_of[i]].uncompressed_size) {
+            fprintf(stderr, "Entries sharing the data of %s disagree on its size\n", azp_index_name(index, i));
+            goto cleanup;
+        }
+    }
+    /* New layout, each blob moves to where its first entry now is */
+    if(layout != NULL) {
+        for(uint32_t i = 0; i < index->count; ++i) {
+            blob_of[i] = blobs[blob_of[i]].rank;
+        }
+        qsort(blobs, blob_count, sizeof(azpRepackBlob_t), azp_repack_rank_cmp);
+        for(uint32_t b = 0; b < blob_count; ++b) {
+            order[blobs[b].rank] = b;
+        }
+        for(uint32_t i = 0; i < index->count; ++i) {
+            blob_of[i] = order[blob_of[i]];
         }
-        out[i].uncompressed_size = st.st_size;
     }
-    header->fields.data_offset = offset + 16;
-#ifdef DEBUG
-    printf("offset: 0x%08X\n", header->fields.data_offset);
-#endif
 
-    return out;
-}
+    azpHeader_t header;
+    header.fields.magic = azpHeaderMagic;
+    header.fields.version = AZP_VERSION;
+    header.fields.file_count = index->count;
+    header.fields.data_offset = sizeof(azpHeader_t) + toc_sz;
 
-int azp_compress_files(const azpHeader_t *header, azpEntry_t *root, const char *filename) {
-    const char *errWritingTOC = "Error writing TOC\n";
-    FILE *outfile = fopen(filename, "wb");
-    if(outfile == NULL) {
-        perror("Error opening file");
-        return -1;
+    outfd = azp_open_replacement(target, archive_fd, &tmp_path);
+    if(outfd == -1) {
+        goto cleanup;
     }
-
-    /* Write header */
-    if(fwrite(header, sizeof(uint32_t), 4, outfile) != 4) {
+    if(azp_pwrite(outfd, &header, sizeof(azpHeader_t), 0) != 0) {
         perror("Error writing header");
-        goto fail_outfile;
+        goto cleanup;
     }
 
-    uint32_t next_key = CIPHER_KEY;
-    uint32_t offset = header->fields.data_offset;
-
-    /* Write TOC */
-    for(uint32_t i = 0; i < header->fields.file_count; ++i) {
-        printf("%6u/%-6u Compressing file %s (%zu bytes)...\n", 
-               i+1, header->fields.file_count, root[i].filename, root[i].uncompressed_size);
+    azpRepackJob_t job = {
+        .index = index,
+        .archive = archive,
+        .options = options,
+        .cpu_limit = options->cpu_budget > 0 ? azp_process_cpu_ns() + (int64_t)(options->cpu_budget * 1e9) : 0,
+        .skipped = 0
+    };
+    pthread_mutex_init(&job.lock, NULL);
+    azpProgress_t progress;
+    azp_progress_start(&progress, "Repacked", blob_count);
 
-        /* Compress file to disk */
-        if(azp_compress_file(root[i].filename, &root[i].compressed_size) != 0) {
-            goto fail_outfile;
+    /*
+     * Windows of blobs are recompressed in parallel and written in blob order, so
+     * only one window of new blobs is held in memory
+     */
+    size_t offset = header.fields.data_offset;
+    uint32_t smaller = 0;
+    uint32_t start = 0;
+    bool failed = false;
+    while(!failed && start < blob_count) {
+        uint32_t end = start;
+        size_t window_sz = 0;
+        while(end < blob_count && (end == start || window_sz + blobs[end].compressed_size <= AZP_COMPRESS_MEMORY)) {
+            window_sz += blobs[end].compressed_size;
+            items[end - start].size = blobs[end].uncompressed_size;
+            items[end - start].index = end - start;
+            ++end;
         }
-
-        uint8_t *cipher_data;
-
-        /* Filename len */
-        cipher_data = azp_cipher((uint8_t*)&root[i].filename_length, 4, &next_key);
-        if(fwrite(cipher_data, sizeof(uint32_t), 1, outfile) != 1) {
-            perror(errWritingTOC);
-            goto fail_outfile;
+        uint32_t window = end - start;
+        qsort(items, window, sizeof(azpWorkItem_t), azp_work_cmp);
+        for(uint32_t i = 0; i < window; ++i) {
+            order[i] = items[i].index;
         }
-
-        /* Filename */
-        cipher_data = azp_cipher((uint8_t*)root[i].filename, root[i].filename_length, &next_key);
-        if(fwrite(cipher_data, sizeof(char), root[i].filename_length, outfile) != root[i].filename_length) {
-            perror(errWritingTOC);
-            goto fail_outfile;
+        job.blobs = blobs + start;
+        if(azp_pool_run(options->threads, order, window, azp_repack_job, &job) != 0) {
+            failed = true;
         }
-        root[i].offset = offset;
 
-        /* Offset */
-        cipher_data = azp_cipher((uint8_t*)&root[i].offset, 4, &next_key);
-        if(fwrite(cipher_data, sizeof(uint32_t), 1, outfile) != 1) {
-            perror(errWritingTOC);
-            goto fail_outfile;
+        for(uint32_t b = start; b < end; ++b) {
+            azpRepackBlob_t *blob = &blobs[b];
+            if(failed) {
+                azp_repack_blob_free(blob);
+                continue;
+            }
+            int wret;
+            if(blob->data != NULL) {
+                azpSpan_t span;
+                azp_span_begin(&span);
+                wret = azp_pwrite(outfd, blob->data, blob->size, offset);
+                azp_span_end(&span, AZP_PHASE_ARCHIVE, blob->size, blob->size, 1);
+                azp_repack_blob_free(blob);
+                ++smaller;
+            } else {
+                blob->size = blob->compressed_size;
+                wret = azp_copy_range(archive_fd, archive, blob->offset, outfd, offset, blob->size);
+            }
+            if(wret != 0) {
+                perror("Error writing compressed archive");
+                failed = true;
+                continue;
+            }
+            blob->offset = offset;
+            offset += blob->size;
+            azp_progress_step(&progress, azp_index_name(index, blob->entry), blob->uncompressed_size);
         }
+        start = end;
+    }
+    pthread_mutex_destroy(&job.lock);
+    azp_progress_end(&progress);
+    if(failed) {
+        goto cleanup;
+    }
 
-        /* Compressed size */
-        cipher_data = azp_cipher((uint8_t*)&root[i].compressed_size, 4, &next_key);
-        if(fwrite(cipher_data, sizeof(uint32_t), 1, outfile) != 1) {
-            perror(errWritingTOC);
-            goto fail_outfile;
+    for(uint32_t i = 0; i < index->count; ++i) {
+        root[i].offset = blobs[blob_of[i]].offset;
+        root[i].compressed_size = blobs[blob_of[i]].size;
+    }
+    if(offset > UINT32_MAX) {
+        fprintf(stderr, "Repacked archive is too big\n");
+        goto cleanup;
+    }
+    const azpEntry_t *toc = root;
+    if(layout != NULL) {
+        for(uint32_t i = 0; i < index->count; ++i) {
+            sorted[i] = root[layout[i]];
         }
-        offset += root[i].compressed_size;
+        toc = sorted;
+    }
+    if(azp_write_toc(&header, toc, outfd) != 0) {
+        goto cleanup;
+    }
+    if(fsync(outfd) != 0 || close(outfd) != 0) {
+        outfd = -1;
+        perror("Error closing archive");
+        unlink(tmp_path);
+        goto cleanup;
+    }
+    outfd = -1;
+    if(rename(tmp_path, target) != 0) {
+        perror("Error replacing archive");
+        unlink(tmp_path);
+        goto cleanup;
+    }
+    if(result != NULL) {
+        result->blobs = blob_count;
+        result->smaller = smaller;
+        result->skipped = job.skipped;
+        result->old_size = archive_sz;
+        result->new_size = offset;
+    }
+    ret = 0;
 
-        /* Uncompressed size */
-        cipher_data = azp_cipher((uint8_t*)&root[i].uncompressed_size, 4, &next_key);
-        if(fwrite(cipher_data, sizeof(uint32_t), 1, outfile) != 1) {
-            perror(errWritingTOC);
-            goto fail_outfile;
-        }
+cleanup:
+    if(outfd != -1) {
+        close(outfd);
+        unlink(tmp_path);
     }
+    free(tmp_path);
+    free(root);
+    free(blobs);
+    free(blob_of);
+    free(items);
+    free(order);
+    free(layout);
+    free(sorted);
+    return ret;
+}
 
-    FILE *compressed;
+/*
+ *          B A T C H   F U N C S
+ */
 
-    /* Append all compressed files to the archive */
-    for(uint32_t i = 0; i < header->fields.file_count; ++i) {
-        compressed = fopen(root[i].filename, "rb");
-        if(compressed == NULL) {
-            perror("Error opening compressed file for reading");
-            return -1;
+/*
+ * One archive of a batch run and its share of the pool
+ */
+typedef struct azpBatchArchive_t {
+    azpArchive_t *archive;  // extract and test
+    char *subdir;           // extract
+    azpExtractJob_t extract;
+    azpTestJob_t test;
+    azpEntry_t *root;       // compress
+    azpHeader_t header;
+    azpDedup_t dedup;
+    azpCompressJob_t compress;
+    const azpBatchItem_t *item;
+    const azpCompressOptions_t *options;
+    azpCompressMemory_t *mem;
+    azpProgress_t *progress;
+    int outfd;
+    bool ready;             // set up, its jobs are in the pool
+    azpBatchResult_t result; // compress sets it when the pool is done with it
+} azpBatchArchive_t;
+
+/*
+ * Output directory of an archive, its file name without the .azp extension
+ * returns malloc()'d name or NULL
+ */
+static char *azp_batch_subdir(const char *archive) {
+    const char *base = strrchr(archive, '/');
+    base = base != NULL ? base + 1 : archive;
+    size_t len = strlen(base);
+    if(len > 4 && strcasecmp(base + len - 4, ".azp") == 0) {
+        return strndup(base, len - 4);
+    }
+    /* Can't take the name of the archive itself */
+    char *subdir = malloc(len + sizeof(".d"));
+    if(subdir != NULL) {
+        sprintf(subdir, "%s.d", base);
+    }
+    return subdir;
+}
+
+/*
+ * Opens an archive and queues its extraction or test
+ * returns number of pool jobs, -1 if it can't be done
+ */
+static int64_t azp_batch_open(azpBatchArchive_t *batch, azpBatchJob_t job, const char *filename, unsigned flags, azpProgress_t *progress) {
+    int ret = azp_archive_open(&batch->archive, filename, flags);
+    if(ret != AZP_OK) {
+        batch->result.status = AZP_BATCH_OPEN;
+        batch->result.error = ret;
+        batch->result.sys_errno = errno;
+        batch->archive = NULL;
+        return -1;
+    }
+    const azpIndex_t *index = azp_archive_index(batch->archive);
+    size_t archive_sz;
+    const uint8_t *archive = azp_archive_data(batch->archive, &archive_sz);
+    if(job == AZP_BATCH_TEST) {
+        return azp_test_prepare(&batch->test, azp_archive_header(batch->archive), index, archive, archive_sz, progress);
+    }
+    return azp_extract_prepare(&batch->extract, batch->subdir, index, NULL, index->count, archive, archive_sz, progress);
+}
+
+/*
+ * Lists the files of an archive to compress, the archive itself is only created
+ * once the pool gets to it in azp_batch_begin
+ * returns number of pool jobs, -1 if it can't be done
+ */
+static int64_t azp_batch_list(azpBatchArchive_t *batch, const azpBatchItem_t *item, const azpCompressOptions_t *options) {
+    batch->root = azp_make_file_list(&batch->header, item->files, item->file_count);
+    if(batch->root == NULL || azp_names_collide(batch->root, batch->header.fields.file_count)) {
+        batch->result.status = AZP_BATCH_FILES;
+        return -1;
+    }
+    uint32_t count = batch->header.fields.file_count;
+    if(azp_layout_entries(batch->root, count, options) != 0) {
+        batch->result.status = AZP_BATCH_FAILED;
+        return -1;
+    }
+    /* An empty archive still needs a job to get written */
+    return count > 0 ? count : 1;
+}
+
+/*
+ * Creates the archive, writes its header and starts its writer
+ * returns 0 if OK
+ */
+static int azp_batch_begin(void *ctx) {
+    azpBatchArchive_t *batch = ctx;
+    uint32_t count = batch->header.fields.file_count;
+    batch->outfd = open(batch->item->archive, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(batch->outfd == -1) {
+        perror("Error opening file");
+        return -1;
+    }
+    if(azp_pwrite(batch->outfd, &batch->header, sizeof(azpHeader_t), 0) != 0) {
+        perror("Error writing header");
+        return -1;
+    }
+    if(azp_dedup_prepare(&batch->dedup, batch->root, count, batch->options) != 0) {
+        return -1;
+    }
+    /* Duplicates are not compressed, they leave the count */
+    __atomic_sub_fetch(&batch->progress->total, count - batch->dedup.distinct, __ATOMIC_RELAXED);
+    return azp_compress_begin(&batch->compress, batch->dedup.first, batch->dedup.distinct, batch->header.fields.data_offset,
+                              batch->outfd, batch->options, batch->mem, batch->progress);
+}
+
+static int azp_batch_compress_job(void *ctx, uint32_t job_nr) {
+    azpBatchArchive_t *batch = ctx;
+    /* Jobs were counted before deduplication, the ones past the distinct files have nothing to do */
+    if(job_nr >= batch->dedup.distinct) {
+        return 0;
+    }
+    return azp_compress_job(&batch->compress, job_nr);
+}
+
+/*
+ * Waits for the writer and finishes the archive, a failed one is removed
+ * error - a job or azp_batch_begin failed
+ */
+static void azp_batch_end(void *ctx, int error) {
+    azpBatchArchive_t *batch = ctx;
+    uint32_t count = batch->header.fields.file_count;
+    int ret = azp_compress_end(&batch->compress, error != 0);
+    azp_dedup_finish(&batch->dedup, batch->root, count, ret == 0, NULL);
+    if(ret == 0) {
+        ret = azp_write_toc(&batch->header, batch->root, batch->outfd);
+    }
+    if(batch->outfd != -1) {
+        if(close(batch->outfd) != 0 && ret == 0) {
+            perror("Error closing archive");
+            ret = -1;
+        }
+        if(ret != 0) {
+            unlink(batch->item->archive);
         }
+        batch->outfd = -1;
+    }
+    batch->result.status = ret == 0 ? AZP_BATCH_OK : AZP_BATCH_FAILED;
+    free(batch->root);
+    batch->root = NULL;
+}
 
-        uint8_t block[CHUNK_SZ+1];
-        int chunksize = CHUNK_SZ;
-        int written = 0;
+uint32_t azp_batch_run(azpBatchJob_t job, const azpBatchItem_t *items, size_t count, const azpCompressOptions_t *options, unsigned flags,
+                       azpBatchResult_t *results) {
+    azpBatchArchive_t *batch = calloc(count + 1, sizeof(azpBatchArchive_t));
+    azpPoolPart_t *parts = calloc(count + 1, sizeof(azpPoolPart_t));
+    if(batch == NULL || parts == NULL) {
+        free(batch);
+        free(parts);
+        for(size_t i = 0; results != NULL && i < count; ++i) {
+            memset(&results[i], 0, sizeof(azpBatchResult_t));
+            results[i].status = AZP_BATCH_FAILED;
+        }
+        return count;
+    }
 
-        /* Append files in chunks, some might be big */
-        while(written != root[i].compressed_size) {
-            if(chunksize > (root[i].compressed_size - written)) {
-                chunksize = (root[i].compressed_size - written);
+    static const char *verbs[] = { "Extracted", "Tested", "Compressed" };
+    azpProgress_t progress;
+    /* One memory budget for all archives being compressed */
+    azpCompressMemory_t mem;
+    memset(&mem, 0, sizeof(azpCompressMemory_t));
+    pthread_mutex_init(&mem.lock, NULL);
+    pthread_cond_init(&mem.cond, NULL);
+    uint64_t total = 0;
+    for(size_t i = 0; i < count; ++i) {
+        batch[i].outfd = -1;
+        batch[i].item = &items[i];
+        batch[i].options = options;
+        batch[i].mem = &mem;
+        batch[i].progress = &progress;
+        if(job == AZP_BATCH_EXTRACT) {
+            batch[i].subdir = azp_batch_subdir(items[i].archive);
+            batch[i].result.status = batch[i].subdir == NULL ? AZP_BATCH_FAILED : AZP_BATCH_OK;
+            for(size_t j = 0; batch[i].subdir != NULL && j < i; ++j) {
+                if(batch[j].subdir != NULL && strcmp(batch[i].subdir, batch[j].subdir) == 0) {
+                    batch[i].result.status = AZP_BATCH_SUBDIR;
+                    batch[i].result.other = j;
+                    free(batch[i].subdir);
+                    batch[i].subdir = NULL;
+                    break;
+                }
             }
-            if(fread(block, sizeof(uint8_t), chunksize, compressed) != chunksize) {
-                perror("Error reading compressed archive");
-                goto fail_compressed;
+            if(batch[i].subdir == NULL) {
+                continue;
             }
-            if(fwrite(block, sizeof(uint8_t), chunksize, outfile) != chunksize) {
-                perror("Error writing compressed archive");
-                goto fail_compressed;
-            }
-            written += chunksize;
         }
 
-        fflush(compressed);
-        fclose(compressed);
-        /* Delete compressed temporary files */
-        remove(root[i].filename);
-        continue;
-
-fail_compressed:
-        fclose(compressed);
-        goto fail_outfile;
+        int64_t jobs = job == AZP_BATCH_COMPRESS ? azp_batch_list(&batch[i], &items[i], options)
+                                                 : azp_batch_open(&batch[i], job, items[i].archive, flags, &progress);
+        if(jobs < 0) {
+            continue;
+        }
+        batch[i].ready = true;
+        if(job == AZP_BATCH_COMPRESS) {
+            /* Created, compressed and closed while the pool is on them, azp_batch_end says how it went */
+            batch[i].result.status = AZP_BATCH_FAILED;
+            total += batch[i].header.fields.file_count;
+            parts[i].job = azp_batch_compress_job;
+            parts[i].ctx = &batch[i];
+            parts[i].begin = azp_batch_begin;
+            parts[i].end = azp_batch_end;
+        } else {
+            total += azp_archive_index(batch[i].archive)->count;
+            parts[i].job = job == AZP_BATCH_EXTRACT ? azp_extract_job : azp_test_job;
+            parts[i].ctx = job == AZP_BATCH_EXTRACT ? (void*)&batch[i].extract : (void*)&batch[i].test;
+        }
+        parts[i].job_count = jobs;
     }
 
-    fflush(outfile);
-    fclose(outfile);
-
-    return 0;
+    /* Archives that could not be set up have no jobs and are passed over */
+    azp_progress_start(&progress, verbs[job], total);
+    (void)azp_pool_run_parts(options->threads, parts, count);
+    azp_progress_end(&progress);
 
-fail_outfile:
-    fclose(outfile);
-    return -1;
+    uint32_t failed = 0;
+    for(size_t i = 0; i < count; ++i) {
+        if(batch[i].ready) {
+            switch(job) {
+            case AZP_BATCH_EXTRACT:
+                azp_extract_finish(&batch[i].extract);
+                if(parts[i].error != 0) {
+                    batch[i].result.status = AZP_BATCH_FAILED;
+                }
+                break;
+            case AZP_BATCH_TEST:
+                if(!azp_test_finish(&batch[i].test) || parts[i].error != 0) {
+                    batch[i].result.status = AZP_BATCH_DAMAGED;
+                }
+                break;
+            case AZP_BATCH_COMPRESS:
+                break;
+            }
+        }
+        if(batch[i].result.status != AZP_BATCH_OK) {
+            ++failed;
+        }
+        if(results != NULL) {
+            results[i] = batch[i].result;
+        }
+        free(batch[i].root);
+        azp_archive_close(batch[i].archive);
+        free(batch[i].subdir);
+    }
+    pthread_cond_destroy(&mem.cond);
+    pthread_mutex_destroy(&mem.lock);
+    free(batch);
+    free(parts);
+    return failed;
 }
 
 /*
@@ -265,18 +3684,15 @@ fail_outfile:
  * Huge thanks to Stanislav Bobovych for the blog post and code where this cipher code was adapted from!
  * https://stan-bobovych.com/2017/08/12/239/
  *
+ * The keystream only depends on the product of both state halves, so the same
+ * function encrypts and decrypts. Key state carries over between calls, any
+ * contiguous region can be done in one call. output may be the same as data.
 */
-static uint8_t *azp_cipher(const uint8_t *restrict data, const size_t len, uint32_t *key) {
-    if(len == 0) {
-        printf("Lenght to cipher is 0!\n");
-        return NULL;
-    }
-    static uint8_t output[MAX_FILENAME];
-
+static void azp_cipher(uint8_t *output, const uint8_t *data, size_t len, uint32_t *key) {
     uint32_t y = 0x0000FFFF & *key;
     uint32_t x = 0x0000FFFF & (*key >> 16);
 
-    for(uint32_t i = 0; i < len; ++i) {
+    for(size_t i = 0; i < len; ++i) {
         uint32_t tmp = x * y;
         x = 0x0000FFFF & tmp;
         y = 0x0000FFFF & (tmp >> 16);
@@ -286,9 +3702,7 @@ static uint8_t *azp_cipher(const uint8_t *restrict data, const size_t len, uint3
         y = x ^ y;
         output[i] = y & 0x000000FF;
     }
-    output[len] = '\0';
     *key = (x << 0x10) | y;
-    return output;
 }
 
 /*
@@ -306,98 +3720,68 @@ static uint8_t *azp_cipher(const uint8_t *restrict data, const size_t len, uint3
 /*
  * Mostly from zlib zpipe.c example
  */
-int azp_extract_file(const azpEntry_t *root, const uint32_t index, const uint8_t *archive, const size_t archive_sz) {
-    if(archive == NULL || root == NULL) {
-        return -1;
-    }
-    FILE *outfile;
-    
-    /* Lets check if its in a subfolder */
-    char *slash = strchr(root[index].filename, '\\');
-    if(slash != NULL) {
-        /* Ugly directory name splitting */
-        char dirname[32] = { '\0' };
-        char path[64] = { '\0' };
-        strcpy(dirname, root[index].filename);
-        dirname[slash - root[index].filename] = '\0';
-        sprintf(path, "./%s/%s", dirname, slash+1);
-#ifdef WIN32
-        mkdir(dirname);
-#else
-        mkdir(dirname, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-#endif
-        outfile = fopen(path, "wb");
-    } else {
-        outfile = fopen(root[index].filename, "wb");
-    }
-    if(outfile == NULL) {
+int azp_extract_file(const azpIndex_t *idx, const uint32_t index, const uint8_t *archive, const size_t archive_sz) {
+    if(archive == NULL || idx == NULL || index >= idx->count) {
         return -1;
     }
-    uint8_t *data = (uint8_t*)archive + root[index].offset;
-    
-    int ret;
-    int written = 0;
-    unsigned have;
-    z_stream strm;
-    uint8_t out[CHUNK_SZ];
-    size_t chunksize = CHUNK_SZ;
-
-    /* allocate inflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    ret = inflateInit(&strm);
-    if (ret != Z_OK) {
-        fclose(outfile);
-        return ret;
+    azpOutDir_t *out = azp_outdir_open(NULL, idx, &index, 1);
+    if(out == NULL) {
+        return Z_MEM_ERROR;
     }
-
-    /* decompress until deflate stream ends or end of file */
-    do {
-        strm.avail_in = archive_sz;
-        strm.next_in = data;
-        /* run inflate() on input until output buffer not full */
-        do {
-            strm.avail_out = chunksize;
-            strm.next_out = out;
-            ret = inflate(&strm, Z_NO_FLUSH);
-            assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-            switch (ret) {
-            case Z_NEED_DICT:
-                ret = Z_DATA_ERROR;     /* and fall through */
-            case Z_DATA_ERROR:
-            case Z_MEM_ERROR:
-                (void)inflateEnd(&strm);
-                return ret;
-            }
-            have = chunksize- strm.avail_out;
-            if (fwrite(out, 1, have, outfile) != have || ferror(outfile)) {
-                (void)inflateEnd(&strm);
-                return Z_ERRNO;
-            }
-        } while (strm.avail_out == 0);
-        /* done when inflate() says it's done */
-        written += chunksize;
-    } while (written < root[index].uncompressed_size);
-    (void)inflateEnd(&strm);
-
-    fflush(outfile);
-    fclose(outfile);
-    return 0;
+    int ret = azp_extract_one(out, idx, index, archive, archive_sz);
+    azp_outdir_close(out);
+    return ret;
 }
 
-int azp_compress_file(char *filename, size_t *filesize) {
+int azp_compress_file(const char *filename, int level, uint8_t **blob, size_t *blob_sz) {
     struct stat st;
     FILE *source = fopen(filename, "rb");
     if(source == NULL) {
         return -1;
     }
-    strcat(filename, ".tmp");
-    FILE *dest = fopen(filename, "wb");
-    if(dest == NULL) {
+    if(fstat(fileno(source), &st) != 0) {
+        fclose(source);
+        return -1;
+    }
+
+    /* Read it whole, then deflate in one call */
+    size_t in_sz = st.st_size;
+    uint8_t *in = malloc(in_sz + 1);
+    if(in == NULL) {
+        fclose(source);
+        return Z_MEM_ERROR;
+    }
+    azpSpan_t span;
+    azp_span_begin(&span);
+    if(fread(in, 1, in_sz, source) != in_sz || ferror(source)) {
+        free(in);
         fclose(source);
+        return Z_ERRNO;
+    }
+    fclose(source);
+    azp_span_end(&span, AZP_PHASE_READ, in_sz, 0, 1);
+
+    size_t out_sz = azp_codec_bound(in_sz);
+    uint8_t *out = malloc(out_sz);
+    if(out == NULL) {
+        free(in);
+        return Z_MEM_ERROR;
+    }
+    int ret = azp_codec_deflate(out, &out_sz, in, in_sz, level);
+    free(in);
+    if(ret != Z_OK) {
+        free(out);
+        return ret;
+    }
+
+    *blob = out;
+    *blob_sz = out_sz;
+    return Z_OK;
+}
+
+int azp_compress_stream(const char *filename, int level, int fd, size_t offset, size_t *compressed_sz) {
+    FILE *source = fopen(filename, "rb");
+    if(source == NULL) {
         return -1;
     }
 
@@ -406,15 +3790,17 @@ int azp_compress_file(char *filename, size_t *filesize) {
     z_stream strm;
     unsigned char in[CHUNK_SZ];
     unsigned char out[CHUNK_SZ];
+    size_t written = 0;
+    azpSpan_t span;
+    azp_span_begin(&span);
 
     /* allocate deflate state */
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
-    ret = deflateInit(&strm, Z_DEFAULT_COMPRESSION);
+    ret = deflateInit(&strm, level > Z_BEST_COMPRESSION ? Z_BEST_COMPRESSION : level);
     if (ret != Z_OK) {
         fclose(source);
-        fclose(dest);
         return ret;
     }
 
@@ -424,7 +3810,6 @@ int azp_compress_file(char *filename, size_t *filesize) {
         if (ferror(source)) {
             (void)deflateEnd(&strm);
             fclose(source);
-            fclose(dest);
             return Z_ERRNO;
         }
         flush = feof(source) ? Z_FINISH : Z_NO_FLUSH;
@@ -438,10 +3823,12 @@ int azp_compress_file(char *filename, size_t *filesize) {
             ret = deflate(&strm, flush);    /* no bad return value */
             assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
             have = CHUNK_SZ - strm.avail_out;
-            if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
+            if (azp_pwrite(fd, out, have, offset + written) != 0) {
                 (void)deflateEnd(&strm);
+                fclose(source);
                 return Z_ERRNO;
             }
+            written += have;
         } while (strm.avail_out == 0);
         assert(strm.avail_in == 0);     /* all input will be used */
 
@@ -450,18 +3837,10 @@ int azp_compress_file(char *filename, size_t *filesize) {
     assert(ret == Z_STREAM_END);        /* stream will be complete */
 
     /* clean up and return */
+    azp_span_end(&span, AZP_PHASE_DEFLATE, strm.total_in, written, 1);
     (void)deflateEnd(&strm);
-
-    fflush(dest);
     fclose(source);
-    fclose(dest);
-
-    int stat_ret = stat(filename, &st);
-    if(stat_ret != 0) {
-        perror("Error reading filesize");
-        return -1;
-    }
-    *filesize = st.st_size;
+    *compressed_sz = written;
 
     return Z_OK;
 }
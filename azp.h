@@ -2,17 +2,16 @@
  * library for working with 7,62HC .AZP archives
  *
  * Licenced under GPLv3
- *
- * Bugs:
- * 15k allocs on big files and 100mb alloc'd, reduce it
 */
 #ifndef _AZP_H_
 #define _AZP_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 #define MAX_FILENAME 255
+#define AZP_NOT_FOUND UINT32_MAX
 
 /*
  * Archive header structure
@@ -37,8 +36,29 @@ typedef struct azpEntry_t {
     size_t uncompressed_size;
     uint8_t filename_length; // lenght of filename
     char filename[MAX_FILENAME];
+    const char *path; // file to read when compressing, NULL if it is filename
 } azpEntry_t;
 
+/*
+ * Decoded TOC of an archive, structure of arrays
+ * Arrays and the filename pool share one block of memory
+ */
+typedef struct azpIndex_t {
+    uint32_t count;              // number of entries
+    uint32_t *offset;            // offset from start of file
+    uint32_t *compressed_size;
+    uint32_t *uncompressed_size;
+    uint32_t *name;              // offset of the filename in names
+    uint32_t *hash;              // open addressed name table, entry nr. + 1, 0 if empty
+    uint32_t hash_slots;         // power of two
+    char *names;                 // packed pool of NUL terminated filenames
+    uint32_t names_size;         // bytes used in names
+    void *mem;                   // the block everything above points into
+    bool owned;                  // mem was allocated by azp_index_decode
+    void *map;                   // sidecar file mapping mem lives in, if loaded from one
+    size_t map_sz;
+} azpIndex_t;
+
 /*
  * Checks if the file is a valid AZP archive and fills in the header
  * header - empty header structure
@@ -48,35 +68,446 @@ typedef struct azpEntry_t {
 bool azp_check_header(azpHeader_t *header, uint8_t *archive, size_t archive_sz);
 
 /*
- * Gets the file list inside of archive
- * header - alpeady filled AZP header
- * archive - pointer to archive data
- * returns an array of all entries, count = header.file_count, NULL on error
- * MUST BE FREE()'d AFTER USE!!
+ * Returns the number of bytes azp_index_decode needs for the archive, 0 if the header is bad
+ * header - already filled AZP header
  */
-azpEntry_t *azp_get_file_list(azpHeader_t *header, uint8_t *restrict archive, size_t archive_sz);
+size_t azp_index_size(const azpHeader_t *header);
 
 /*
- * Extracts all files from archive
- * header - filled azp header
- * root - filled start of azp entries array
+ * Deciphers the whole TOC in one pass into a compact index
+ * Reentrant, does not allocate if memory is passed in
+ * index - index to fill
+ * header - already filled AZP header
  * archive - pointer to archive data
+ * mem - at least azp_index_size() bytes, or NULL to allocate one block
+ * mem_sz - size of mem
+ * returns true if ok, false if the TOC is damaged or memory is short
+ */
+bool azp_index_decode(azpIndex_t *index, const azpHeader_t *header, const uint8_t *archive, size_t archive_sz, void *mem, size_t mem_sz);
+
+/*
+ * Maps a sidecar index file if it was made from this archive
+ * Valid only while archive size, mtime and header checksum match, name offsets
+ * and hash slots are checked before the index is used
+ * index - index to fill, read-only
+ * idx_path - sidecar filename, e.g. archive.azp.idx
+ * header - already filled AZP header
+ * archive_fd - opened archive
+ * returns true if loaded, false if missing, stale or damaged
+ */
+bool azp_index_load(azpIndex_t *index, const char *idx_path, const azpHeader_t *header, int archive_fd);
+
+/*
+ * Writes the decoded index to a sidecar file for azp_index_load
+ * Replaces the file atomically
+ * returns true if ok
+ */
+bool azp_index_save(const azpIndex_t *index, const char *idx_path, const azpHeader_t *header, int archive_fd);
+
+/*
+ * Frees the index memory if azp_index_decode allocated it or unmaps the sidecar
+ */
+void azp_index_free(azpIndex_t *index);
+
+/*
+ * Filename of entry i
+ */
+static inline const char *azp_index_name(const azpIndex_t *index, uint32_t i) {
+    return index->names + index->name[i];
+}
+
+/*
+ * Looks up an entry by filename in O(1)
+ * Forward and back slashes are the same, case is ignored
+ * returns entry nr. or AZP_NOT_FOUND
+ */
+uint32_t azp_index_find(const azpIndex_t *index, const char *name);
+
+/*
+ * Matches a filename against a glob pattern
+ * '*' matches any run of characters including path separators, '?' one character
+ * Compares like azp_index_find
+ */
+bool azp_glob_match(const char *pattern, const char *name);
+
+/*
+ * Collects the entries matching any of the names or glob patterns
+ * Plain names are looked up through the hash table, patterns scan the index
+ * Entries come in pattern order, each only once
+ * count - returns number of entries there
+ * matched - pattern_count flags, returns there whether each pattern matched something, can be NULL
+ * returns malloc()'d list of entry nr., NULL if out of memory
+ */
+uint32_t *azp_index_select(const azpIndex_t *index, char **patterns, size_t pattern_count, uint32_t *count, bool *matched);
+
+/*
+ * Extracts all files from archive on a pool of worker threads
+ * Entries are handed out biggest uncompressed_size first
+ * index - decoded TOC
+ * archive - pointer to archive data, shared read-only by all workers
+ * threads - number of worker threads, 0 for one per online CPU
  * returns true if ok, false if not
  */
-bool azp_extract_all(const azpHeader_t *header, const azpEntry_t *root, uint8_t *archive, size_t archive_sz);
+bool azp_extract_all(const azpIndex_t *index, const uint8_t *archive, size_t archive_sz, unsigned threads);
+
+/*
+ * Extracts the files matching any of the names or glob patterns, see azp_index_select
+ * patterns - names or glob patterns
+ * pattern_count - number of patterns
+ * matched - as for azp_index_select, can be NULL
+ * returns true if ok, false if something failed or, with matched, a pattern matched nothing
+ */
+bool azp_extract_matching(const azpIndex_t *index, char **patterns, size_t pattern_count, const uint8_t *archive, size_t archive_sz, unsigned threads,
+                          bool *matched);
+
+/*
+ * Checks an archive without writing anything
+ * Every entry must lie inside the data section and not partly overlap another one
+ * (entries sharing the same blob are fine), and inflate to exactly its uncompressed
+ * size with a matching adler32. Entries are inflated into scratch buffers on the
+ * worker pool, problems are printed to stderr
+ * header - header of the archive
+ * threads - worker threads, 0 for one per online CPU
+ * returns true if the archive is intact
+ */
+bool azp_test_archive(const azpHeader_t *header, const azpIndex_t *index, const uint8_t *archive, size_t archive_sz, unsigned threads);
 
 /*
  * Extracts a single file by its index nr. from archive
- * header
- * root
+ * idx - decoded TOC
  * index - nr. of file
  * archive
  * returns 0 if ok, zlib errors if not
  */
-int azp_extract_file(const azpEntry_t *root, const uint32_t index, const uint8_t *restrict archive, const size_t archive_sz);
+int azp_extract_file(const azpIndex_t *idx, const uint32_t index, const uint8_t *restrict archive, const size_t archive_sz);
+
+/*
+ * Random access reader over the entries of a mapped archive
+ * Safe to use from many threads at once
+ */
+typedef struct azpReader_t azpReader_t;
+
+/*
+ * Opens a reader
+ * index - decoded TOC, must outlive the reader
+ * archive - pointer to archive data, must outlive the reader
+ * span - uncompressed bytes between inflate checkpoints, 0 for the default 4 MiB
+ * returns reader or NULL if out of memory
+ */
+azpReader_t *azp_reader_open(const azpIndex_t *index, const uint8_t *archive, size_t archive_sz, size_t span);
+
+/*
+ * Closes a reader and frees the checkpoints it cached
+ */
+void azp_reader_close(azpReader_t *reader);
+
+/*
+ * Reads a byte range of an entry into memory
+ * Reads past the first span build the entry's checkpoints once (one full inflate)
+ * and then only inflate from the closest checkpoint before offset
+ * entry - nr. of file
+ * offset - uncompressed offset in the entry
+ * len - bytes to read
+ * buf - at least len bytes
+ * returns bytes read, less than len at end of entry, -1 on error or if the data is
+ *         shorter than the entry's size in the TOC
+ */
+int64_t azp_read(azpReader_t *reader, uint32_t entry, size_t offset, size_t len, void *buf);
+
+/*
+ * Buffered writer for streaming entries to a file descriptor
+ * Pipes get whole buffers handed over with vmsplice where the system allows it
+ */
+typedef struct azpFdWriter_t azpFdWriter_t;
+
+/*
+ * Opens a writer on fd, e.g. STDOUT_FILENO
+ * returns writer or NULL if out of memory
+ */
+azpFdWriter_t *azp_fdwriter_open(int fd);
+
+/*
+ * Flushes and frees the writer, does not close fd
+ * returns 0 if ok
+ */
+int azp_fdwriter_close(azpFdWriter_t *writer);
+
+/*
+ * Copies data into the writer, full buffers are written out
+ * returns 0 if ok
+ */
+int azp_fdwriter_write(azpFdWriter_t *writer, const void *data, size_t len);
+
+/*
+ * Inflates a single file by its index nr. into the writer
+ * idx - decoded TOC
+ * index - nr. of file
+ * returns 0 if ok, zlib errors if not
+ */
+int azp_extract_fd(const azpIndex_t *idx, const uint32_t index, const uint8_t *archive, const size_t archive_sz, azpFdWriter_t *writer);
+
+/*
+ * Inflates a single file by its index nr. into an empty regular file
+ * Big files are preallocated to their final size and inflated straight into a mapping,
+ * where the filesystem can't preallocate they are written through write()
+ * fd - destination opened for reading and writing
+ * idx - decoded TOC
+ * index - nr. of file
+ * returns 0 if ok, zlib errors if not
+ */
+int azp_write_entry(int fd, const azpIndex_t *idx, const uint32_t index, const uint8_t *archive, const size_t archive_sz);
+
+/*
+ * Reads header and TOC from the start of an archive that can only be read front
+ * to back, e.g. a pipe. fd is left at the start of the data section
+ * header - filled with the archive header
+ * index - decoded TOC, free with azp_index_free
+ * returns true if ok
+ */
+bool azp_index_read(azpIndex_t *index, azpHeader_t *header, int fd);
+
+/*
+ * Extracts entries from an archive read sequentially from fd after azp_index_read
+ * Entries are done in the order their data is stored, gaps are read past and only
+ * a small fixed buffer is used, so nothing has to be mapped or seekable.
+ * Entries sharing one blob all get the data. Entries whose data lies before one
+ * already read can't be reached and fail
+ * list - entry numbers, NULL for all entries
+ * count - number of entries in list
+ * writer - all entries go there back to back in data order, NULL to create files
+ * returns true if all listed entries were extracted
+ */
+bool azp_extract_sequential(const azpHeader_t *header, const azpIndex_t *index, int fd, const uint32_t *list, uint32_t count, azpFdWriter_t *writer);
+
+#define AZP_LEVEL_AUTO (-2)    // sample the file and pick a level
+#define AZP_LEVEL_INVALID (-3)
+#define AZP_LEVEL_MAX (-4)     // best the selected codec can do, see azp_codec_max_level
+
+/*
+ * Compression level for files with a given extension
+ */
+typedef struct azpPolicyRule_t {
+    char *extension; // without the dot, compared ignoring case
+    int level;       // 0-9, AZP_LEVEL_AUTO or AZP_LEVEL_MAX
+} azpPolicyRule_t;
+
+/*
+ * How compression levels are picked for each file
+ */
+typedef struct azpPolicy_t {
+    int level;       // level for files without a rule, 0-9, AZP_LEVEL_AUTO or AZP_LEVEL_MAX
+    azpPolicyRule_t *rules;
+    size_t rule_count;
+} azpPolicy_t;
+
+/*
+ * Sets up a policy that samples every file
+ */
+void azp_policy_init(azpPolicy_t *policy);
+
+/*
+ * Frees the rules of a policy
+ */
+void azp_policy_free(azpPolicy_t *policy);
+
+/*
+ * Adds a rule to the policy, later rules win
+ * rule - "LEVEL" for the default or "EXT=LEVEL", LEVEL is 0-9, auto or max, e.g. "ogg=0"
+ * returns false if the rule is malformed
+ */
+bool azp_policy_add_rule(azpPolicy_t *policy, const char *rule);
+
+/*
+ * Picks the zlib level for a file
+ * Automatic level samples the file: near random data is stored (level 0), poorly
+ * compressing data gets level 1, very compressible data level 9, the rest the zlib default
+ * policy - policy or NULL for the zlib default
+ * returns zlib compression level
+ */
+int azp_policy_level(const azpPolicy_t *policy, const char *filename);
+
+/*
+ * Level the policy rules give a file without resolving it
+ * returns 0-9, AZP_LEVEL_AUTO or AZP_LEVEL_MAX
+ */
+int azp_policy_rule_level(const azpPolicy_t *policy, const char *filename);
+
+/*
+ * On-disk cache of compressed blobs, shared by concurrent builds
+ */
+typedef struct azpCache_t azpCache_t;
+
+/*
+ * Cache key, hash of a file's contents and the compression settings
+ */
+typedef struct azpCacheKey_t {
+    uint8_t hash[32]; // SHA-256
+    uint64_t size;    // uncompressed size
+} azpCacheKey_t;
+
+/*
+ * Opens a cache directory, creating it if needed
+ * dir - cache directory
+ * limit - size in bytes the cache is trimmed to when closed
+ * returns cache or NULL if the directory can't be used
+ */
+azpCache_t *azp_cache_open(const char *dir, size_t limit);
+
+/*
+ * Hits and misses since the cache was opened
+ */
+void azp_cache_counts(const azpCache_t *cache, uint32_t *hits, uint32_t *misses);
+
+/*
+ * Evicts least recently used blobs if over the limit and frees the cache
+ */
+void azp_cache_close(azpCache_t *cache);
+
+/*
+ * Hashes a file for the cache
+ * level - zlib level it is compressed with
+ * returns false if the file can't be read
+ */
+bool azp_cache_key(const azpCache_t *cache, const char *filename, int level, azpCacheKey_t *key);
+
+/*
+ * Looks up a blob
+ * blob - returns malloc()'d compressed data on a hit
+ * returns true on a hit
+ */
+bool azp_cache_get(azpCache_t *cache, const azpCacheKey_t *key, uint8_t **blob, size_t *blob_sz);
+
+/*
+ * Looks up a blob and writes it to fd at offset
+ * returns true on a hit
+ */
+bool azp_cache_get_fd(azpCache_t *cache, const azpCacheKey_t *key, int fd, size_t offset, size_t *blob_sz);
+
+/*
+ * Stores a blob, failures are ignored
+ */
+void azp_cache_put(azpCache_t *cache, const azpCacheKey_t *key, const uint8_t *blob, size_t blob_sz);
+
+/*
+ * Stores a blob already written to fd at offset, failures are ignored
+ */
+void azp_cache_put_fd(azpCache_t *cache, const azpCacheKey_t *key, int fd, size_t offset, size_t blob_sz);
+
+/*
+ * Order of entries and their data in a new archive
+ */
+typedef enum azpLayout_t {
+    AZP_LAYOUT_KEEP,    // as given, argument order for -c, old order for -r
+    AZP_LAYOUT_GROUP,   // grouped by directory, then extension
+    AZP_LAYOUT_PROFILE  // in the order of an access profile, entries not in it after those
+} azpLayout_t;
+
+/*
+ * Entry names in the order a program reads them, e.g. recorded from a load trace
+ */
+typedef struct azpProfile_t {
+    char **names;
+    size_t count;
+} azpProfile_t;
+
+/*
+ * Reads an access profile, one entry name per line
+ * Empty lines and lines starting with '#' are skipped
+ * returns false on error
+ */
+bool azp_profile_load(azpProfile_t *profile, const char *filename);
+
+/*
+ * Frees the names of a profile
+ */
+void azp_profile_free(azpProfile_t *profile);
+
+/*
+ * Works out the order of entries for a layout
+ * Profile names are matched like azp_index_find, each entry takes the place of its
+ * first access and entries the profile does not name keep their order after them
+ * root - entries in their current order
+ * profile - access order for AZP_LAYOUT_PROFILE, NULL otherwise
+ * returns malloc()'d list of entry nrs. in their new order or NULL on error
+ */
+uint32_t *azp_layout_order(const azpEntry_t *root, uint32_t count, azpLayout_t layout, const azpProfile_t *profile);
+
+/*
+ * Options for azp_compress_files
+ */
+typedef struct azpCompressOptions_t {
+    unsigned threads;           // worker threads, 0 for one per online CPU
+    const azpPolicy_t *policy;  // compression level per file, NULL for the zlib default
+    bool dedup;                 // store byte-identical files once, their entries share the blob
+    azpCache_t *cache;          // reuse blobs of unchanged files, NULL for none
+    azpLayout_t layout;         // order of the entries and their data
+    const azpProfile_t *profile; // access order for AZP_LAYOUT_PROFILE
+} azpCompressOptions_t;
+
+/*
+ * What azp_compress_files and azp_update_archive did
+ */
+typedef struct azpCompressResult_t {
+    uint32_t duplicates;        // files stored as a copy of an identical one, with options->dedup
+    size_t saved;               // their bytes
+    size_t saved_compressed;    // their compressed bytes
+    uint32_t kept;              // azp_update_archive only, entries copied over
+    uint32_t added;             // files added, replacing an entry or not
+    uint32_t removed;           // entries dropped
+} azpCompressResult_t;
+
+/*
+ * Whole-buffer zlib stream backends
+ */
+typedef enum azpCodec_t {
+    AZP_CODEC_ZLIB,
+    AZP_CODEC_LIBDEFLATE // only when built with CODEC=libdeflate
+} azpCodec_t;
+
+/*
+ * Selects the codec used for whole-buffer (de)compression, call before starting work
+ * name - "zlib" or "libdeflate"
+ * returns false if unknown or not built in
+ */
+bool azp_codec_select(const char *name);
+
+/*
+ * Name of the selected codec
+ */
+const char *azp_codec_name(void);
+
+/*
+ * Highest level the selected codec takes, 12 for libdeflate, 9 for zlib
+ * zlib gets anything higher as 9
+ */
+int azp_codec_max_level(void);
+
+/*
+ * Worst case compressed size of src_sz bytes for any codec
+ */
+size_t azp_codec_bound(size_t src_sz);
+
+/*
+ * Inflates a whole zlib stream whose uncompressed size is known
+ * dst_sz - exact uncompressed size, anything else is an error
+ * returns 0 if ok, zlib errors if not
+ */
+int azp_codec_inflate(uint8_t *dst, size_t dst_sz, const uint8_t *src, size_t src_sz);
+
+/*
+ * Deflates a whole buffer into a zlib stream
+ * dst_sz - size of dst, at least azp_codec_bound(src_sz), returns compressed size there
+ * level - zlib compression level
+ * returns 0 if ok, zlib errors if not
+ */
+int azp_codec_deflate(uint8_t *dst, size_t *dst_sz, const uint8_t *src, size_t src_sz, int level);
 
 /*
  * Generates the TOC filelist from passed parameters
+ * Every parameter is stat'ed once. Files keep the name they were given, directories
+ * are walked on the worker pool and every regular file below them becomes an entry
+ * named by its path relative to the directory with '\' separators, sorted by name.
+ * Paths of those files live in the same allocation as the entries, free() frees both
  * Compressed size and offset not filled in!
  * returns TOC entry root or NULL if something wrong
  */
@@ -84,20 +515,315 @@ azpEntry_t *azp_make_file_list(azpHeader_t *header, char **file_list, size_t fil
 
 /*
  * Compresses all the files listed in the TOC entries
+ * The entries are first put in the order of options->layout, the data follows the TOC order.
+ * Fails without creating the archive if two entries have the same name, and
+ * removes the archive if compression fails
+ * The TOC region is reserved and backfilled once all compressed sizes are known
+ * With one thread the data is deflated straight into the archive in a single pass,
+ * otherwise workers deflate entries into memory and a writer thread appends them in TOC order
  * header - filled header
- * root
+ * root - offset and compressed size get filled in
  * filename - output filename
+ * options - threads and compression policy
+ * result - filled in if not NULL
  * returns 0 if OK
  */
-int azp_compress_files(const azpHeader_t *header, azpEntry_t *root, const char *filename);
+int azp_compress_files(const azpHeader_t *header, azpEntry_t *root, const char *filename, const azpCompressOptions_t *options,
+                       azpCompressResult_t *result);
+
+/*
+ * Rewrites an archive with entries removed and files added
+ * Kept entries are copied byte for byte, only the added files get compressed.
+ * The new archive is written to a temporary file next to the old one, given its
+ * permissions and renamed over it
+ * filename - archive filename
+ * index - decoded TOC of the mapped archive
+ * archive_fd - open archive, copied from with copy_file_range where possible
+ * remove - names or patterns of entries to drop, fails if one matches nothing
+ * add - files to add, an entry with the same name is replaced in place, of files
+ *       with the same name the last one is added
+ * options - threads and compression policy for the added files
+ * result - filled in if not NULL
+ * returns 0 if OK
+ */
+int azp_update_archive(const char *filename, const azpIndex_t *index, const uint8_t *archive, size_t archive_sz, int archive_fd,
+                       char **remove, size_t remove_count, char **add, size_t add_count, const azpCompressOptions_t *options,
+                       azpCompressResult_t *result);
+
+/*
+ * Options for azp_repack_archive
+ */
+typedef struct azpRepackOptions_t {
+    unsigned threads;           // worker threads, 0 for one per online CPU
+    const azpPolicy_t *policy;  // level per entry, automatic means the best the codec has
+    double cpu_budget;          // CPU seconds over all threads, blobs left after that are copied, 0 for no limit
+    azpLayout_t layout;         // new order of the entries and their data, AZP_LAYOUT_KEEP for the old one
+    const azpProfile_t *profile; // access order for AZP_LAYOUT_PROFILE
+} azpRepackOptions_t;
+
+/*
+ * What azp_repack_archive did
+ */
+typedef struct azpRepackResult_t {
+    uint32_t blobs;
+    uint32_t smaller;           // blobs that got the new data
+    uint32_t skipped;           // blobs copied because the CPU budget ran out
+    size_t old_size;            // archive sizes in bytes
+    size_t new_size;
+} azpRepackResult_t;
+
+/*
+ * Writes an archive with every blob recompressed from the mapping, nothing is extracted to disk
+ * Each blob keeps whichever of the old and new data is smaller. Shared blobs stay shared,
+ * with AZP_LAYOUT_KEEP the TOC order and data layout stay the same, otherwise the
+ * TOC is reordered and every blob goes where its first entry now is
+ * filename - archive filename
+ * out_filename - new archive, NULL to replace the old one
+ * index - decoded TOC of the mapped archive
+ * archive_fd - open archive, unchanged blobs are copied from it
+ * options - threads, levels and CPU budget
+ * result - filled in if not NULL
+ * returns 0 if OK
+ */
+int azp_repack_archive(const char *filename, const char *out_filename, const azpIndex_t *index, const uint8_t *archive, size_t archive_sz,
+                       int archive_fd, const azpRepackOptions_t *options, azpRepackResult_t *result);
+
+/*
+ * Jobs that can be run over many archives at once
+ */
+typedef enum azpBatchJob_t {
+    AZP_BATCH_EXTRACT,
+    AZP_BATCH_TEST,
+    AZP_BATCH_COMPRESS
+} azpBatchJob_t;
+
+/*
+ * One archive of a batch run
+ */
+typedef struct azpBatchItem_t {
+    const char *archive;
+    char **files;       // files compressed into it
+    size_t file_count;
+} azpBatchItem_t;
+
+/*
+ * What became of one archive of a batch run
+ */
+typedef enum azpBatchStatus_t {
+    AZP_BATCH_OK,
+    AZP_BATCH_OPEN,     // archive can't be opened, see error
+    AZP_BATCH_FILES,    // files to compress can't be read or two get the same name
+    AZP_BATCH_SUBDIR,   // extracted into the same directory as an earlier archive, see other
+    AZP_BATCH_FAILED,   // extracting or compressing failed
+    AZP_BATCH_DAMAGED   // testing found errors
+} azpBatchStatus_t;
+
+typedef struct azpBatchResult_t {
+    azpBatchStatus_t status;
+    int error;          // azpError_t of opening the archive
+    int sys_errno;      // errno for AZP_ERR_IO
+    size_t other;       // item nr. of the earlier archive
+} azpBatchResult_t;
+
+/*
+ * Runs one job over many archives on a single worker pool
+ * The entries of all archives go to the same workers, archive after archive, so
+ * the end of one archive overlaps the start of the next. Each archive is extracted
+ * into a subdirectory named after it without the .azp extension. Archives being
+ * compressed are created when the workers get to them and share one memory
+ * budget, one that fails is removed
+ * items - archives, and the files of each one when compressing
+ * options - threads, and the compression settings
+ * flags - AZP_OPEN_* flags for the archives read
+ * results - count results, returns there what became of each archive, can be NULL
+ * returns number of archives that failed
+ */
+uint32_t azp_batch_run(azpBatchJob_t job, const azpBatchItem_t *items, size_t count, const azpCompressOptions_t *options, unsigned flags,
+                       azpBatchResult_t *results);
+
+/*
+ * Compresses a file into memory in one call through the selected codec
+ * filename - filename
+ * level - zlib compression level
+ * blob - returns malloc()'d zlib stream there, MUST BE FREE()'d AFTER USE!!
+ * blob_sz - returns compressed size there
+ * returns 0 if OK, zlib errors if not
+ */
+int azp_compress_file(const char *filename, int level, uint8_t **blob, size_t *blob_sz);
 
 /*
- * Compresses a file to filename.tmp
- * MANGLES FILENAMES TO FILENAME.TMP!!
+ * Compresses a file straight into an open archive
  * filename - filename
- * filesize - returns filesize there
+ * level - zlib compression level
+ * fd - archive opened for writing
+ * offset - position in the archive to write the zlib stream at
+ * compressed_sz - returns compressed size there
  * returns 0 if OK, zlib errors if not
  */
-int azp_compress_file(char *filename, size_t *filesize);
+int azp_compress_stream(const char *filename, int level, int fd, size_t offset, size_t *compressed_sz);
+
+/*
+ * Phases timed by the stats
+ */
+typedef enum azpPhase_t {
+    AZP_PHASE_HEADER,  // header check
+    AZP_PHASE_TOC,     // TOC deciphering and decoding, index sidecar
+    AZP_PHASE_READ,    // reading input files (hashing, whole-file compression)
+    AZP_PHASE_INFLATE,
+    AZP_PHASE_DEFLATE, // includes reading and writing for streamed entries
+    AZP_PHASE_FILES,   // creating and writing extracted files
+    AZP_PHASE_ARCHIVE, // writing and copying archive data
+    AZP_PHASE_COUNT
+} azpPhase_t;
+
+/*
+ * Output of long running jobs
+ */
+typedef enum azpVerbosity_t {
+    AZP_QUIET,
+    AZP_PROGRESS, // rate limited done/total line
+    AZP_VERBOSE   // one line per file
+} azpVerbosity_t;
+
+/*
+ * Sets the output of extraction and compression, AZP_PROGRESS by default
+ */
+void azp_set_verbosity(azpVerbosity_t verbosity);
+
+/*
+ * Starts collecting per phase wall and CPU time, bytes and entries
+ * Also the baseline for resource usage and allocation counts
+ */
+void azp_stats_enable(void);
+
+/*
+ * Prints the collected stats to stderr
+ * json - one JSON object instead of a table
+ */
+void azp_stats_print(bool json);
+
+/*
+ * Error codes of the archive handle calls, none of them print anything
+ */
+typedef enum azpError_t {
+    AZP_OK = 0,
+    AZP_ERR_IO = -1,        // system call failed, errno tells why
+    AZP_ERR_NOMEM = -2,
+    AZP_ERR_FORMAT = -3,    // not an AZP archive or the TOC is broken
+    AZP_ERR_NOT_FOUND = -4, // no entry with that name or number
+    AZP_ERR_DATA = -5,      // entry data is corrupt or outside the archive
+    AZP_ERR_SIZE = -6,      // buffer too small for the entry
+    AZP_ERR_SINK = -7       // the output sink returned an error
+} azpError_t;
+
+/*
+ * Describes an error code
+ */
+const char *azp_strerror(int error);
+
+/*
+ * Open archive, owns the file, its mapping and the decoded TOC
+ * Everything but azp_archive_close may be called from many threads at once
+ */
+typedef struct azpArchive_t azpArchive_t;
+
+#define AZP_OPEN_SIDECAR 1 // use ARCHIVE.idx if up to date, write it if not
+
+/*
+ * Opens and maps an archive and decodes its TOC
+ * archive - returns the handle there
+ * filename - archive filename
+ * flags - AZP_OPEN_* flags
+ * returns AZP_OK or an error code
+ */
+int azp_archive_open(azpArchive_t **archive, const char *filename, unsigned flags);
+
+/*
+ * Unmaps and closes the archive
+ */
+void azp_archive_close(azpArchive_t *archive);
+
+/*
+ * Decoded TOC of the archive, valid until the archive is closed
+ */
+const azpIndex_t *azp_archive_index(const azpArchive_t *archive);
+
+/*
+ * Header, mapped data and file descriptor for the lower level calls above
+ */
+const azpHeader_t *azp_archive_header(const azpArchive_t *archive);
+const uint8_t *azp_archive_data(const azpArchive_t *archive, size_t *size);
+int azp_archive_fd(const azpArchive_t *archive);
+
+/*
+ * Looks up an entry by name, like azp_index_find
+ * entry - returns the entry nr. there
+ * returns AZP_OK or AZP_ERR_NOT_FOUND
+ */
+int azp_archive_find(const azpArchive_t *archive, const char *name, uint32_t *entry);
+
+/*
+ * Reads a byte range of an entry, see azp_read
+ * returns bytes read (less than len at the end of the entry) or an error code
+ */
+int64_t azp_archive_read(azpArchive_t *archive, uint32_t entry, size_t offset, size_t len, void *buf);
+
+/*
+ * Inflates a whole entry into memory
+ * buf - at least the uncompressed size of the entry
+ * returns AZP_OK or an error code
+ */
+int azp_archive_extract_mem(const azpArchive_t *archive, uint32_t entry, void *buf, size_t buf_sz);
+
+/*
+ * Receives the data of an entry piece by piece, in order
+ * returns 0 if ok, anything else stops the extraction with AZP_ERR_SINK
+ */
+typedef int (*azpSinkWrite_t)(void *ctx, const void *data, size_t len);
+
+typedef struct azpSink_t {
+    azpSinkWrite_t write;
+    void *ctx;
+} azpSink_t;
+
+/*
+ * Inflates an entry into a caller supplied sink, at most 64 KiB per call
+ * returns AZP_OK or an error code
+ */
+int azp_archive_extract_sink(const azpArchive_t *archive, uint32_t entry, const azpSink_t *sink);
+
+/*
+ * Inflates an entry into a file descriptor, e.g. a socket
+ * returns AZP_OK or an error code
+ */
+int azp_archive_extract_fd(const azpArchive_t *archive, uint32_t entry, int fd);
+
+/*
+ * Inflates an entry into a file at path, created or truncated
+ * returns AZP_OK or an error code
+ */
+int azp_archive_extract_path(const azpArchive_t *archive, uint32_t entry, const char *path);
+
+/*
+ * State file azp_extract_update keeps in the output directory
+ */
+#define AZP_UPDATE_STATE ".azpstate"
+
+/*
+ * Extracts only the entries that differ from the files already in a directory
+ * A file of the entry's uncompressed_size whose adler32 matches the one at the end of the
+ * entry's zlib stream is inflated and compared, other files are stale without inflating.
+ * Files that match are recorded in AZP_UPDATE_STATE with their size, mtime, ctime and inode
+ * and the SHA-256 of the compressed entry, in a section for the archive. A file still
+ * matching its record is not read again if the entry has the same digest, or is where it
+ * was in an archive with the same path, size, mtime and header. Sections of other archives
+ * are kept, the file is locked while it is rewritten, so several archives can be updated
+ * into one tree, also at the same time
+ * archive_path - path the archive was opened from, names its section
+ * root - directory to update, NULL for the current one
+ * up_to_date - set to the number of entries that were not extracted
+ * returns true if ok, false if not
+ */
+bool azp_extract_update(const azpArchive_t *archive, const char *archive_path, const char *root, unsigned threads, uint32_t *up_to_date);
 
 #endif
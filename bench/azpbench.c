@@ -0,0 +1,292 @@
+/*
+ *	azpbench
+ *
+ *	Times the phases of reading and writing an AZP archive
+ *	One JSON object per phase is printed to stdout:
+ *		{"phase":"inflate","runs":3,"best_s":0.1,"mean_s":0.11,"entries":1000,"bytes":123,"mb_per_s":1.1,"entries_per_s":9000.0}
+ *
+ *	Phases:
+ *		header	- azp_check_header
+ *		toc		- azp_index_decode of the whole TOC
+ *		inflate	- azp_codec_inflate of every entry into memory, one thread
+ *		extract	- azp_extract_all into an empty directory
+ *		compress	- azp_compress_files of the extracted files
+ *
+ *	Arguments:
+ *		Repetitions per phase:	-R N	(default 3, the best run is used for throughput)
+ *		Worker threads:			-j N	(extract and compress)
+ *		Scratch directory:		-t DIR	(default /tmp)
+ *
+ *	azpbench [options] ARCHIVE
+ *
+ * Licenced under GPLv3
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "azp.h"
+
+#define BENCH_HEADER_CALLS 1000000 // azp_check_header is too fast to time a single call
+
+typedef struct benchResult_t {
+    const char *phase;
+    unsigned runs;
+    double best;
+    double total;
+    uint64_t entries;
+    uint64_t bytes;
+} benchResult_t;
+
+/* Real stdout, the library's progress output goes to /dev/null */
+static FILE *benchOut;
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_add(benchResult_t *result, double start) {
+    double elapsed = bench_now() - start;
+    if(result->runs == 0 || elapsed < result->best) {
+        result->best = elapsed;
+    }
+    result->total += elapsed;
+    ++result->runs;
+}
+
+static void bench_print(const benchResult_t *result) {
+    double best = result->best > 0 ? result->best : 1e-9;
+    fprintf(benchOut, "{\"phase\":\"%s\",\"runs\":%u,\"best_s\":%.6f,\"mean_s\":%.6f,\"entries\":%llu,\"bytes\":%llu,"
+            "\"mb_per_s\":%.2f,\"entries_per_s\":%.1f}\n",
+            result->phase, result->runs, result->best, result->total / result->runs,
+            (unsigned long long)result->entries, (unsigned long long)result->bytes,
+            result->bytes / best / 1e6, result->entries / best);
+    fflush(benchOut);
+}
+
+static int bench_unlink(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+/*
+ * Makes an empty scratch directory and changes into it
+ * returns its path, NULL on error
+ */
+static char *bench_scratch(const char *tmp_dir, const char *cwd) {
+    if(chdir(cwd) != 0) {
+        return NULL;
+    }
+    char *dir = malloc(strlen(tmp_dir) + sizeof("/azpbench-XXXXXX"));
+    if(dir == NULL) {
+        return NULL;
+    }
+    sprintf(dir, "%s/azpbench-XXXXXX", tmp_dir);
+    if(mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        perror("mkdtemp");
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+static void bench_scratch_remove(char *dir, const char *cwd) {
+    if(dir != NULL) {
+        (void)chdir(cwd);
+        nftw(dir, bench_unlink, 16, FTW_DEPTH | FTW_PHYS);
+        free(dir);
+    }
+}
+
+static void print_usage(void) {
+    printf("Usage: azpbench [-R N] [-j N] [-t DIR] ARCHIVE\n");
+}
+
+int main(int argc, char **argv) {
+    unsigned runs = 3;
+    unsigned threads = 0;
+    const char *tmp_dir = "/tmp";
+
+    int opt;
+    while((opt = getopt(argc, argv, "R:j:t:h")) != -1) {
+        switch(opt) {
+        case 'R':
+            runs = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            tmp_dir = optarg;
+            break;
+        default:
+            print_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(argc - optind != 1 || runs == 0) {
+        print_usage();
+        return 1;
+    }
+    const char *filename = argv[optind];
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot open file %s\n", filename);
+        return 1;
+    }
+    size_t archive_sz = st.st_size;
+    uint8_t *archive = mmap(NULL, archive_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(archive == MAP_FAILED) {
+        fprintf(stderr, "Cannot mmap file %s\n", filename);
+        return 1;
+    }
+    char *cwd = getcwd(NULL, 0);
+    if(cwd == NULL) {
+        perror("getcwd");
+        return 1;
+    }
+
+    benchOut = fdopen(dup(STDOUT_FILENO), "w");
+    int null = open("/dev/null", O_WRONLY);
+    if(benchOut == NULL || null == -1 || dup2(null, STDOUT_FILENO) == -1) {
+        perror("stdout");
+        return 1;
+    }
+    close(null);
+
+    /* Header */
+    azpHeader_t header;
+    benchResult_t result = { .phase = "header", .entries = BENCH_HEADER_CALLS };
+    for(unsigned r = 0; r < runs; ++r) {
+        double start = bench_now();
+        for(unsigned i = 0; i < BENCH_HEADER_CALLS; ++i) {
+            if(!azp_check_header(&header, archive, archive_sz)) {
+                fprintf(stderr, "Not a valid AZP archive, header mismatch!\n");
+                return 1;
+            }
+            __asm__ __volatile__("" ::: "memory");
+        }
+        bench_add(&result, start);
+    }
+    result.bytes = (uint64_t)sizeof(azpHeader_t) * BENCH_HEADER_CALLS;
+    bench_print(&result);
+
+    /* TOC */
+    azpIndex_t index;
+    result = (benchResult_t){ .phase = "toc", .entries = header.fields.file_count, .bytes = header.fields.data_offset };
+    for(unsigned r = 0; r < runs; ++r) {
+        double start = bench_now();
+        if(!azp_index_decode(&index, &header, archive, archive_sz, NULL, 0)) {
+            fprintf(stderr, "Error getting file list\n");
+            return 1;
+        }
+        bench_add(&result, start);
+        if(r + 1 < runs) {
+            azp_index_free(&index);
+        }
+    }
+    bench_print(&result);
+
+    /* Inflate */
+    size_t max_size = 0;
+    uint64_t total_size = 0;
+    for(uint32_t i = 0; i < index.count; ++i) {
+        if(index.uncompressed_size[i] > max_size) {
+            max_size = index.uncompressed_size[i];
+        }
+        total_size += index.uncompressed_size[i];
+    }
+    uint8_t *buffer = malloc(max_size > 0 ? max_size : 1);
+    if(buffer == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    result = (benchResult_t){ .phase = "inflate", .entries = index.count, .bytes = total_size };
+    for(unsigned r = 0; r < runs; ++r) {
+        double start = bench_now();
+        for(uint32_t i = 0; i < index.count; ++i) {
+            if((size_t)index.offset[i] + index.compressed_size[i] > archive_sz ||
+               azp_codec_inflate(buffer, index.uncompressed_size[i], archive + index.offset[i], index.compressed_size[i]) != 0) {
+                fprintf(stderr, "Error inflating %s\n", azp_index_name(&index, i));
+                return 1;
+            }
+        }
+        bench_add(&result, start);
+    }
+    free(buffer);
+    bench_print(&result);
+
+    /* Extract, each run into a fresh directory */
+    char *extracted = NULL;
+    result = (benchResult_t){ .phase = "extract", .entries = index.count, .bytes = total_size };
+    for(unsigned r = 0; r < runs; ++r) {
+        bench_scratch_remove(extracted, cwd);
+        if((extracted = bench_scratch(tmp_dir, cwd)) == NULL) {
+            return 1;
+        }
+        double start = bench_now();
+        if(!azp_extract_all(&index, archive, archive_sz, threads)) {
+            fprintf(stderr, "Error extracting archive\n");
+            bench_scratch_remove(extracted, cwd);
+            return 1;
+        }
+        bench_add(&result, start);
+    }
+    bench_print(&result);
+
+    /* Compress the files just extracted */
+    char **names = malloc(index.count * sizeof(char*));
+    if(names == NULL || chdir(extracted) != 0) {
+        perror("compress");
+        bench_scratch_remove(extracted, cwd);
+        return 1;
+    }
+    for(uint32_t i = 0; i < index.count; ++i) {
+        names[i] = (char*)azp_index_name(&index, i);
+    }
+    char *output = malloc(strlen(extracted) + sizeof(".azp"));
+    sprintf(output, "%s.azp", extracted);
+    azpCompressOptions_t options = {
+        .threads = threads,
+        .policy = NULL
+    };
+    result = (benchResult_t){ .phase = "compress", .entries = index.count, .bytes = total_size };
+    for(unsigned r = 0; r < runs; ++r) {
+        double start = bench_now();
+        azpHeader_t out_header;
+        azpEntry_t *toc = azp_make_file_list(&out_header, names, index.count);
+        if(toc == NULL || azp_compress_files(&out_header, toc, output, &options, NULL) != 0) {
+            fprintf(stderr, "Error creating archive\n");
+            free(toc);
+            unlink(output);
+            bench_scratch_remove(extracted, cwd);
+            return 1;
+        }
+        bench_add(&result, start);
+        free(toc);
+    }
+    bench_print(&result);
+
+    unlink(output);
+    free(output);
+    free(names);
+    bench_scratch_remove(extracted, cwd);
+    azp_index_free(&index);
+    munmap(archive, archive_sz);
+    close(fd);
+    free(cwd);
+    fclose(benchOut);
+    return 0;
+}
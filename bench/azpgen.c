@@ -0,0 +1,247 @@
+/*
+ *	azpgen
+ *
+ *	Generates a synthetic file set and packs it into an AZP archive for benchmarks
+ *
+ *	Arguments:
+ *		Number of files:				-n COUNT		(default 1000)
+ *		File sizes:						-s MIN:MAX		(default 256:1048576)
+ *		Size distribution:				-d log|uniform	(default log, many small and few big files)
+ *		Incompressible fraction:		-r RATIO		(0-1, default 0.3)
+ *		Random seed:					-S SEED
+ *		Worker threads:					-j N
+ *
+ *	azpgen [options] DIR ARCHIVE
+ *
+ * Licenced under GPLv3
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "azp.h"
+
+#define GEN_BLOCK 4096
+#define GEN_DIRS 16 // files are spread over this many subdirectories
+
+static const char *genWords[] = {
+    "texture", "sound", "weapon", "bullet", "soldier", "mission", "vehicle", "terrain",
+    "model", "shader", "the", "of", "and", "a", "to", "in", "is", "0.000", "1.000", "{", "}", ";", "\n"
+};
+
+typedef struct genOptions_t {
+    uint32_t count;
+    size_t min_size;
+    size_t max_size;
+    bool uniform;
+    double random_ratio;
+    uint64_t seed;
+    unsigned threads;
+} genOptions_t;
+
+/*
+ * xorshift64*, fast and good enough for test data
+ */
+static uint64_t gen_next(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double gen_unit(uint64_t *state) {
+    return (gen_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t gen_size(const genOptions_t *options, uint64_t *state) {
+    double u = gen_unit(state);
+    if(options->uniform || options->min_size == 0) {
+        return options->min_size + (size_t)(u * (options->max_size - options->min_size));
+    }
+    /* Log-uniform, like real game data */
+    double lo = log((double)options->min_size);
+    double hi = log((double)options->max_size);
+    return (size_t)exp(lo + u * (hi - lo));
+}
+
+/*
+ * Fills a block either with random bytes or with text made of a few words
+ */
+static void gen_block(uint8_t *block, size_t len, double random_ratio, uint64_t *state) {
+    if(gen_unit(state) < random_ratio) {
+        for(size_t i = 0; i < len; i += 8) {
+            uint64_t r = gen_next(state);
+            memcpy(block + i, &r, len - i < 8 ? len - i : 8);
+        }
+        return;
+    }
+    size_t pos = 0;
+    while(pos < len) {
+        const char *word = genWords[gen_next(state) % (sizeof(genWords) / sizeof(genWords[0]))];
+        size_t word_len = strlen(word);
+        if(word_len > len - pos) {
+            word_len = len - pos;
+        }
+        memcpy(block + pos, word, word_len);
+        pos += word_len;
+        if(pos < len) {
+            block[pos++] = ' ';
+        }
+    }
+}
+
+/*
+ * Writes file nr. i, contents only depend on seed and i
+ * returns 0 if ok
+ */
+static int gen_file(const genOptions_t *options, uint32_t i, const char *name) {
+    uint64_t state = options->seed ^ (0x9E3779B97F4A7C15ULL * (i + 1));
+    gen_next(&state);
+    size_t size = gen_size(options, &state);
+
+    FILE *out = fopen(name, "wb");
+    if(out == NULL) {
+        return -1;
+    }
+    uint8_t block[GEN_BLOCK];
+    for(size_t done = 0; done < size; done += GEN_BLOCK) {
+        size_t len = size - done < GEN_BLOCK ? size - done : GEN_BLOCK;
+        gen_block(block, len, options->random_ratio, &state);
+        if(fwrite(block, 1, len, out) != len) {
+            fclose(out);
+            return -1;
+        }
+    }
+    return fclose(out);
+}
+
+static void print_usage(void) {
+    printf("Usage: azpgen [-n COUNT] [-s MIN:MAX] [-d log|uniform] [-r RATIO] [-S SEED] [-j N] DIR ARCHIVE\n");
+}
+
+int main(int argc, char **argv) {
+    genOptions_t options = {
+        .count = 1000,
+        .min_size = 256,
+        .max_size = 1024 * 1024,
+        .uniform = false,
+        .random_ratio = 0.3,
+        .seed = 0x415A50,
+        .threads = 0
+    };
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:s:d:r:S:j:h")) != -1) {
+        switch(opt) {
+        case 'n':
+            options.count = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            if(sscanf(optarg, "%zu:%zu", &options.min_size, &options.max_size) != 2 || options.min_size > options.max_size) {
+                fprintf(stderr, "Invalid size range %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'd':
+            options.uniform = strcmp(optarg, "uniform") == 0;
+            break;
+        case 'r':
+            options.random_ratio = strtod(optarg, NULL);
+            break;
+        case 'S':
+            options.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'j':
+            options.threads = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            print_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(argc - optind != 2 || options.count == 0) {
+        print_usage();
+        return 1;
+    }
+    const char *dir = argv[optind];
+
+    /* Archive path stays valid after changing into DIR */
+    char *archive = argv[optind + 1][0] == '/' ? strdup(argv[optind + 1]) : NULL;
+    if(archive == NULL) {
+        char *cwd = getcwd(NULL, 0);
+        if(cwd == NULL || (archive = malloc(strlen(cwd) + strlen(argv[optind + 1]) + 2)) == NULL) {
+            perror("getcwd");
+            return 1;
+        }
+        sprintf(archive, "%s/%s", cwd, argv[optind + 1]);
+        free(cwd);
+    }
+
+    if((mkdir(dir, 0755) != 0 && errno != EEXIST) || chdir(dir) != 0) {
+        fprintf(stderr, "Cannot use directory %s\n", dir);
+        return 1;
+    }
+    char **names = calloc(options.count, sizeof(char*));
+    if(names == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    size_t total = 0;
+    for(uint32_t i = 0; i < options.count; ++i) {
+        char subdir[16];
+        snprintf(subdir, sizeof(subdir), "d%02u", i % GEN_DIRS);
+        (void)mkdir(subdir, 0755);
+        names[i] = malloc(32);
+        if(names[i] == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        snprintf(names[i], 32, "%s/f%06u.bin", subdir, i);
+        struct stat st;
+        if(gen_file(&options, i, names[i]) != 0 || stat(names[i], &st) != 0) {
+            fprintf(stderr, "Error writing %s\n", names[i]);
+            return 1;
+        }
+        total += st.st_size;
+    }
+    fprintf(stderr, "Generated %u files, %zu bytes\n", options.count, total);
+
+    /* Pack with the library, progress output is not interesting here */
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if(saved != -1 && null != -1) {
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+    azpHeader_t header;
+    azpEntry_t *toc = azp_make_file_list(&header, names, options.count);
+    azpCompressOptions_t compress = {
+        .threads = options.threads,
+        .policy = NULL
+    };
+    int ret = toc != NULL ? azp_compress_files(&header, toc, archive, &compress, NULL) : -1;
+    fflush(stdout);
+    if(saved != -1) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+    if(ret != 0) {
+        fprintf(stderr, "Error creating archive %s\n", archive);
+        return 1;
+    }
+    fprintf(stderr, "Created archive %s\n", archive);
+
+    free(toc);
+    for(uint32_t i = 0; i < options.count; ++i) {
+        free(names[i]);
+    }
+    free(names);
+    free(archive);
+    return 0;
+}
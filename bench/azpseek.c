@@ -0,0 +1,114 @@
+/*
+ *	azpseek
+ *
+ *	Replays an access profile against an archive and reports how far a disk head
+ *	would move, to compare layouts (see azptool -O)
+ *	The head starts at the end of the TOC and stops at the end of each entry read.
+ *	One JSON object is printed to stdout:
+ *		{"archive":"data.azp","accesses":100,"missing":0,"seeks":12,"backward":5,"distance":123,"mean_distance":10.3,"max_distance":99,"bytes":4567}
+ *
+ *	Fields:
+ *		accesses	- names in the profile
+ *		missing		- names not in the archive, not counted in the rest
+ *		seeks		- reads not starting where the last one ended
+ *		backward	- seeks towards the start of the archive
+ *		distance	- bytes skipped over by all seeks, either way
+ *		bytes		- compressed bytes read
+ *
+ *	Arguments:
+ *		Use/refresh index sidecar:	-i
+ *		Print missing names:		-v	(to stderr)
+ *
+ *	azpseek [options] PROFILE ARCHIVE
+ *
+ * Licenced under GPLv3
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "azp.h"
+
+static void print_usage(void) {
+    printf("Usage: azpseek [-i] [-v] PROFILE ARCHIVE\n");
+}
+
+int main(int argc, char **argv) {
+    unsigned flags = 0;
+    int verbose = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "ivh")) != -1) {
+        switch(opt) {
+        case 'i':
+            flags |= AZP_OPEN_SIDECAR;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            print_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(argc - optind != 2) {
+        print_usage();
+        return 1;
+    }
+    const char *profile_name = argv[optind];
+    const char *filename = argv[optind + 1];
+
+    azpArchive_t *archive;
+    int ret = azp_archive_open(&archive, filename, flags);
+    if(ret != AZP_OK) {
+        fprintf(stderr, "Cannot open archive %s: %s\n", filename, azp_strerror(ret));
+        return 1;
+    }
+    azpProfile_t profile;
+    if(!azp_profile_load(&profile, profile_name)) {
+        azp_archive_close(archive);
+        return 1;
+    }
+
+    const azpIndex_t *index = azp_archive_index(archive);
+    uint64_t head = azp_archive_header(archive)->fields.data_offset;
+    uint64_t missing = 0;
+    uint64_t seeks = 0;
+    uint64_t backward = 0;
+    uint64_t distance = 0;
+    uint64_t max_distance = 0;
+    uint64_t bytes = 0;
+    for(size_t i = 0; i < profile.count; ++i) {
+        uint32_t entry;
+        if(azp_archive_find(archive, profile.names[i], &entry) != AZP_OK) {
+            if(verbose) {
+                fprintf(stderr, "Not in archive: %s\n", profile.names[i]);
+            }
+            ++missing;
+            continue;
+        }
+        uint64_t offset = index->offset[entry];
+        if(offset != head) {
+            uint64_t jump = offset > head ? offset - head : head - offset;
+            ++seeks;
+            backward += offset < head;
+            distance += jump;
+            if(jump > max_distance) {
+                max_distance = jump;
+            }
+        }
+        head = offset + index->compressed_size[entry];
+        bytes += index->compressed_size[entry];
+    }
+
+    printf("{\"archive\":\"%s\",\"accesses\":%zu,\"missing\":%llu,\"seeks\":%llu,\"backward\":%llu,\"distance\":%llu,"
+           "\"mean_distance\":%.1f,\"max_distance\":%llu,\"bytes\":%llu}\n",
+           filename, profile.count, (unsigned long long)missing, (unsigned long long)seeks, (unsigned long long)backward,
+           (unsigned long long)distance, seeks > 0 ? (double)distance / seeks : 0.0, (unsigned long long)max_distance,
+           (unsigned long long)bytes);
+
+    azp_profile_free(&profile);
+    azp_archive_close(archive);
+    return 0;
+}
@@ -0,0 +1,401 @@
+/*
+ * Persistent cache of compressed blobs
+ *
+ * Blobs are kept in CACHE_DIR/xx/<key>, the key being a SHA-256 of the input file's
+ * contents and the settings that shape the deflate stream (level, codec). Entries
+ * are written to a temporary file and renamed into place, so concurrent builds only
+ * ever see complete ones. A hit refreshes the file's mtime, and when a run added
+ * something the oldest entries are evicted until the cache fits its size limit.
+ *
+ * Licenced under GPLv3
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "azp.h"
+#include "sha256.h"
+
+#define AZP_CACHE_MAGIC 0x43505A41 // "AZPC"
+#define AZP_CACHE_VERSION 1
+#define AZP_CACHE_BLOCK (256 * 1024)
+#define AZP_CACHE_TMP_AGE 3600     // seconds before a leftover temporary file is removed
+
+/*
+ * Cache file header, the blob follows
+ */
+typedef struct azpCacheFile_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t uncompressed_size;
+    uint64_t compressed_size;
+    uint32_t crc;      // crc32 of the blob
+    uint32_t reserved;
+} azpCacheFile_t;
+
+struct azpCache_t {
+    char *dir;
+    size_t limit;
+    uint32_t hits;
+    uint32_t misses;
+    size_t stored;     // bytes added during this run
+};
+
+/*
+ *      C A C H E
+ */
+
+azpCache_t *azp_cache_open(const char *dir, size_t limit) {
+    if(mkdir(dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0 && errno != EEXIST) {
+        return NULL;
+    }
+    azpCache_t *cache = calloc(1, sizeof(azpCache_t));
+    if(cache == NULL) {
+        return NULL;
+    }
+    cache->dir = strdup(dir);
+    if(cache->dir == NULL) {
+        free(cache);
+        return NULL;
+    }
+    cache->limit = limit;
+    return cache;
+}
+
+bool azp_cache_key(const azpCache_t *cache, const char *filename, int level, azpCacheKey_t *key) {
+    (void)cache;
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1) {
+        return false;
+    }
+    uint8_t *block = malloc(AZP_CACHE_BLOCK);
+    if(block == NULL) {
+        close(fd);
+        return false;
+    }
+
+    /* Settings first, anything that changes the stream changes the key */
+    azpSha256_t sha;
+    azp_sha256_init(&sha);
+    int n = snprintf((char*)block, AZP_CACHE_BLOCK, "azp-cache %d level %d codec %s", AZP_CACHE_VERSION, level, azp_codec_name());
+    azp_sha256_update(&sha, block, n + 1);
+
+    ssize_t got;
+    while((got = read(fd, block, AZP_CACHE_BLOCK)) > 0) {
+        azp_sha256_update(&sha, block, got);
+    }
+    free(block);
+    close(fd);
+    if(got != 0) {
+        return false;
+    }
+    key->size = sha.length - (n + 1);
+    azp_sha256_final(&sha, key->hash);
+    return true;
+}
+
+/*
+ * Cache file of a key, CACHE_DIR/xx/xxxx...
+ * returns malloc()'d path, NULL if out of memory
+ */
+static char *azp_cache_path(const azpCache_t *cache, const azpCacheKey_t *key, bool subdir_only) {
+    size_t dir_len = strlen(cache->dir);
+    char *path = malloc(dir_len + 4 + sizeof(key->hash) * 2 + 1);
+    if(path == NULL) {
+        return NULL;
+    }
+    char *out = path + sprintf(path, "%s/%02x", cache->dir, key->hash[0]);
+    if(!subdir_only) {
+        *out++ = '/';
+        for(size_t i = 0; i < sizeof(key->hash); ++i) {
+            out += sprintf(out, "%02x", key->hash[i]);
+        }
+    }
+    return path;
+}
+
+/*
+ * Opens the cache file of key and checks its header
+ * returns fd or -1 on a miss
+ */
+static int azp_cache_open_entry(azpCache_t *cache, const azpCacheKey_t *key, azpCacheFile_t *file) {
+    char *path = azp_cache_path(cache, key, false);
+    if(path == NULL) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if(fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if(pread(fd, file, sizeof(azpCacheFile_t), 0) != sizeof(azpCacheFile_t) || fstat(fd, &st) != 0
+       || file->magic != AZP_CACHE_MAGIC || file->version != AZP_CACHE_VERSION
+       || file->uncompressed_size != key->size || file->compressed_size != (uint64_t)st.st_size - sizeof(azpCacheFile_t)) {
+        close(fd);
+        return -1;
+    }
+    /* Recently used, mtime is what eviction goes by */
+    (void)futimens(fd, NULL);
+    return fd;
+}
+
+/*
+ * Counts a hit or a miss
+ */
+static bool azp_cache_count(azpCache_t *cache, bool hit) {
+    __atomic_add_fetch(hit ? &cache->hits : &cache->misses, 1, __ATOMIC_RELAXED);
+    return hit;
+}
+
+bool azp_cache_get(azpCache_t *cache, const azpCacheKey_t *key, uint8_t **blob, size_t *blob_sz) {
+    azpCacheFile_t file;
+    int fd = azp_cache_open_entry(cache, key, &file);
+    if(fd == -1) {
+        return azp_cache_count(cache, false);
+    }
+    uint8_t *data = malloc(file.compressed_size + 1);
+    bool ok = data != NULL
+           && pread(fd, data, file.compressed_size, sizeof(azpCacheFile_t)) == (ssize_t)file.compressed_size
+           && crc32_z(crc32(0L, Z_NULL, 0), data, file.compressed_size) == file.crc;
+    close(fd);
+    if(!ok) {
+        free(data);
+        return azp_cache_count(cache, false);
+    }
+    *blob = data;
+    *blob_sz = file.compressed_size;
+    return azp_cache_count(cache, true);
+}
+
+/*
+ * Copies len bytes between files in blocks, crc32 of what went through in crc
+ * returns true if ok
+ */
+static bool azp_cache_copy(int in_fd, off_t in_off, int out_fd, off_t out_off, size_t len, uint32_t *crc) {
+    uint8_t *block = malloc(AZP_CACHE_BLOCK);
+    if(block == NULL) {
+        return false;
+    }
+    *crc = crc32(0L, Z_NULL, 0);
+    while(len > 0) {
+        size_t chunk = len < AZP_CACHE_BLOCK ? len : AZP_CACHE_BLOCK;
+        if(pread(in_fd, block, chunk, in_off) != (ssize_t)chunk || pwrite(out_fd, block, chunk, out_off) != (ssize_t)chunk) {
+            free(block);
+            return false;
+        }
+        *crc = crc32_z(*crc, block, chunk);
+        in_off += chunk;
+        out_off += chunk;
+        len -= chunk;
+    }
+    free(block);
+    return true;
+}
+
+bool azp_cache_get_fd(azpCache_t *cache, const azpCacheKey_t *key, int fd, size_t offset, size_t *blob_sz) {
+    azpCacheFile_t file;
+    int cache_fd = azp_cache_open_entry(cache, key, &file);
+    if(cache_fd == -1) {
+        return azp_cache_count(cache, false);
+    }
+    uint32_t crc;
+    bool ok = azp_cache_copy(cache_fd, sizeof(azpCacheFile_t), fd, offset, file.compressed_size, &crc) && crc == file.crc;
+    close(cache_fd);
+    if(ok) {
+        *blob_sz = file.compressed_size;
+    }
+    return azp_cache_count(cache, ok);
+}
+
+/*
+ * Writes a new cache file through a temporary file
+ * blob - data in memory, or NULL to copy from fd at offset
+ */
+static void azp_cache_store(azpCache_t *cache, const azpCacheKey_t *key, const uint8_t *blob, int fd, size_t offset, size_t blob_sz) {
+    char *subdir = azp_cache_path(cache, key, true);
+    char *path = azp_cache_path(cache, key, false);
+    char *tmp = malloc(strlen(cache->dir) + sizeof("/tmp-XXXXXX"));
+    if(subdir == NULL || path == NULL || tmp == NULL) {
+        goto cleanup;
+    }
+    sprintf(tmp, "%s/tmp-XXXXXX", cache->dir);
+    if(mkdir(subdir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0 && errno != EEXIST) {
+        goto cleanup;
+    }
+    int tmp_fd = mkstemp(tmp);
+    if(tmp_fd == -1) {
+        goto cleanup;
+    }
+
+    azpCacheFile_t file = {
+        .magic = AZP_CACHE_MAGIC,
+        .version = AZP_CACHE_VERSION,
+        .uncompressed_size = key->size,
+        .compressed_size = blob_sz,
+        .reserved = 0
+    };
+    bool ok;
+    if(blob != NULL) {
+        file.crc = crc32_z(crc32(0L, Z_NULL, 0), blob, blob_sz);
+        ok = pwrite(tmp_fd, blob, blob_sz, sizeof(azpCacheFile_t)) == (ssize_t)blob_sz;
+    } else {
+        ok = azp_cache_copy(fd, offset, tmp_fd, sizeof(azpCacheFile_t), blob_sz, &file.crc);
+    }
+    ok = ok && pwrite(tmp_fd, &file, sizeof(azpCacheFile_t), 0) == sizeof(azpCacheFile_t);
+    ok = ok && fchmod(tmp_fd, 0644) == 0;
+    ok = close(tmp_fd) == 0 && ok;
+    /* Someone else may have stored the same key meanwhile, same contents either way */
+    if(!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        goto cleanup;
+    }
+    __atomic_add_fetch(&cache->stored, blob_sz + sizeof(azpCacheFile_t), __ATOMIC_RELAXED);
+
+cleanup:
+    free(subdir);
+    free(path);
+    free(tmp);
+}
+
+void azp_cache_put(azpCache_t *cache, const azpCacheKey_t *key, const uint8_t *blob, size_t blob_sz) {
+    azp_cache_store(cache, key, blob, -1, 0, blob_sz);
+}
+
+void azp_cache_put_fd(azpCache_t *cache, const azpCacheKey_t *key, int fd, size_t offset, size_t blob_sz) {
+    azp_cache_store(cache, key, NULL, fd, offset, blob_sz);
+}
+
+/*
+ * Cache file found while trimming
+ */
+typedef struct azpCacheItem_t {
+    struct timespec mtime;
+    size_t size;
+    char *path;
+} azpCacheItem_t;
+
+static int azp_cache_item_cmp(const void *a, const void *b) {
+    const azpCacheItem_t *ia = a;
+    const azpCacheItem_t *ib = b;
+    if(ia->mtime.tv_sec != ib->mtime.tv_sec) {
+        return ia->mtime.tv_sec < ib->mtime.tv_sec ? -1 : 1;
+    }
+    return ia->mtime.tv_nsec < ib->mtime.tv_nsec ? -1 : (ia->mtime.tv_nsec > ib->mtime.tv_nsec);
+}
+
+/*
+ * Evicts least recently used entries until the cache is 90% of its limit
+ * Only one process trims at a time, the others skip it
+ */
+static void azp_cache_trim(azpCache_t *cache) {
+    size_t dir_len = strlen(cache->dir);
+    char *lock_path = malloc(dir_len + sizeof("/lock"));
+    if(lock_path == NULL) {
+        return;
+    }
+    sprintf(lock_path, "%s/lock", cache->dir);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    free(lock_path);
+    if(lock_fd == -1) {
+        return;
+    }
+    if(flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        close(lock_fd);
+        return;
+    }
+
+    azpCacheItem_t *items = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t total = 0;
+    time_t now = time(NULL);
+    DIR *root = opendir(cache->dir);
+    for(struct dirent *sub; root != NULL && (sub = readdir(root)) != NULL;) {
+        struct stat st;
+        /* Temporary files of builds that died */
+        if(strncmp(sub->d_name, "tmp-", 4) == 0) {
+            if(fstatat(dirfd(root), sub->d_name, &st, 0) == 0 && now - st.st_mtime > AZP_CACHE_TMP_AGE) {
+                (void)unlinkat(dirfd(root), sub->d_name, 0);
+            }
+            continue;
+        }
+        if(strlen(sub->d_name) != 2 || strspn(sub->d_name, "0123456789abcdef") != 2) {
+            continue;
+        }
+        int sub_fd = openat(dirfd(root), sub->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *dir = sub_fd != -1 ? fdopendir(sub_fd) : NULL;
+        if(dir == NULL && sub_fd != -1) {
+            close(sub_fd);
+        }
+        for(struct dirent *ent; dir != NULL && (ent = readdir(dir)) != NULL;) {
+            if(ent->d_name[0] == '.' || fstatat(dirfd(dir), ent->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            if(count == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                azpCacheItem_t *grown = realloc(items, capacity * sizeof(azpCacheItem_t));
+                if(grown == NULL) {
+                    break;
+                }
+                items = grown;
+            }
+            items[count].mtime = st.st_mtim;
+            items[count].size = st.st_size;
+            items[count].path = malloc(dir_len + strlen(ent->d_name) + 5);
+            if(items[count].path == NULL) {
+                break;
+            }
+            sprintf(items[count].path, "%s/%s/%s", cache->dir, sub->d_name, ent->d_name);
+            total += st.st_size;
+            ++count;
+        }
+        if(dir != NULL) {
+            closedir(dir);
+        }
+    }
+    if(root != NULL) {
+        closedir(root);
+    }
+
+    if(total > cache->limit) {
+        /* Oldest first */
+        qsort(items, count, sizeof(azpCacheItem_t), azp_cache_item_cmp);
+        size_t target = cache->limit / 10 * 9;
+        for(size_t i = 0; i < count && total > target; ++i) {
+            if(unlink(items[i].path) == 0) {
+                total -= items[i].size;
+            }
+        }
+    }
+    for(size_t i = 0; i < count; ++i) {
+        free(items[i].path);
+    }
+    free(items);
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+void azp_cache_counts(const azpCache_t *cache, uint32_t *hits, uint32_t *misses) {
+    *hits = cache->hits;
+    *misses = cache->misses;
+}
+
+void azp_cache_close(azpCache_t *cache) {
+    if(cache == NULL) {
+        return;
+    }
+    if(cache->stored > 0) {
+        azp_cache_trim(cache);
+    }
+    free(cache->dir);
+    free(cache);
+}
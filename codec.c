@@ -0,0 +1,238 @@
+/*
+ * Whole-buffer zlib stream codecs
+ *
+ * The TOC stores both sizes of every entry, so input and output buffers can be
+ * sized exactly and the stream done in one call instead of 16 KiB chunks.
+ * libdeflate is used when built with CODEC=libdeflate, zlib otherwise.
+ *
+ * Licenced under GPLv3
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <zlib.h>
+#include <pthread.h>
+#ifdef AZP_HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#include "azp.h"
+#include "stats.h"
+
+#ifdef AZP_HAVE_LIBDEFLATE
+static azpCodec_t azpCodec = AZP_CODEC_LIBDEFLATE;
+#else
+static azpCodec_t azpCodec = AZP_CODEC_ZLIB;
+#endif
+
+static const char *azpCodecNames[] = { "zlib", "libdeflate" };
+
+bool azp_codec_select(const char *name) {
+    for(int codec = 0; codec < (int)(sizeof(azpCodecNames) / sizeof(azpCodecNames[0])); ++codec) {
+        if(strcmp(name, azpCodecNames[codec]) == 0) {
+#ifndef AZP_HAVE_LIBDEFLATE
+            if(codec == AZP_CODEC_LIBDEFLATE) {
+                return false;
+            }
+#endif
+            azpCodec = codec;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *azp_codec_name(void) {
+    return azpCodecNames[azpCodec];
+}
+
+int azp_codec_max_level(void) {
+    return azpCodec == AZP_CODEC_LIBDEFLATE ? 12 : Z_BEST_COMPRESSION;
+}
+
+/*
+ *      Z L I B
+ */
+
+static int azp_zlib_inflate(uint8_t *dst, size_t dst_sz, const uint8_t *src, size_t src_sz) {
+    z_stream strm;
+    int ret;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    ret = inflateInit(&strm);
+    if(ret != Z_OK) {
+        return ret;
+    }
+    strm.next_in = (uint8_t*)src;
+    strm.avail_in = src_sz;
+    strm.next_out = dst;
+    strm.avail_out = dst_sz;
+
+    /* Exact output size, everything should be done in one call */
+    ret = inflate(&strm, Z_FINISH);
+    if(ret == Z_STREAM_END) {
+        ret = strm.total_out == dst_sz ? Z_OK : Z_DATA_ERROR;
+    } else if(ret != Z_MEM_ERROR) {
+        ret = Z_DATA_ERROR;
+    }
+    (void)inflateEnd(&strm);
+    return ret;
+}
+
+static int azp_zlib_deflate(uint8_t *dst, size_t *dst_sz, const uint8_t *src, size_t src_sz, int level) {
+    z_stream strm;
+    int ret;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    ret = deflateInit(&strm, level);
+    if(ret != Z_OK) {
+        return ret;
+    }
+    strm.next_in = (uint8_t*)src;
+    strm.avail_in = src_sz;
+    strm.next_out = dst;
+    strm.avail_out = *dst_sz > UINT_MAX ? UINT_MAX : *dst_sz;
+
+    ret = deflate(&strm, Z_FINISH);
+    *dst_sz = strm.total_out;
+    (void)deflateEnd(&strm);
+    return ret == Z_STREAM_END ? Z_OK : Z_BUF_ERROR;
+}
+
+/*
+ *      L I B D E F L A T E
+ */
+
+#ifdef AZP_HAVE_LIBDEFLATE
+
+/*
+ * (De)compressors are reused per thread, allocating a compressor is not cheap
+ */
+typedef struct azpLibdeflate_t {
+    struct libdeflate_decompressor *decompressor;
+    struct libdeflate_compressor *compressor;
+    int level; // level of compressor
+} azpLibdeflate_t;
+
+static pthread_key_t azpLibdeflateKey;
+static pthread_once_t azpLibdeflateOnce = PTHREAD_ONCE_INIT;
+
+static void azp_libdeflate_free(void *arg) {
+    azpLibdeflate_t *state = arg;
+    if(state->decompressor != NULL) {
+        libdeflate_free_decompressor(state->decompressor);
+    }
+    if(state->compressor != NULL) {
+        libdeflate_free_compressor(state->compressor);
+    }
+    free(state);
+}
+
+static void azp_libdeflate_key(void) {
+    (void)pthread_key_create(&azpLibdeflateKey, azp_libdeflate_free);
+}
+
+static azpLibdeflate_t *azp_libdeflate_state(void) {
+    pthread_once(&azpLibdeflateOnce, azp_libdeflate_key);
+    azpLibdeflate_t *state = pthread_getspecific(azpLibdeflateKey);
+    if(state == NULL) {
+        state = calloc(1, sizeof(azpLibdeflate_t));
+        if(state != NULL && pthread_setspecific(azpLibdeflateKey, state) != 0) {
+            free(state);
+            state = NULL;
+        }
+    }
+    return state;
+}
+
+static int azp_libdeflate_inflate(uint8_t *dst, size_t dst_sz, const uint8_t *src, size_t src_sz) {
+    azpLibdeflate_t *state = azp_libdeflate_state();
+    if(state == NULL) {
+        return Z_MEM_ERROR;
+    }
+    if(state->decompressor == NULL && (state->decompressor = libdeflate_alloc_decompressor()) == NULL) {
+        return Z_MEM_ERROR;
+    }
+    /* No actual size pointer, so anything but exactly dst_sz bytes is an error */
+    enum libdeflate_result ret = libdeflate_zlib_decompress(state->decompressor, src, src_sz, dst, dst_sz, NULL);
+    return ret == LIBDEFLATE_SUCCESS ? Z_OK : Z_DATA_ERROR;
+}
+
+static int azp_libdeflate_deflate(uint8_t *dst, size_t *dst_sz, const uint8_t *src, size_t src_sz, int level) {
+    azpLibdeflate_t *state = azp_libdeflate_state();
+    if(state == NULL) {
+        return Z_MEM_ERROR;
+    }
+    if(state->compressor == NULL || state->level != level) {
+        if(state->compressor != NULL) {
+            libdeflate_free_compressor(state->compressor);
+        }
+        state->compressor = libdeflate_alloc_compressor(level);
+        state->level = level;
+        if(state->compressor == NULL) {
+            return Z_MEM_ERROR;
+        }
+    }
+    size_t out = libdeflate_zlib_compress(state->compressor, src, src_sz, dst, *dst_sz);
+    if(out == 0) {
+        return Z_BUF_ERROR;
+    }
+    *dst_sz = out;
+    return Z_OK;
+}
+
+#endif
+
+/*
+ *      D I S P A T C H
+ */
+
+size_t azp_codec_bound(size_t src_sz) {
+    /* libdeflate may start a new block every 5000 bytes at worst, 5 bytes of header each */
+    size_t bound = src_sz + 5 * (src_sz / 5000 + 1) + 64;
+    size_t zbound = compressBound(src_sz);
+    return zbound > bound ? zbound : bound;
+}
+
+int azp_codec_inflate(uint8_t *dst, size_t dst_sz, const uint8_t *src, size_t src_sz) {
+    if(dst_sz > UINT_MAX || src_sz > UINT_MAX) {
+        return Z_BUF_ERROR;
+    }
+    azpSpan_t span;
+    azp_span_begin(&span);
+    int ret;
+#ifdef AZP_HAVE_LIBDEFLATE
+    if(azpCodec == AZP_CODEC_LIBDEFLATE) {
+        ret = azp_libdeflate_inflate(dst, dst_sz, src, src_sz);
+    } else
+#endif
+    ret = azp_zlib_inflate(dst, dst_sz, src, src_sz);
+    azp_span_end(&span, AZP_PHASE_INFLATE, src_sz, dst_sz, 1);
+    return ret;
+}
+
+int azp_codec_deflate(uint8_t *dst, size_t *dst_sz, const uint8_t *src, size_t src_sz, int level) {
+    if(src_sz > UINT_MAX) {
+        return Z_BUF_ERROR;
+    }
+    azpSpan_t span;
+    azp_span_begin(&span);
+    int ret = Z_BUF_ERROR;
+#ifdef AZP_HAVE_LIBDEFLATE
+    /* Stored data is left to zlib, not every libdeflate takes level 0 */
+    if(azpCodec == AZP_CODEC_LIBDEFLATE && level != Z_NO_COMPRESSION) {
+        ret = azp_libdeflate_deflate(dst, dst_sz, src, src_sz, level == Z_DEFAULT_COMPRESSION ? 6 : level);
+    }
+#endif
+    if(ret == Z_BUF_ERROR) {
+        ret = azp_zlib_deflate(dst, dst_sz, src, src_sz, level > Z_BEST_COMPRESSION ? Z_BEST_COMPRESSION : level);
+    }
+    azp_span_end(&span, AZP_PHASE_DEFLATE, src_sz, ret == Z_OK ? *dst_sz : 0, 1);
+    return ret;
+}
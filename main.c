@@ -6,14 +6,39 @@
  *	Arguments:
  *		Compress files into archive:	-c, --compress 	[FILES] FILENAME
  *		Extract files from archive:		-e, --extract 	FILENAME
- * 		TODO Append files to archive:		-a, --append	[FILES] FILENAME
- * 		TODO Delete files from archive		-d, --delete	[FILES] FILENAME
+ *		Extract matching files:			-x, --extract-only	[NAMES/PATTERNS] FILENAME
+ *		Write files to stdout:			-p, --stdout	[NAMES/PATTERNS] FILENAME
+ * 		Append/replace files in archive:	-a, --append	[FILES] FILENAME
+ * 		Delete files from archive:		-d, --delete	[NAMES/PATTERNS] FILENAME
  * 		List all files in archive:		-l, --list		FILENAME
+ * 		Test archive integrity:			-t, --test		FILENAME
+ * 		Recompress archive:				-r, --repack	[OUTPUT] FILENAME
  * 		List help text					-h, --help
  *
+ *	FILENAME - reads the archive from standard input (-e, -x, -p, -l)
+ *
+ *	Batch mode:							-b, --batch		ARCHIVES/@MANIFEST
+ *		Runs -l, -e, -t or -c over many archives on one worker pool
+ *
+ *	Options:
+ *		Worker threads:					-j, --jobs		N
+ *		Compression level:				-L, --level		[EXT=]LEVEL
+ *		CPU time limit for repacking:	-B, --cpu-budget	SECONDS
+ *		Entry and data order:			-O, --order		PROFILE|group
+ *		Only rewrite changed files:		-u, --update
+ *		Deflate implementation:			-C, --codec		zlib|libdeflate
+ *		Store identical files once:		-D, --dedup
+ *		Compressed blob cache:			-K, --cache		DIR
+ *		Cache size limit:				-M, --cache-size	MIB
+ *		Use/refresh index sidecar:		-i, --index
+ *		Print every file:				-v, --verbose
+ *		Phase timings and resources:	-S, --stats[=json]
+ *
  */
 
 
+#define _GNU_SOURCE
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,12 +48,19 @@
 #include <unistd.h>
 #include "azp.h"
 
+#define AZP_CACHE_SIZE (1024ull * 1024 * 1024)
+
 typedef enum eJobType {
     JOB_NONE,
     JOB_COMPRESS,
     JOB_EXTRACT = 2,
     JOB_APPEND = 3,
-    JOB_LIST = 4
+    JOB_LIST = 4,
+    JOB_EXTRACT_MATCHING = 5,
+    JOB_STDOUT = 6,
+    JOB_DELETE = 7,
+    JOB_TEST = 8,
+    JOB_REPACK = 9
 } eJobType;
 
 void print_usage(void) {
@@ -38,8 +70,35 @@ void print_usage(void) {
     Arguments:\n \
     \tCompress files into archive: -c, --compress FILE_LIST FILENAME\n\
     \tExtract files from archive:  -e, --extract  FILENAME\n\
+    \tExtract matching files:      -x, --extract-only PATTERN_LIST FILENAME\n\
+    \tWrite files to stdout:       -p, --stdout   PATTERN_LIST FILENAME\n\
+    \tAppend/replace files:        -a, --append   FILE_LIST FILENAME\n\
+    \tDelete files from archive:   -d, --delete   PATTERN_LIST FILENAME\n\
     \tList all files in archive:   -l, --list     FILENAME\n\
-    \tList help text:              -h, --help\n");
+    \tTest archive integrity:      -t, --test     FILENAME\n\
+    \tRecompress archive:          -r, --repack   [OUTPUT] FILENAME\n\
+    \tList help text:              -h, --help\n\
+    \n\
+    \tA directory in FILE_LIST adds every file below it, named by its path inside it.\n\
+    \n\
+    Batch mode:                    -b, --batch  with -l, -e, -t or -c\n\
+    \tEvery FILENAME is an archive, @FILE reads them from a manifest, one per line.\n\
+    \tFor -c each manifest line is ARCHIVE<TAB>FILE<TAB>FILE...\n\
+    \tArchives are extracted into subdirectories named after them.\n\
+    \n\
+    Options:\n \
+    \tWorker threads:              -j, --jobs N   (default: online CPUs)\n\
+    \tCompression level:           -L, --level [EXT=]LEVEL  (0-9, auto or max, default auto)\n\
+    \tCPU time limit for repack:   -B, --cpu-budget SECONDS\n\
+    \tEntry order for -c and -r:   -O, --order    PROFILE|group  (names in load order, or by dir/extension)\n\
+    \tOnly rewrite changed files:  -u, --update   (with -e, digests kept in .azpstate)\n\
+    \tDeflate implementation:      -C, --codec    zlib|libdeflate\n\
+    \tStore identical files once:  -D, --dedup\n\
+    \tCompressed blob cache:       -K, --cache DIR\n\
+    \tCache size limit:            -M, --cache-size MIB  (default 1024)\n\
+    \tUse/refresh index sidecar:   -i, --index    (FILENAME.idx)\n\
+    \tPrint every file:            -v, --verbose\n\
+    \tPhase timings and resources: -S, --stats[=json]  (to stderr)\n");
 }
 
 /* Ugly size units calculation */
@@ -63,7 +122,7 @@ static const char *sizeUnit(size_t bytes, size_t *bytesdiv) {
 /*
  * Ugly stuff for list printing
  */
-static void azp_list_entries(const azpHeader_t *header, const azpEntry_t *root) {
+static void azp_list_entries(const azpIndex_t *index) {
     size_t sum_compressed = 0;
     size_t sum_uncompressed = 0;
     const char *unit_comp;
@@ -72,15 +131,15 @@ static void azp_list_entries(const azpHeader_t *header, const azpEntry_t *root)
            "║  Nr.  ║  Packed  ║ Unpacked ║                   Filename                     ║\n" \
            "║       ║   Size   ║   Size   ║                                                ║\n" \
            "╠═══════╬══════════╬══════════╬════════════════════════════════════════════════╣\n");
-    for(uint32_t i = 0; i < header->fields.file_count; ++i) {
-        sum_compressed += root[i].compressed_size;
-        sum_uncompressed += root[i].uncompressed_size;
+    for(uint32_t i = 0; i < index->count; ++i) {
+        sum_compressed += index->compressed_size[i];
+        sum_uncompressed += index->uncompressed_size[i];
         size_t compressed_size = -1;
         size_t uncompressed_size = -1;
-        unit_comp = sizeUnit(root[i].compressed_size, &compressed_size);
-        unit_uncomp = sizeUnit(root[i].uncompressed_size, &uncompressed_size);
+        unit_comp = sizeUnit(index->compressed_size[i], &compressed_size);
+        unit_uncomp = sizeUnit(index->uncompressed_size[i], &uncompressed_size);
         printf("║ %5u ║%4zu %-4s ║ %-4zu %-4s║  %-46s║\n", 
-               i+1, compressed_size, unit_comp, uncompressed_size, unit_uncomp,root[i].filename);
+               i+1, compressed_size, unit_comp, uncompressed_size, unit_uncomp, azp_index_name(index, i));
     }
     printf("╚═══════╩══════════╩══════════╩════════════════════════════════════════════════╝\n");
     unit_comp = sizeUnit(sum_compressed, &sum_compressed);
@@ -89,12 +148,378 @@ static void azp_list_entries(const azpHeader_t *header, const azpEntry_t *root)
            sum_uncompressed, unit_uncomp, sum_compressed, unit_comp, (float)sum_compressed/sum_uncompressed);
 }
 
+/*
+ * Reports what deduplication saved
+ */
+static void azp_print_dedup(const azpCompressResult_t *result) {
+    if(result->duplicates > 0) {
+        printf("Deduplicated %u files: %zu bytes, %zu bytes compressed\n", result->duplicates, result->saved, result->saved_compressed);
+    }
+}
+
+/*
+ * Reports why an archive can't be opened
+ * err - errno of the failed call, only tells why for AZP_ERR_IO
+ */
+static void azp_print_open_error(const char *filename, int ret, int err) {
+    fprintf(stderr, "Cannot open archive %s: %s\n", filename, ret == AZP_ERR_IO ? strerror(err) : azp_strerror(ret));
+}
+
+/*
+ * Names the patterns that matched no entry
+ * matched - per pattern, from azp_index_select
+ * returns true if all of them matched
+ */
+static bool azp_print_unmatched(char **patterns, size_t pattern_count, const bool *matched) {
+    bool all_matched = true;
+    for(size_t p = 0; p < pattern_count; ++p) {
+        if(!matched[p]) {
+            fprintf(stderr, "No files in archive match %s\n", patterns[p]);
+            all_matched = false;
+        }
+    }
+    return all_matched;
+}
+
+/*
+ * Collects the entries matching the patterns, see azp_index_select
+ * all_matched - returns false there if some pattern matched nothing
+ * returns malloc()'d list of entry nr., NULL if out of memory
+ */
+static uint32_t *azp_select_entries(const azpIndex_t *index, char **patterns, size_t pattern_count, uint32_t *count, bool *all_matched) {
+    bool *matched = malloc((pattern_count + 1) * sizeof(bool));
+    uint32_t *list = matched != NULL ? azp_index_select(index, patterns, pattern_count, count, matched) : NULL;
+    if(list != NULL) {
+        *all_matched = azp_print_unmatched(patterns, pattern_count, matched);
+    }
+    free(matched);
+    return list;
+}
+
+/*
+ * Inflates the named entries to standard output one after another
+ */
+static bool azp_stream_entries(const azpIndex_t *index, char **patterns, size_t pattern_count, const uint8_t *archive, size_t archive_sz) {
+    uint32_t count;
+    bool ok;
+    uint32_t *list = azp_select_entries(index, patterns, pattern_count, &count, &ok);
+    if(list == NULL) {
+        return false;
+    }
+    azpFdWriter_t *writer = azp_fdwriter_open(STDOUT_FILENO);
+    if(writer == NULL) {
+        free(list);
+        return false;
+    }
+    for(uint32_t i = 0; ok && i < count; ++i) {
+        int ret = azp_extract_fd(index, list[i], archive, archive_sz, writer);
+        if(ret != 0) {
+            fprintf(stderr, "Error extracting file %s (%d)\n", azp_index_name(index, list[i]), ret);
+            ok = false;
+        }
+    }
+    if(azp_fdwriter_close(writer) != 0) {
+        perror("Error writing to standard output");
+        ok = false;
+    }
+    free(list);
+    return ok;
+}
+
+/*
+ * Runs a job on an archive piped into standard input, it can only be read front to back
+ * returns exit status
+ */
+static int azp_stdin_job(eJobType jobtype, char **patterns, size_t pattern_count) {
+    if(jobtype != JOB_LIST && jobtype != JOB_EXTRACT && jobtype != JOB_EXTRACT_MATCHING && jobtype != JOB_STDOUT) {
+        fprintf(stderr, "This job needs an archive file, standard input can only be read once\n");
+        return 1;
+    }
+    fprintf(jobtype == JOB_STDOUT ? stderr : stdout, "Reading archive from standard input...\n");
+    azpHeader_t header;
+    azpIndex_t toc;
+    if(!azp_index_read(&toc, &header, STDIN_FILENO)) {
+        fprintf(stderr, "Not a valid AZP archive or cannot read it!\n");
+        return 1;
+    }
+
+    bool ok = true;
+    uint32_t count = toc.count;
+    uint32_t *list = NULL;
+    if(jobtype == JOB_EXTRACT_MATCHING || jobtype == JOB_STDOUT) {
+        list = azp_select_entries(&toc, patterns, pattern_count, &count, &ok);
+        if(list == NULL) {
+            azp_index_free(&toc);
+            return 1;
+        }
+    }
+    switch(jobtype) {
+        case JOB_LIST:
+            azp_list_entries(&toc);
+            break;
+        case JOB_EXTRACT:
+        case JOB_EXTRACT_MATCHING:
+            if(!azp_extract_sequential(&header, &toc, STDIN_FILENO, list, count, NULL)) {
+                fprintf(stderr, "Error extracting archive\n");
+                ok = false;
+            }
+            break;
+        case JOB_STDOUT: {
+            /* In the order the data is stored, not the order asked for */
+            azpFdWriter_t *writer = azp_fdwriter_open(STDOUT_FILENO);
+            if(writer == NULL || !azp_extract_sequential(&header, &toc, STDIN_FILENO, list, count, writer)) {
+                fprintf(stderr, "Error streaming archive\n");
+                ok = false;
+            }
+            if(azp_fdwriter_close(writer) != 0) {
+                perror("Error writing to standard output");
+                ok = false;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    free(list);
+    azp_index_free(&toc);
+    return ok ? 0 : 1;
+}
+
+/*
+ * Archives of a batch run, manifest lines are kept as the items point into them
+ */
+typedef struct azpBatchList_t {
+    azpBatchItem_t *items;
+    size_t count;
+    char **lines;
+    size_t line_count;
+} azpBatchList_t;
+
+static bool azp_batch_add(azpBatchList_t *list, const char *archive, char **files, size_t file_count) {
+    azpBatchItem_t *items = realloc(list->items, (list->count + 1) * sizeof(azpBatchItem_t));
+    if(items == NULL) {
+        return false;
+    }
+    list->items = items;
+    items[list->count].archive = archive;
+    items[list->count].files = files;
+    items[list->count].file_count = file_count;
+    ++list->count;
+    return true;
+}
+
+/*
+ * Reads archives from a manifest, one per line, empty lines and lines starting
+ * with # are skipped. When compressing a line is ARCHIVE<TAB>FILE<TAB>FILE...
+ * returns false if it can't be read
+ */
+static bool azp_batch_manifest(azpBatchList_t *list, const char *path, bool compress) {
+    FILE *manifest = fopen(path, "r");
+    if(manifest == NULL) {
+        fprintf(stderr, "Cannot open manifest %s\n", path);
+        return false;
+    }
+    bool ok = true;
+    char *line = NULL;
+    size_t line_sz = 0;
+    ssize_t len;
+    for(unsigned nr = 1; ok && (len = getline(&line, &line_sz, manifest)) != -1; ++nr) {
+        while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if(len == 0 || line[0] == '#') {
+            continue;
+        }
+        char **lines = realloc(list->lines, (list->line_count + 1) * sizeof(char*));
+        if(lines == NULL) {
+            ok = false;
+            break;
+        }
+        list->lines = lines;
+        lines[list->line_count++] = line;
+
+        char **files = NULL;
+        size_t file_count = 0;
+        if(compress) {
+            /* Split in place, the first field is the archive */
+            files = malloc((len / 2 + 1) * sizeof(char*));
+            for(char *tab = strchr(line, '\t'); files != NULL && tab != NULL; tab = strchr(tab + 1, '\t')) {
+                *tab = '\0';
+                if(tab[1] != '\0' && tab[1] != '\t') {
+                    files[file_count++] = tab + 1;
+                }
+            }
+            if(files == NULL || file_count == 0) {
+                fprintf(stderr, "%s:%u: no files for archive %s\n", path, nr, line);
+                free(files);
+                ok = false;
+            }
+        }
+        ok = ok && azp_batch_add(list, line, files, file_count);
+        line = NULL;
+        line_sz = 0;
+    }
+    free(line);
+    fclose(manifest);
+    return ok;
+}
+
+static void azp_batch_free(azpBatchList_t *list) {
+    for(size_t i = 0; i < list->count; ++i) {
+        free(list->items[i].files);
+    }
+    for(size_t i = 0; i < list->line_count; ++i) {
+        free(list->lines[i]);
+    }
+    free(list->items);
+    free(list->lines);
+}
+
+/*
+ * Runs a job over every archive of the batch
+ * returns exit status
+ */
+static int azp_batch_job(eJobType jobtype, const azpBatchList_t *list, const azpCompressOptions_t *options, unsigned flags) {
+    uint32_t failed = 0;
+    if(jobtype == JOB_LIST) {
+        /* Nothing to share a pool for */
+        for(size_t i = 0; i < list->count; ++i) {
+            azpArchive_t *archive;
+            int ret = azp_archive_open(&archive, list->items[i].archive, flags);
+            if(ret != AZP_OK) {
+                azp_print_open_error(list->items[i].archive, ret, errno);
+                ++failed;
+                continue;
+            }
+            printf("%s%s:\n", i > 0 ? "\n" : "", list->items[i].archive);
+            azp_list_entries(azp_archive_index(archive));
+            azp_archive_close(archive);
+        }
+    } else {
+        azpBatchJob_t job = jobtype == JOB_EXTRACT ? AZP_BATCH_EXTRACT : jobtype == JOB_TEST ? AZP_BATCH_TEST : AZP_BATCH_COMPRESS;
+        azpBatchResult_t *results = malloc((list->count + 1) * sizeof(azpBatchResult_t));
+        if(results == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        printf("%s %zu archives...\n", job == AZP_BATCH_COMPRESS ? "Creating" : "Reading", list->count);
+        failed = azp_batch_run(job, list->items, list->count, options, flags, results);
+        for(size_t i = 0; i < list->count; ++i) {
+            const char *name = list->items[i].archive;
+            switch(results[i].status) {
+            case AZP_BATCH_OK:
+                break;
+            case AZP_BATCH_OPEN:
+                azp_print_open_error(name, results[i].error, results[i].sys_errno);
+                break;
+            case AZP_BATCH_FILES:
+                fprintf(stderr, "Cannot read the files for %s\n", name);
+                break;
+            case AZP_BATCH_SUBDIR:
+                fprintf(stderr, "Archives %s and %s would be extracted into the same directory\n", list->items[results[i].other].archive, name);
+                break;
+            case AZP_BATCH_FAILED:
+                fprintf(stderr, "Error %s archive %s\n", job == AZP_BATCH_COMPRESS ? "compressing" : "extracting", name);
+                break;
+            case AZP_BATCH_DAMAGED:
+                fprintf(stderr, "Archive %s is damaged\n", name);
+                break;
+            }
+        }
+        free(results);
+    }
+    if(failed > 0) {
+        fprintf(stderr, "%u of %zu archives failed\n", failed, list->count);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Long arguments and the short ones they stand for
+ */
+static const struct {
+    const char *name;
+    char letter;
+} longArgs[] = {
+    { "compress",     'c' },
+    { "extract",      'e' },
+    { "extract-only", 'x' },
+    { "stdout",       'p' },
+    { "append",       'a' },
+    { "delete",       'd' },
+    { "list",         'l' },
+    { "test",         't' },
+    { "batch",        'b' },
+    { "repack",       'r' },
+    { "help",         'h' },
+    { "index",        'i' },
+    { "level",        'L' },
+    { "cpu-budget",   'B' },
+    { "order",        'O' },
+    { "update",       'u' },
+    { "jobs",         'j' },
+    { "codec",        'C' },
+    { "dedup",        'D' },
+    { "cache",        'K' },
+    { "cache-size",   'M' },
+    { "verbose",      'v' },
+    { "stats",        'S' }
+};
+
+/*
+ * Short letter of an argument, long ones may carry a value after '='
+ */
+static char arg_letter(const char *arg) {
+    if(arg[1] != '-') {
+        return arg[1];
+    }
+    size_t len = strcspn(arg + 2, "=");
+    for(size_t i = 0; i < sizeof(longArgs) / sizeof(longArgs[0]); ++i) {
+        if(strlen(longArgs[i].name) == len && strncmp(arg + 2, longArgs[i].name, len) == 0) {
+            return longArgs[i].letter;
+        }
+    }
+    return '?';
+}
+
+/*
+ * Value of an argument, either after '=' or the next argument which is then skipped
+ * returns NULL if there is none
+ */
+static const char *arg_value(char **argv, int argc, uint16_t *i) {
+    const char *eq = strchr(argv[*i], '=');
+    if(argv[*i][1] == '-' && eq != NULL) {
+        return eq + 1;
+    }
+    if(*i + 1 >= argc) {
+        return NULL;
+    }
+    return argv[++*i];
+}
+
 int main(int argc, char **argv) {
 
     eJobType jobtype = JOB_NONE;
-    char *filename;
+    int status = 0;
+    char *filename = NULL;
     char *file_list[argc];
     size_t file_count = 0;
+    unsigned threads = 0;
+    bool use_sidecar = false;
+    bool batch = false;
+    bool dedup = false;
+    bool update = false;
+    const char *cache_dir = NULL;
+    size_t cache_size = AZP_CACHE_SIZE;
+    bool stats = false;
+    bool stats_json = false;
+    double cpu_budget = 0;
+    const char *order = NULL;
+    azpLayout_t layout = AZP_LAYOUT_KEEP;
+    azpProfile_t profile = { 0 };
+    azpPolicy_t policy;
+    azp_policy_init(&policy);
 
     if(argc < 2) {
         print_usage();
@@ -105,25 +530,113 @@ int main(int argc, char **argv) {
         --argc;
     }
     for(uint16_t i = 1; i < argc; ++i) {
-        /* If we already have a job then assume that everything past is filenames */
-        if(jobtype == JOB_NONE) {
-            /* If long arguments then increment the pointer */
-            if(argv[i][0] == '-' && argv[i][1] == '-') {
-                ++argv[i];
-            };
-            switch(argv[i][1]) {
+        /* Anything that is not an option is a filename */
+        if(argv[i][0] == '-' && argv[i][1] != '\0') {
+            const char *value;
+            switch(arg_letter(argv[i])) {
             case 'c':
                 jobtype = JOB_COMPRESS;
                 break;
             case 'e':
                 jobtype = JOB_EXTRACT;
                 break;
-            /*case 'a':
+            case 'a':
                 jobtype = JOB_APPEND;
-                break;*/
+                break;
+            case 'd':
+                jobtype = JOB_DELETE;
+                break;
             case 'l':
                 jobtype = JOB_LIST;
                 break;
+            case 't':
+                jobtype = JOB_TEST;
+                break;
+            case 'r':
+                jobtype = JOB_REPACK;
+                break;
+            case 'x':
+                jobtype = JOB_EXTRACT_MATCHING;
+                break;
+            case 'p':
+                jobtype = JOB_STDOUT;
+                break;
+            case 'b':
+                batch = true;
+                break;
+            case 'i':
+                use_sidecar = true;
+                break;
+            case 'L':
+                value = arg_value(argv, argc, &i);
+                if(value == NULL || !azp_policy_add_rule(&policy, value)) {
+                    printf("Invalid compression level rule for %s\n", argv[i]);
+                    return 1;
+                }
+                break;
+            case 'B':
+                value = arg_value(argv, argc, &i);
+                if(value == NULL || (cpu_budget = strtod(value, NULL)) <= 0) {
+                    printf("Invalid CPU budget for %s\n", argv[i]);
+                    return 1;
+                }
+                break;
+            case 'O':
+                order = arg_value(argv, argc, &i);
+                if(order == NULL) {
+                    printf("Missing access profile for %s\n", argv[i]);
+                    return 1;
+                }
+                break;
+            case 'C':
+                value = arg_value(argv, argc, &i);
+                if(value == NULL || !azp_codec_select(value)) {
+                    printf("Codec %s is not available\n", value != NULL ? value : "");
+                    return 1;
+                }
+                break;
+            case 'D':
+                dedup = true;
+                break;
+            case 'u':
+                update = true;
+                break;
+            case 'v':
+                azp_set_verbosity(AZP_VERBOSE);
+                break;
+            case 'S':
+                /* Only the long form takes a format */
+                value = strchr(argv[i], '=');
+                if(argv[i][1] == '-' && value != NULL) {
+                    if(strcmp(value + 1, "json") != 0) {
+                        printf("Invalid stats format for %s\n", argv[i]);
+                        return 1;
+                    }
+                    stats_json = true;
+                }
+                stats = true;
+                break;
+            case 'K':
+                cache_dir = arg_value(argv, argc, &i);
+                if(cache_dir == NULL) {
+                    printf("Missing cache directory for %s\n", argv[i]);
+                    return 1;
+                }
+                break;
+            case 'M':
+                value = arg_value(argv, argc, &i);
+                if(value == NULL || (cache_size = strtoull(value, NULL, 10) * 1024 * 1024) == 0) {
+                    printf("Invalid cache size for %s\n", argv[i]);
+                    return 1;
+                }
+                break;
+            case 'j':
+                value = arg_value(argv, argc, &i);
+                if(value == NULL || (threads = strtoul(value, NULL, 10)) == 0) {
+                    printf("Invalid thread count for %s\n", argv[i]);
+                    return 1;
+                }
+                break;
             default:
                 printf("Invalid argument: %s\n", argv[i]);
             case 'h':
@@ -135,62 +648,184 @@ int main(int argc, char **argv) {
             file_list[file_count++] = argv[i];
         }
     }
+    if(jobtype != JOB_NONE && filename == NULL) {
+        print_usage();
+        return 1;
+    }
+    if(update && (jobtype != JOB_EXTRACT || batch || strcmp(filename, "-") == 0)) {
+        fprintf(stderr, "--update works with -e on an archive file\n");
+        return 1;
+    }
+    if(stats) {
+        azp_stats_enable();
+    }
+    if(order != NULL && strcmp(order, "group") == 0) {
+        layout = AZP_LAYOUT_GROUP;
+    } else if(order != NULL) {
+        if(!azp_profile_load(&profile, order)) {
+            return 1;
+        }
+        layout = AZP_LAYOUT_PROFILE;
+    }
+    azpCache_t *cache = NULL;
+    if(cache_dir != NULL && (jobtype == JOB_COMPRESS || jobtype == JOB_APPEND)
+       && (cache = azp_cache_open(cache_dir, cache_size)) == NULL) {
+        fprintf(stderr, "Cannot use cache directory %s, compressing without it\n", cache_dir);
+    }
     
     /* If jobtype has something to do with an already existing archive then check for valid archive */
-    if(jobtype >= JOB_EXTRACT) {
-        printf("Reading archive %s...\n", filename);
-        int infile_fd = open(filename, O_RDONLY);
-        if(infile_fd == -1) {
-            printf("Error opening file %s!\n", filename);
-            return -1;
+    if(batch) {
+        azpCompressOptions_t options = {
+            .threads = threads,
+            .policy = &policy,
+            .dedup = dedup,
+            .cache = cache,
+            .layout = layout,
+            .profile = &profile
+        };
+        azpBatchList_t list = { 0 };
+        file_list[file_count++] = filename;
+        status = 0;
+        if(jobtype != JOB_LIST && jobtype != JOB_EXTRACT && jobtype != JOB_TEST && jobtype != JOB_COMPRESS) {
+            fprintf(stderr, "Batch mode works with -l, -e, -t and -c\n");
+            status = 1;
         }
-        struct stat st;
-        if(fstat(infile_fd, &st) != 0) {
-            fprintf(stderr, "Cannot stat file %s\n", filename);
-            close(infile_fd);
-            return -1;
-        }
-        size_t infile_sz = st.st_size;
-        
-        uint8_t *infile = mmap(NULL, infile_sz, PROT_READ, MAP_PRIVATE, infile_fd, 0);
-        if(infile == MAP_FAILED) {
-            fprintf(stderr, "Cannot mmap file %s\n", filename);
-            close(infile_fd);
-            return -1;
+        for(size_t i = 0; status == 0 && i < file_count; ++i) {
+            if(file_list[i][0] == '@') {
+                status = azp_batch_manifest(&list, file_list[i] + 1, jobtype == JOB_COMPRESS) ? 0 : 1;
+            } else if(jobtype == JOB_COMPRESS) {
+                fprintf(stderr, "Batch compression takes its archives and files from a manifest, @FILE\n");
+                status = 1;
+            } else if(!azp_batch_add(&list, file_list[i], NULL, 0)) {
+                status = 1;
+            }
         }
-            
-        azpHeader_t header;
-        
-        if(!azp_check_header(&header, infile, infile_sz)) {
-            fprintf(stderr, "Not a valid AZP archive, header mismatch!\n");
-            close(infile_fd);
-            munmap(infile, infile_sz);
-            return -1;
+        if(status == 0) {
+            status = azp_batch_job(jobtype, &list, &options, use_sidecar ? AZP_OPEN_SIDECAR : 0);
         }
-        azpEntry_t *toc = azp_get_file_list(&header, infile, infile_sz);
-        if(toc == NULL) {
-            fprintf(stderr, "Error getting file list\n");
-            close(infile_fd);
-            munmap(infile, infile_sz);
+        azp_batch_free(&list);
+    } else if(jobtype >= JOB_EXTRACT && strcmp(filename, "-") == 0) {
+        status = azp_stdin_job(jobtype, file_list, file_count);
+    } else if(jobtype >= JOB_EXTRACT) {
+        /* Standard output may be the data itself */
+        fprintf(jobtype == JOB_STDOUT ? stderr : stdout, "Reading archive %s...\n", filename);
+        azpArchive_t *archive;
+        int ret = azp_archive_open(&archive, filename, use_sidecar ? AZP_OPEN_SIDECAR : 0);
+        if(ret != AZP_OK) {
+            azp_print_open_error(filename, ret, errno);
             return -1;
         }
+        const azpHeader_t header = *azp_archive_header(archive);
+        const azpIndex_t toc = *azp_archive_index(archive);
+        size_t infile_sz;
+        const uint8_t *infile = azp_archive_data(archive, &infile_sz);
+        int infile_fd = azp_archive_fd(archive);
+
         switch(jobtype) {
             default:
             case JOB_LIST:
-                azp_list_entries(&header, toc);
+                azp_list_entries(&toc);
                 break;
             case JOB_EXTRACT:
-                if(!azp_extract_all(&header, toc, infile, infile_sz)) {
+                if(update) {
+                    uint32_t current;
+                    bool ok = azp_extract_update(archive, filename, NULL, threads, &current);
+                    printf("%u of %u files up to date\n", current, toc.count);
+                    if(!ok) {
+                        fprintf(stderr, "Error extracting archive\n");
+                        status = 1;
+                    }
+                } else if(!azp_extract_all(&toc, infile, infile_sz, threads)) {
                     fprintf(stderr, "Error extracting archive\n");
+                    status = 1;
+                }
+                break;
+            case JOB_EXTRACT_MATCHING: {
+                /* Stays set if the entries can't even be looked up */
+                bool *matched = malloc((file_count + 1) * sizeof(bool));
+                for(size_t p = 0; matched != NULL && p < file_count; ++p) {
+                    matched[p] = true;
+                }
+                if(matched == NULL || !azp_extract_matching(&toc, file_list, file_count, infile, infile_sz, threads, matched)) {
+                    /* A pattern that matched nothing is its own message */
+                    if(matched == NULL || azp_print_unmatched(file_list, file_count, matched)) {
+                        fprintf(stderr, "Error extracting archive\n");
+                    }
+                    status = 1;
+                }
+                free(matched);
+                break;
+            }
+            case JOB_TEST:
+                if(azp_test_archive(&header, &toc, infile, infile_sz, threads)) {
+                    printf("No errors found in %s\n", filename);
+                } else {
+                    fprintf(stderr, "Archive %s is damaged\n", filename);
+                    status = 1;
+                }
+                break;
+            case JOB_REPACK: {
+                azpRepackOptions_t options = {
+                    .threads = threads,
+                    .policy = &policy,
+                    .cpu_budget = cpu_budget,
+                    .layout = layout,
+                    .profile = &profile
+                };
+                azpRepackResult_t result;
+                if(file_count > 1) {
+                    print_usage();
+                    status = 1;
+                } else if(azp_repack_archive(filename, file_count == 1 ? file_list[0] : NULL, &toc, infile, infile_sz, infile_fd, &options, &result) != 0) {
+                    fprintf(stderr, "Error repacking archive\n");
+                    status = 1;
+                } else {
+                    printf("Repacked %s: %u of %u blobs smaller, %u skipped over the CPU budget, %zu -> %zu bytes\n",
+                           file_count == 1 ? file_list[0] : filename, result.smaller, result.blobs, result.skipped, result.old_size, result.new_size);
+                }
+                break;
+            }
+            case JOB_STDOUT:
+                if(!azp_stream_entries(&toc, file_list, file_count, infile, infile_sz)) {
+                    fprintf(stderr, "Error streaming archive\n");
+                    status = 1;
                 }
                 break;
             case JOB_APPEND:
+            case JOB_DELETE: {
+                azpCompressOptions_t options = {
+                    .threads = threads,
+                    .policy = &policy,
+                    .dedup = dedup,
+                    .cache = cache
+                };
+                azpCompressResult_t result;
+                bool all_matched = true;
+                if(jobtype == JOB_DELETE && file_count > 0) {
+                    /* Every pattern has to remove something, name the ones that don't */
+                    uint32_t removed;
+                    free(azp_select_entries(&toc, file_list, file_count, &removed, &all_matched));
+                }
+                if(file_count == 0) {
+                    print_usage();
+                    status = 1;
+                } else if(!all_matched) {
+                    status = 1;
+                } else if(azp_update_archive(filename, &toc, infile, infile_sz, infile_fd,
+                                             jobtype == JOB_DELETE ? file_list : NULL, jobtype == JOB_DELETE ? file_count : 0,
+                                             jobtype == JOB_APPEND ? file_list : NULL, jobtype == JOB_APPEND ? file_count : 0,
+                                             &options, &result) != 0) {
+                    fprintf(stderr, "Error updating archive\n");
+                    status = 1;
+                } else {
+                    azp_print_dedup(&result);
+                    printf("Updated archive %s: %u kept, %u added, %u removed\n", filename, result.kept, result.added, result.removed);
+                }
                 break;
+            }
         }
 
-        free(toc);
-        close(infile_fd);
-        munmap(infile, infile_sz);
+        azp_archive_close(archive);
     } else if (jobtype == JOB_COMPRESS) {
         azpHeader_t header;
         
@@ -201,10 +836,36 @@ int main(int argc, char **argv) {
 
         azpEntry_t *toc = azp_make_file_list(&header, file_list, file_count);
         if(toc != NULL) {
-            azp_compress_files(&header, toc, filename);
+            azpCompressOptions_t options = {
+                .threads = threads,
+                .policy = &policy,
+                .dedup = dedup,
+                .cache = cache,
+                .layout = layout,
+                .profile = &profile
+            };
+            azpCompressResult_t result;
+            if(azp_compress_files(&header, toc, filename, &options, &result) != 0) {
+                status = 1;
+            } else {
+                azp_print_dedup(&result);
+            }
+        } else {
+            status = 1;
         }
         free(toc);
     }
+    if(cache != NULL) {
+        uint32_t hits, misses;
+        azp_cache_counts(cache, &hits, &misses);
+        if(hits + misses > 0) {
+            printf("Cache: %u hits, %u misses\n", hits, misses);
+        }
+    }
+    azp_cache_close(cache);
+    azp_profile_free(&profile);
+    azp_policy_free(&policy);
+    azp_stats_print(stats_json);
 
-    return 0;
+    return status;
 }
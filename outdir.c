@@ -0,0 +1,572 @@
+/*
+ * Output directory tree for extraction
+ *
+ * The directories of all entries are created once up front and kept open, files
+ * are then created with openat() relative to their directory instead of walking
+ * the whole path every time. Small files are created, written and closed in
+ * batches through io_uring, a couple of syscalls for a few hundred files. Rings
+ * are kept with the tree and handed to the next batch, so each worker sets one up
+ * once instead of for every batch.
+ *
+ * Licenced under GPLv3
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include "outdir.h"
+#include "uring.h"
+
+#define AZP_FILE_FLAGS (O_CREAT | O_TRUNC | O_CLOEXEC)
+#define AZP_FILE_MODE 0644
+/* Files per round through a ring, each takes an openat and then a write and a close */
+#define AZP_RING_BATCH 256
+
+#ifdef AZP_HAVE_URING
+typedef struct azpOutRing_t {
+    azpUring_t ring;
+    int fds[AZP_RING_BATCH];
+} azpOutRing_t;
+
+/*
+ * Rings made for this tree, at most one per worker is in use at a time
+ */
+typedef struct azpRingPool_t {
+    pthread_mutex_t lock;
+    azpOutRing_t **idle;
+    uint32_t idle_count;
+    uint32_t count;      // rings made, idle has room for all of them
+    bool unavailable;    // io_uring can't be set up here, don't try again
+} azpRingPool_t;
+#endif
+
+typedef struct azpDir_t {
+    uint32_t parent;
+    uint32_t hash;
+    char *path;  // relative to the current directory, '/' separated, includes the root
+    int fd;      // open directory, -1 if not kept open
+    bool failed; // could not be created
+} azpDir_t;
+
+struct azpOutDir_t {
+    const azpIndex_t *index;
+    azpDir_t *dirs;
+    uint32_t dir_count;
+    uint32_t *table; // hash table of dir numbers, AZP_NOT_FOUND for empty slots
+    uint32_t table_mask;
+    uint32_t *entry_dir;  // per entry, AZP_NOT_FOUND if it is not extracted
+    uint32_t *entry_base; // offset of the file name within the entry name
+    long fds_left;        // how many more directories may be kept open
+#ifdef AZP_HAVE_URING
+    azpRingPool_t *rings;
+#endif
+};
+
+/*
+ * FNV-1a of a path component, mixed with the parent dir
+ */
+static uint32_t azp_dir_hash(uint32_t parent, const char *name, size_t len) {
+    uint32_t hash = 2166136261u ^ parent;
+    for(size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Creates a directory and opens it
+ * returns 0 if ok
+ */
+static int azp_dir_make(azpOutDir_t *out, azpDir_t *dir) {
+    const azpDir_t *parent = &out->dirs[dir->parent];
+    if(parent->failed) {
+        return -1;
+    }
+    /* Last component of path, the parent's fd is relative to that */
+    const char *name = strrchr(dir->path, '/');
+    name = name != NULL ? name + 1 : dir->path;
+    int at = parent->fd;
+    if(at == -1) {
+        at = AT_FDCWD;
+        name = dir->path;
+    }
+
+    if(mkdirat(at, name, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    if(out->fds_left > 0) {
+        dir->fd = openat(at, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dir->fd != -1) {
+            --out->fds_left;
+            return 0;
+        }
+        if(errno != EMFILE && errno != ENFILE) {
+            return -1;
+        }
+        out->fds_left = 0;
+    }
+    /* Out of fds, files in here get created by path */
+    struct stat st;
+    if(fstatat(at, name, &st, 0) != 0 || !S_ISDIR(st.st_mode)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Finds the directory name[0..len) under parent, creating it if it is new
+ * returns dir number
+ */
+static uint32_t azp_dir_get(azpOutDir_t *out, uint32_t parent, const char *name, size_t len) {
+    uint32_t hash = azp_dir_hash(parent, name, len);
+    uint32_t slot = hash & out->table_mask;
+    const azpDir_t *up = &out->dirs[parent];
+    /* The current directory is left out of paths, an output directory is not */
+    size_t up_len = parent == 0 && up->fd == AT_FDCWD ? 0 : strlen(up->path) + 1;
+
+    for(uint32_t d; (d = out->table[slot]) != AZP_NOT_FOUND; slot = (slot + 1) & out->table_mask) {
+        const azpDir_t *dir = &out->dirs[d];
+        if(dir->hash == hash && dir->parent == parent
+           && strncmp(dir->path + up_len, name, len) == 0 && dir->path[up_len + len] == '\0') {
+            return d;
+        }
+    }
+
+    azpDir_t *dir = &out->dirs[out->dir_count];
+    dir->parent = parent;
+    dir->hash = hash;
+    dir->fd = -1;
+    dir->path = malloc(up_len + len + 1);
+    if(dir->path == NULL) {
+        return AZP_NOT_FOUND;
+    }
+    if(up_len != 0) {
+        memcpy(dir->path, up->path, up_len - 1);
+        dir->path[up_len - 1] = '/';
+    }
+    memcpy(dir->path + up_len, name, len);
+    dir->path[up_len + len] = '\0';
+    dir->failed = azp_dir_make(out, dir) != 0;
+    if(dir->failed) {
+        fprintf(stderr, "Error creating directory %s: %s\n", dir->path, strerror(errno));
+    }
+    out->table[slot] = out->dir_count;
+    return out->dir_count++;
+}
+
+/*
+ * Splits an entry name into directories and file name
+ * returns false if the entry can't be extracted
+ */
+static bool azp_outdir_add(azpOutDir_t *out, uint32_t entry) {
+    const char *name = azp_index_name(out->index, entry);
+    const char *part = name;
+    uint32_t dir = 0;
+
+    for(const char *sep; (sep = strpbrk(part, "/\\")) != NULL; part = sep + 1) {
+        size_t len = sep - part;
+        /* Skip empty and "." components, never go up */
+        if(len == 0 || (len == 1 && part[0] == '.')) {
+            continue;
+        }
+        if(len == 2 && part[0] == '.' && part[1] == '.') {
+            fprintf(stderr, "Refusing to extract %s outside the current directory\n", name);
+            return false;
+        }
+        dir = azp_dir_get(out, dir, part, len);
+        if(dir == AZP_NOT_FOUND || out->dirs[dir].failed) {
+            return false;
+        }
+    }
+    if(part[0] == '\0' || strcmp(part, ".") == 0 || strcmp(part, "..") == 0) {
+        fprintf(stderr, "Invalid file name %s\n", name);
+        return false;
+    }
+    out->entry_dir[entry] = dir;
+    out->entry_base[entry] = part - name;
+    return true;
+}
+
+azpOutDir_t *azp_outdir_open(const char *root, const azpIndex_t *index, const uint32_t *list, uint32_t count) {
+    azpOutDir_t *out = calloc(1, sizeof(azpOutDir_t));
+    if(out == NULL) {
+        return NULL;
+    }
+    out->index = index;
+
+    /* Every separator could be a new directory */
+    size_t max_dirs = 1;
+    for(uint32_t i = 0; i < count; ++i) {
+        const char *name = azp_index_name(index, list != NULL ? list[i] : i);
+        for(; *name != '\0'; ++name) {
+            max_dirs += *name == '/' || *name == '\\';
+        }
+    }
+    /* Dir numbers and the table mask are 32 bit */
+    if(max_dirs > UINT32_MAX / 4) {
+        azp_outdir_close(out);
+        return NULL;
+    }
+    size_t table_sz = 2;
+    while(table_sz < max_dirs * 2) {
+        table_sz <<= 1;
+    }
+
+    out->dirs = calloc(max_dirs, sizeof(azpDir_t));
+    out->table = malloc(table_sz * sizeof(uint32_t));
+    out->entry_dir = malloc((index->count + 1) * sizeof(uint32_t));
+    out->entry_base = calloc(index->count + 1, sizeof(uint32_t));
+    if(out->dirs == NULL || out->table == NULL || out->entry_dir == NULL || out->entry_base == NULL) {
+        azp_outdir_close(out);
+        return NULL;
+    }
+    memset(out->table, 0xFF, table_sz * sizeof(uint32_t));
+    memset(out->entry_dir, 0xFF, (index->count + 1) * sizeof(uint32_t));
+    out->table_mask = table_sz - 1;
+#ifdef AZP_HAVE_URING
+    out->rings = calloc(1, sizeof(azpRingPool_t));
+    if(out->rings == NULL || pthread_mutex_init(&out->rings->lock, NULL) != 0) {
+        free(out->rings);
+        out->rings = NULL;
+        azp_outdir_close(out);
+        return NULL;
+    }
+#endif
+
+    /* Leave half of the fds for the files themselves */
+    struct rlimit limit;
+    out->fds_left = 256;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        out->fds_left = limit.rlim_cur / 2;
+    }
+
+    /* Dir 0 is the output directory */
+    out->dirs[0].parent = 0;
+    out->dirs[0].fd = AT_FDCWD;
+    out->dirs[0].path = strdup(root != NULL ? root : ".");
+    out->dir_count = 1;
+    if(out->dirs[0].path == NULL) {
+        azp_outdir_close(out);
+        return NULL;
+    }
+    if(root != NULL) {
+        if(mkdir(root, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error creating directory %s: %s\n", root, strerror(errno));
+            azp_outdir_close(out);
+            return NULL;
+        }
+        out->dirs[0].fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(out->dirs[0].fd == -1) {
+            fprintf(stderr, "Error opening directory %s: %s\n", root, strerror(errno));
+            azp_outdir_close(out);
+            return NULL;
+        }
+        --out->fds_left;
+    }
+
+    for(uint32_t i = 0; i < count; ++i) {
+        (void)azp_outdir_add(out, list != NULL ? list[i] : i);
+    }
+    return out;
+}
+
+void azp_outdir_close(azpOutDir_t *out) {
+    if(out == NULL) {
+        return;
+    }
+    for(uint32_t i = 0; out->dirs != NULL && i < out->dir_count; ++i) {
+        if(out->dirs[i].fd >= 0) {
+            close(out->dirs[i].fd);
+        }
+        free(out->dirs[i].path);
+    }
+    free(out->dirs);
+    free(out->table);
+    free(out->entry_dir);
+    free(out->entry_base);
+#ifdef AZP_HAVE_URING
+    if(out->rings != NULL) {
+        /* Every ring is idle once the workers are done */
+        for(uint32_t i = 0; i < out->rings->idle_count; ++i) {
+            azp_uring_exit(&out->rings->idle[i]->ring);
+            free(out->rings->idle[i]);
+        }
+        free(out->rings->idle);
+        pthread_mutex_destroy(&out->rings->lock);
+        free(out->rings);
+    }
+#endif
+    free(out);
+}
+
+/*
+ * Opens the output file of an entry with the given access mode
+ * returns fd or -1
+ */
+static int azp_outdir_open_file(const azpOutDir_t *out, uint32_t entry, int mode) {
+    if(entry >= out->index->count || out->entry_dir[entry] == AZP_NOT_FOUND) {
+        errno = EINVAL;
+        return -1;
+    }
+    const azpDir_t *dir = &out->dirs[out->entry_dir[entry]];
+    const char *base = azp_index_name(out->index, entry) + out->entry_base[entry];
+    if(dir->fd != -1) {
+        return openat(dir->fd, base, mode | AZP_FILE_FLAGS, AZP_FILE_MODE);
+    }
+
+    char *path = malloc(strlen(dir->path) + strlen(base) + 2);
+    if(path == NULL) {
+        return -1;
+    }
+    sprintf(path, "%s/%s", dir->path, base);
+    int fd = open(path, mode | AZP_FILE_FLAGS, AZP_FILE_MODE);
+    free(path);
+    return fd;
+}
+
+int azp_outdir_create(const azpOutDir_t *out, uint32_t entry) {
+    return azp_outdir_open_file(out, entry, O_RDWR);
+}
+
+/*
+ * Creates and writes one file with plain syscalls
+ * returns 0 or -errno
+ */
+static int azp_outdir_write_one(const azpOutDir_t *out, uint32_t entry, const uint8_t *data) {
+    int fd = azp_outdir_open_file(out, entry, O_WRONLY);
+    if(fd == -1) {
+        return -errno;
+    }
+    size_t left = out->index->uncompressed_size[entry];
+    int ret = 0;
+    while(left > 0) {
+        ssize_t n = write(fd, data, left);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            ret = -errno;
+            break;
+        }
+        data += n;
+        left -= n;
+    }
+    if(close(fd) != 0 && ret == 0) {
+        ret = -errno;
+    }
+    return ret;
+}
+
+#ifdef AZP_HAVE_URING
+/*
+ * Waits for and takes the next completion
+ * returns false if the ring broke
+ */
+static bool azp_outdir_reap(azpUring_t *ring, struct io_uring_cqe *cqe) {
+    while(!azp_uring_cqe(ring, cqe)) {
+        if(azp_uring_submit(ring, 1) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Takes an idle ring or sets up a new one
+ * returns NULL if io_uring is not available
+ */
+static azpOutRing_t *azp_outdir_ring_get(azpRingPool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    azpOutRing_t *ring = NULL;
+    if(pool->idle_count > 0) {
+        ring = pool->idle[--pool->idle_count];
+    }
+    bool unavailable = pool->unavailable;
+    pthread_mutex_unlock(&pool->lock);
+    if(ring != NULL || unavailable) {
+        return ring;
+    }
+
+    ring = malloc(sizeof(azpOutRing_t));
+    if(ring == NULL) {
+        return NULL;
+    }
+    if(!azp_uring_init(&ring->ring, AZP_RING_BATCH * 2)) {
+        free(ring);
+        pthread_mutex_lock(&pool->lock);
+        pool->unavailable = true;
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    /* Room to give it back later */
+    pthread_mutex_lock(&pool->lock);
+    azpOutRing_t **idle = realloc(pool->idle, (pool->count + 1) * sizeof(azpOutRing_t*));
+    if(idle != NULL) {
+        pool->idle = idle;
+        ++pool->count;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if(idle == NULL) {
+        azp_uring_exit(&ring->ring);
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+/*
+ * Gives a ring back for the next batch, a broken one is torn down
+ */
+static void azp_outdir_ring_put(azpRingPool_t *pool, azpOutRing_t *ring, bool broken) {
+    pthread_mutex_lock(&pool->lock);
+    if(broken) {
+        --pool->count;
+    } else {
+        pool->idle[pool->idle_count++] = ring;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if(broken) {
+        azp_uring_exit(&ring->ring);
+        free(ring);
+    }
+}
+
+/*
+ * One round of openat for all files, then one round of write + close pairs
+ * count - at most AZP_RING_BATCH
+ * returns false if the ring broke and may still hold requests
+ */
+static bool azp_outdir_write_uring(const azpOutDir_t *out, azpUring_t *ring, const uint32_t *entries, uint32_t count, uint8_t *const *data, int *results, int *fds) {
+    struct io_uring_cqe cqe;
+    struct io_uring_sqe *sqe;
+    unsigned pending = 0;
+    bool ok = true;
+
+    for(uint32_t i = 0; i < count; ++i) {
+        fds[i] = -1;
+        uint32_t dir = out->entry_dir[entries[i]];
+        if(dir == AZP_NOT_FOUND || out->dirs[dir].fd == -1 || (sqe = azp_uring_sqe(ring)) == NULL) {
+            /* Not under a kept open directory */
+            results[i] = azp_outdir_write_one(out, entries[i], data[i]);
+            continue;
+        }
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = out->dirs[dir].fd;
+        sqe->addr = (uintptr_t)(azp_index_name(out->index, entries[i]) + out->entry_base[entries[i]]);
+        sqe->len = AZP_FILE_MODE;
+        sqe->open_flags = O_WRONLY | AZP_FILE_FLAGS;
+        sqe->user_data = i;
+        results[i] = 1; // in flight
+        ++pending;
+    }
+    if(pending != 0 && azp_uring_submit(ring, pending) != 0) {
+        pending = 0;
+        ok = false;
+    }
+    for(; pending > 0; --pending) {
+        if(!azp_outdir_reap(ring, &cqe)) {
+            ok = false;
+            break;
+        }
+        uint32_t i = cqe.user_data;
+        if(cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+            /* Kernel without openat in io_uring */
+            results[i] = azp_outdir_write_one(out, entries[i], data[i]);
+        } else if(cqe.res < 0) {
+            results[i] = cqe.res;
+        } else {
+            fds[i] = cqe.res;
+            results[i] = 0;
+        }
+    }
+
+    /* Write linked to close, a failed write cancels the close */
+    for(uint32_t i = 0; i < count; ++i) {
+        if(fds[i] == -1) {
+            continue;
+        }
+        size_t len = out->index->uncompressed_size[entries[i]];
+        if(len > 0) {
+            sqe = azp_uring_sqe(ring);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->fd = fds[i];
+            sqe->addr = (uintptr_t)data[i];
+            sqe->len = len;
+            sqe->user_data = (uint64_t)i << 1;
+            ++pending;
+        }
+        sqe = azp_uring_sqe(ring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fds[i];
+        sqe->user_data = ((uint64_t)i << 1) | 1;
+        ++pending;
+    }
+    if(pending != 0 && azp_uring_submit(ring, pending) != 0) {
+        pending = 0;
+        ok = false;
+    }
+    for(; pending > 0; --pending) {
+        if(!azp_outdir_reap(ring, &cqe)) {
+            ok = false;
+            break;
+        }
+        uint32_t i = cqe.user_data >> 1;
+        if(cqe.user_data & 1) {
+            if(cqe.res == -ECANCELED) {
+                close(fds[i]);
+            } else if(cqe.res < 0 && results[i] == 0) {
+                results[i] = cqe.res;
+            }
+            fds[i] = -1;
+        } else if(cqe.res < 0) {
+            results[i] = cqe.res;
+        } else if((size_t)cqe.res != out->index->uncompressed_size[entries[i]]) {
+            /* Short write to a regular file, the disk is full */
+            results[i] = -ENOSPC;
+        }
+    }
+
+    /* Only left over if the ring broke */
+    for(uint32_t i = 0; i < count; ++i) {
+        if(fds[i] != -1) {
+            close(fds[i]);
+            results[i] = -EIO;
+        } else if(results[i] == 1) {
+            results[i] = -EIO;
+        }
+    }
+    return ok;
+}
+#endif
+
+void azp_outdir_write(const azpOutDir_t *out, const uint32_t *entries, uint32_t count, uint8_t *const *data, int *results) {
+#ifdef AZP_HAVE_URING
+    azpOutRing_t *ring = count > 1 ? azp_outdir_ring_get(out->rings) : NULL;
+    if(ring != NULL) {
+        bool ok = true;
+        uint32_t done = 0;
+        while(ok && done < count) {
+            uint32_t n = count - done < AZP_RING_BATCH ? count - done : AZP_RING_BATCH;
+            ok = azp_outdir_write_uring(out, &ring->ring, entries + done, n, data + done, results + done, ring->fds);
+            done += n;
+        }
+        azp_outdir_ring_put(out->rings, ring, !ok);
+        /* Rounds after the ring broke go through plain syscalls */
+        for(uint32_t i = done; i < count; ++i) {
+            results[i] = azp_outdir_write_one(out, entries[i], data[i]);
+        }
+        return;
+    }
+#endif
+    for(uint32_t i = 0; i < count; ++i) {
+        results[i] = azp_outdir_write_one(out, entries[i], data[i]);
+    }
+}
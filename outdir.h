@@ -0,0 +1,45 @@
+/*
+ * Output directory tree for extraction
+ *
+ * Licenced under GPLv3
+*/
+#ifndef _OUTDIR_H_
+#define _OUTDIR_H_
+
+#include <stdint.h>
+#include "azp.h"
+
+typedef struct azpOutDir_t azpOutDir_t;
+
+/*
+ * Creates every directory the listed entries need under the output directory
+ * and keeps them open, so files can be created relative to their directory
+ * Names with ".." in them are refused
+ * root - output directory, created if needed, NULL for the current directory
+ * list - entry numbers, NULL for all entries
+ * count - number of entries in list
+ * returns NULL if out of memory or root can't be created
+ */
+azpOutDir_t *azp_outdir_open(const char *root, const azpIndex_t *index, const uint32_t *list, uint32_t count);
+
+/*
+ * Closes the cached directories and frees the tree
+ */
+void azp_outdir_close(azpOutDir_t *out);
+
+/*
+ * Creates (or truncates) the output file of an entry
+ * returns fd opened for reading and writing, -1 if not
+ */
+int azp_outdir_create(const azpOutDir_t *out, uint32_t entry);
+
+/*
+ * Creates and writes a batch of small entries that are already inflated
+ * Goes through io_uring when available, plain syscalls otherwise
+ * entries - entry numbers
+ * data - uncompressed data of each entry
+ * results - filled with 0 or -errno for each entry
+ */
+void azp_outdir_write(const azpOutDir_t *out, const uint32_t *entries, uint32_t count, uint8_t *const *data, int *results);
+
+#endif
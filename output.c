@@ -0,0 +1,298 @@
+/*
+ * Extraction outputs, files and plain file descriptors
+ *
+ * Licenced under GPLv3
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "azp.h"
+#include "stats.h"
+
+#define AZP_FD_BUFFER (1024 * 1024)
+#define AZP_MMAP_MIN (1024 * 1024) // smaller files are inflated in memory and written in one go
+
+/*
+ * When fd is a pipe the buffers are exactly the pipe size and are handed to the
+ * kernel with vmsplice instead of being copied. The pipe keeps referencing the pages
+ * until the reader is done with them, and a reader that splices them on may hold them
+ * longer still, so a buffer that went in is gifted and unmapped, never written again,
+ * and a fresh one is mapped in its place.
+ */
+struct azpFdWriter_t {
+    int fd;
+    bool splice;     // fd is a pipe and vmsplice works
+    bool spliced;    // something already went through vmsplice
+    uint8_t *buf[2]; // mmap()'d, pages stay valid for the pipe even after munmap
+    size_t buf_sz;
+    size_t used;     // bytes in buf[cur]
+    int cur;
+};
+
+azpFdWriter_t *azp_fdwriter_open(int fd) {
+    azpFdWriter_t *writer = calloc(1, sizeof(azpFdWriter_t));
+    if(writer == NULL) {
+        return NULL;
+    }
+    writer->fd = fd;
+    writer->buf_sz = AZP_FD_BUFFER;
+
+#ifdef __linux__
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        /* Bigger pipe means fewer wakeups, not allowed past /proc/sys/fs/pipe-max-size */
+        (void)fcntl(fd, F_SETPIPE_SZ, AZP_FD_BUFFER);
+        int pipe_sz = fcntl(fd, F_GETPIPE_SZ);
+        if(pipe_sz > 0) {
+            writer->splice = true;
+            writer->buf_sz = pipe_sz;
+        }
+    }
+#endif
+
+    for(int i = 0; i < 2; ++i) {
+        writer->buf[i] = mmap(NULL, writer->buf_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(writer->buf[i] == MAP_FAILED) {
+            writer->buf[i] = NULL;
+            azp_fdwriter_close(writer);
+            return NULL;
+        }
+    }
+    return writer;
+}
+
+/*
+ * Writes out the current buffer and switches to the other one
+ * returns 0 if ok
+ */
+static int azp_fdwriter_flush(azpFdWriter_t *writer) {
+    const uint8_t *data = writer->buf[writer->cur];
+    size_t left = writer->used;
+
+#ifdef __linux__
+    while(writer->splice && left > 0) {
+        struct iovec iov = { .iov_base = (void*)data, .iov_len = left };
+        ssize_t n = vmsplice(writer->fd, &iov, 1, SPLICE_F_GIFT);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            /* Not supported here, copy instead (only safe before any pages were handed over) */
+            if((errno == EINVAL || errno == ENOSYS) && !writer->spliced) {
+                writer->splice = false;
+                break;
+            }
+            return -1;
+        }
+        writer->spliced = true;
+        data += n;
+        left -= n;
+        if(left == 0) {
+            /* The pages belong to the pipe now */
+            munmap(writer->buf[writer->cur], writer->buf_sz);
+            writer->buf[writer->cur] = mmap(NULL, writer->buf_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(writer->buf[writer->cur] == MAP_FAILED) {
+                writer->buf[writer->cur] = NULL;
+                return -1;
+            }
+        }
+    }
+#endif
+    while(left > 0) {
+        ssize_t n = write(writer->fd, data, left);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        left -= n;
+    }
+
+    writer->used = 0;
+    writer->cur ^= 1;
+    return 0;
+}
+
+int azp_fdwriter_close(azpFdWriter_t *writer) {
+    if(writer == NULL) {
+        return 0;
+    }
+    int ret = 0;
+    if(writer->used > 0 && azp_fdwriter_flush(writer) != 0) {
+        ret = -1;
+    }
+    for(int i = 0; i < 2; ++i) {
+        if(writer->buf[i] != NULL) {
+            munmap(writer->buf[i], writer->buf_sz);
+        }
+    }
+    free(writer);
+    return ret;
+}
+
+int azp_fdwriter_write(azpFdWriter_t *writer, const void *data, size_t len) {
+    const uint8_t *p = data;
+    while(len > 0) {
+        if(writer->used == writer->buf_sz && azp_fdwriter_flush(writer) != 0) {
+            return -1;
+        }
+        size_t n = writer->buf_sz - writer->used;
+        if(n > len) {
+            n = len;
+        }
+        memcpy(writer->buf[writer->cur] + writer->used, p, n);
+        writer->used += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int azp_extract_fd(const azpIndex_t *idx, const uint32_t index, const uint8_t *archive, const size_t archive_sz, azpFdWriter_t *writer) {
+    if(archive == NULL || idx == NULL || index >= idx->count
+       || (size_t)idx->offset[index] + idx->compressed_size[index] > archive_sz) {
+        return -1;
+    }
+
+    int ret;
+    z_stream strm;
+    azpSpan_t span;
+    azp_span_begin(&span);
+
+    /* allocate inflate state */
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    ret = inflateInit(&strm);
+    if (ret != Z_OK) {
+        return ret;
+    }
+
+    /* Whole entry is mapped, inflate straight into the output buffers */
+    strm.next_in = (uint8_t*)archive + idx->offset[index];
+    strm.avail_in = idx->compressed_size[index];
+    do {
+        if(writer->used == writer->buf_sz && azp_fdwriter_flush(writer) != 0) {
+            (void)inflateEnd(&strm);
+            return Z_ERRNO;
+        }
+        strm.next_out = writer->buf[writer->cur] + writer->used;
+        strm.avail_out = writer->buf_sz - writer->used;
+        ret = inflate(&strm, Z_NO_FLUSH);
+        switch (ret) {
+        case Z_NEED_DICT:
+        case Z_BUF_ERROR:
+            ret = Z_DATA_ERROR;     /* and fall through */
+        case Z_DATA_ERROR:
+        case Z_MEM_ERROR:
+            (void)inflateEnd(&strm);
+            return ret;
+        }
+        writer->used = writer->buf_sz - strm.avail_out;
+    } while (ret != Z_STREAM_END);
+
+    ret = strm.total_out == idx->uncompressed_size[index] ? Z_OK : Z_DATA_ERROR;
+    (void)inflateEnd(&strm);
+    azp_span_end(&span, AZP_PHASE_INFLATE, idx->compressed_size[index], strm.total_out, 1);
+    return ret;
+}
+
+/*
+ * Writes all of buf to fd
+ * returns 0 if ok
+ */
+static int azp_write_all(int fd, const uint8_t *buf, size_t len) {
+    while(len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int azp_write_entry(int fd, const azpIndex_t *idx, const uint32_t index, const uint8_t *archive, const size_t archive_sz) {
+    if(archive == NULL || idx == NULL || index >= idx->count) {
+        return -1;
+    }
+    if((size_t)idx->offset[index] + idx->compressed_size[index] > archive_sz) {
+        return Z_DATA_ERROR;
+    }
+    const uint8_t *data = archive + idx->offset[index];
+    size_t data_sz = idx->compressed_size[index];
+    size_t out_sz = idx->uncompressed_size[index];
+    int ret;
+
+    /* Not worth a mapping, one write() */
+    if(out_sz < AZP_MMAP_MIN) {
+        uint8_t *out = malloc(out_sz + 1);
+        if(out == NULL) {
+            return Z_MEM_ERROR;
+        }
+        ret = azp_codec_inflate(out, out_sz, data, data_sz);
+        if(ret == Z_OK) {
+            azpSpan_t span;
+            azp_span_begin(&span);
+            if(azp_write_all(fd, out, out_sz) != 0) {
+                ret = Z_ERRNO;
+            }
+            azp_span_end(&span, AZP_PHASE_FILES, out_sz, out_sz, 0);
+        }
+        free(out);
+        return ret;
+    }
+
+    /*
+     * Reserve the final size up front so the filesystem can lay it out in one go.
+     * Only blocks that are really allocated are written through a mapping, a full
+     * disk would otherwise show up as SIGBUS instead of an error
+     */
+    uint8_t *out = MAP_FAILED;
+#ifdef __linux__
+    azpSpan_t span;
+    azp_span_begin(&span);
+    int reserved = fallocate(fd, 0, 0, out_sz);
+    azp_span_end(&span, AZP_PHASE_FILES, 0, out_sz, 0);
+    if(reserved != 0 && errno == ENOSPC) {
+        return Z_ERRNO;
+    }
+    if(reserved == 0) {
+        out = mmap(NULL, out_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+#endif
+    if(out == MAP_FAILED) {
+        /* Can't reserve or map it, stream it through write() instead */
+        azpFdWriter_t *writer = azp_fdwriter_open(fd);
+        if(writer == NULL) {
+            return Z_MEM_ERROR;
+        }
+        ret = azp_extract_fd(idx, index, archive, archive_sz, writer);
+        if(azp_fdwriter_close(writer) != 0 && ret == Z_OK) {
+            ret = Z_ERRNO;
+        }
+        return ret;
+    }
+    (void)madvise(out, out_sz, MADV_SEQUENTIAL);
+    ret = azp_codec_inflate(out, out_sz, data, data_sz);
+    if(munmap(out, out_sz) != 0 && ret == Z_OK) {
+        ret = Z_ERRNO;
+    }
+    return ret;
+}
@@ -0,0 +1,209 @@
+/*
+ * Picks a compression level for each file
+ *
+ * Already compressed assets (ogg, jpg, BCn textures) barely shrink and deflate burns
+ * most of its time on them. A few samples of the file are checked first, an order-0
+ * entropy estimate and then a quick level 1 trial deflate, and the level is picked
+ * from how well the samples compress.
+ *
+ * Licenced under GPLv3
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include "azp.h"
+
+#define SAMPLE_SZ 65536  // bytes per sample
+#define SAMPLE_COUNT 3   // start, middle and end of the file
+#define SAMPLE_MIN 4096  // smaller files just get the default level
+
+void azp_policy_init(azpPolicy_t *policy) {
+    policy->level = AZP_LEVEL_AUTO;
+    policy->rules = NULL;
+    policy->rule_count = 0;
+}
+
+void azp_policy_free(azpPolicy_t *policy) {
+    for(size_t i = 0; i < policy->rule_count; ++i) {
+        free(policy->rules[i].extension);
+    }
+    free(policy->rules);
+    policy->rules = NULL;
+    policy->rule_count = 0;
+}
+
+/*
+ * Parses "auto", "max" or 0-9
+ * returns level or AZP_LEVEL_INVALID
+ */
+static int azp_policy_parse_level(const char *text) {
+    if(strcasecmp(text, "auto") == 0) {
+        return AZP_LEVEL_AUTO;
+    }
+    if(strcasecmp(text, "max") == 0) {
+        return AZP_LEVEL_MAX;
+    }
+    char *end;
+    long level = strtol(text, &end, 10);
+    if(end == text || *end != '\0' || level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION) {
+        return AZP_LEVEL_INVALID;
+    }
+    return (int)level;
+}
+
+bool azp_policy_add_rule(azpPolicy_t *policy, const char *rule) {
+    const char *eq = strchr(rule, '=');
+    if(eq == NULL) {
+        int level = azp_policy_parse_level(rule);
+        if(level == AZP_LEVEL_INVALID) {
+            return false;
+        }
+        policy->level = level;
+        return true;
+    }
+
+    int level = azp_policy_parse_level(eq + 1);
+    /* "*.ogg=0", ".ogg=0" and "ogg=0" all mean the same */
+    const char *ext = rule;
+    if(ext[0] == '*') {
+        ++ext;
+    }
+    if(ext[0] == '.') {
+        ++ext;
+    }
+    if(level == AZP_LEVEL_INVALID || ext == eq) {
+        return false;
+    }
+
+    azpPolicyRule_t *rules = realloc(policy->rules, (policy->rule_count + 1) * sizeof(azpPolicyRule_t));
+    if(rules == NULL) {
+        return false;
+    }
+    policy->rules = rules;
+    rules[policy->rule_count].extension = strndup(ext, eq - ext);
+    if(rules[policy->rule_count].extension == NULL) {
+        return false;
+    }
+    rules[policy->rule_count].level = level;
+    ++policy->rule_count;
+    return true;
+}
+
+/*
+ * Order-0 entropy of the samples in bits per byte
+ */
+static double azp_entropy(const uint8_t *data, size_t len) {
+    size_t counts[256] = { 0 };
+    for(size_t i = 0; i < len; ++i) {
+        ++counts[data[i]];
+    }
+    double bits = 0.0;
+    for(int i = 0; i < 256; ++i) {
+        if(counts[i] != 0) {
+            double p = (double)counts[i] / len;
+            bits -= p * log2(p);
+        }
+    }
+    return bits;
+}
+
+/*
+ * Samples the file and picks a level from how well it compresses
+ */
+static int azp_policy_sample(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1) {
+        return Z_DEFAULT_COMPRESSION;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < SAMPLE_MIN) {
+        close(fd);
+        return Z_DEFAULT_COMPRESSION;
+    }
+
+    uint8_t *sample = malloc(SAMPLE_SZ * SAMPLE_COUNT);
+    if(sample == NULL) {
+        close(fd);
+        return Z_DEFAULT_COMPRESSION;
+    }
+    size_t sample_sz = 0;
+    if((size_t)st.st_size <= SAMPLE_SZ * SAMPLE_COUNT) {
+        ssize_t n = pread(fd, sample, st.st_size, 0);
+        sample_sz = n > 0 ? n : 0;
+    } else {
+        off_t step = (st.st_size - SAMPLE_SZ) / (SAMPLE_COUNT - 1);
+        for(int i = 0; i < SAMPLE_COUNT; ++i) {
+            ssize_t n = pread(fd, sample + sample_sz, SAMPLE_SZ, step * i);
+            if(n > 0) {
+                sample_sz += n;
+            }
+        }
+    }
+    close(fd);
+
+    int level = Z_DEFAULT_COMPRESSION;
+    if(sample_sz == 0) {
+        free(sample);
+        return level;
+    }
+
+    /* Close to 8 bits per byte, nothing to gain */
+    if(azp_entropy(sample, sample_sz) > 7.95) {
+        free(sample);
+        return Z_NO_COMPRESSION;
+    }
+
+    /* Low entropy can still be incompressible (e.g. BCn blocks), trial deflate tells */
+    uLongf trial_sz = compressBound(sample_sz);
+    uint8_t *trial = malloc(trial_sz);
+    if(trial != NULL && compress2(trial, &trial_sz, sample, sample_sz, Z_BEST_SPEED) == Z_OK) {
+        double ratio = (double)trial_sz / sample_sz;
+        if(ratio > 0.97) {
+            level = Z_NO_COMPRESSION;
+        } else if(ratio > 0.90) {
+            level = Z_BEST_SPEED;
+        } else if(ratio < 0.50) {
+            level = Z_BEST_COMPRESSION;
+        }
+    }
+    free(trial);
+    free(sample);
+    return level;
+}
+
+int azp_policy_rule_level(const azpPolicy_t *policy, const char *filename) {
+    if(policy == NULL) {
+        return Z_DEFAULT_COMPRESSION;
+    }
+
+    int level = policy->level;
+    const char *dot = strrchr(filename, '.');
+    if(dot != NULL && strpbrk(dot, "/\\") == NULL) {
+        /* Last matching rule wins */
+        for(size_t i = policy->rule_count; i-- > 0;) {
+            if(strcasecmp(policy->rules[i].extension, dot + 1) == 0) {
+                level = policy->rules[i].level;
+                break;
+            }
+        }
+    }
+
+    return level;
+}
+
+int azp_policy_level(const azpPolicy_t *policy, const char *filename) {
+    int level = azp_policy_rule_level(policy, filename);
+    if(level == AZP_LEVEL_AUTO) {
+        level = azp_policy_sample(filename);
+    } else if(level == AZP_LEVEL_MAX) {
+        level = azp_codec_max_level();
+    }
+    return level;
+}
@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "pool.h"
+
+typedef struct azpPool_t {
+    pthread_mutex_t lock;
+    const uint32_t *order;
+    uint32_t job_count;
+    uint32_t next; // next position in order to hand out
+    int error;     // first error returned by a job
+    azpJob_t job;
+    void *ctx;
+} azpPool_t;
+
+unsigned azp_pool_default_threads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus < 1) {
+        return 1;
+    }
+    return (unsigned)cpus;
+}
+
+static void *azp_pool_worker(void *arg) {
+    azpPool_t *pool = arg;
+
+    for(;;) {
+        /* Take the next job, stop handing out work after the first error */
+        pthread_mutex_lock(&pool->lock);
+        if(pool->error != 0 || pool->next >= pool->job_count) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        uint32_t pos = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        uint32_t job = pool->order != NULL ? pool->order[pos] : pos;
+        int ret = pool->job(pool->ctx, job);
+        if(ret != 0) {
+            pthread_mutex_lock(&pool->lock);
+            if(pool->error == 0) {
+                pool->error = ret;
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return NULL;
+}
+
+int azp_pool_run(unsigned threads, const uint32_t *order, uint32_t job_count, azpJob_t job, void *ctx) {
+    azpPool_t pool = {
+        .order = order,
+        .job_count = job_count,
+        .next = 0,
+        .error = 0,
+        .job = job,
+        .ctx = ctx
+    };
+    if(threads == 0) {
+        threads = azp_pool_default_threads();
+    }
+    if(threads > job_count) {
+        threads = job_count;
+    }
+    if(pthread_mutex_init(&pool.lock, NULL) != 0) {
+        return -1;
+    }
+
+    /* Calling thread is always one of the workers */
+    pthread_t *workers = NULL;
+    unsigned started = 0;
+    if(threads > 1) {
+        workers = calloc(threads - 1, sizeof(pthread_t));
+        if(workers == NULL) {
+            perror("Error allocating worker threads");
+        }
+        for(unsigned i = 0; workers != NULL && i < threads - 1; ++i) {
+            if(pthread_create(&workers[i], NULL, azp_pool_worker, &pool) != 0) {
+                /* Carry on with what we have */
+                fprintf(stderr, "Error starting worker thread, using %u\n", started + 1);
+                break;
+            }
+            ++started;
+        }
+    }
+
+    azp_pool_worker(&pool);
+
+    for(unsigned i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    pthread_mutex_destroy(&pool.lock);
+
+    return pool.error;
+}
+
+/*
+ * Shared run, job numbers are mapped back to their part
+ */
+typedef struct azpPoolParts_t {
+    azpPoolPart_t *parts;
+    uint32_t *first; // first job nr. of each part
+    uint32_t part_count;
+    pthread_mutex_t lock; // guards state of the parts
+    pthread_cond_t cond;  // signalled when a part is set up
+} azpPoolParts_t;
+
+enum {
+    AZP_PART_IDLE,
+    AZP_PART_BEGINNING,
+    AZP_PART_READY
+};
+
+/*
+ * Runs the begin hook of a part once, other workers taking its jobs wait for it
+ */
+static void azp_pool_part_begin(azpPoolParts_t *run, azpPoolPart_t *part) {
+    pthread_mutex_lock(&run->lock);
+    if(part->state == AZP_PART_IDLE) {
+        part->state = AZP_PART_BEGINNING;
+        pthread_mutex_unlock(&run->lock);
+        int ret = part->begin(part->ctx);
+        pthread_mutex_lock(&run->lock);
+        if(ret != 0) {
+            __atomic_store_n(&part->error, ret, __ATOMIC_RELAXED);
+        }
+        part->state = AZP_PART_READY;
+        pthread_cond_broadcast(&run->cond);
+    }
+    while(part->state != AZP_PART_READY) {
+        pthread_cond_wait(&run->cond, &run->lock);
+    }
+    pthread_mutex_unlock(&run->lock);
+}
+
+static int azp_pool_part_job(void *ctx, uint32_t job) {
+    azpPoolParts_t *run = ctx;
+    /* Last part starting at or before job, empty parts in front of it are passed over */
+    uint32_t lo = 0;
+    uint32_t hi = run->part_count - 1;
+    while(lo < hi) {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+        if(run->first[mid] <= job) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    azpPoolPart_t *part = &run->parts[lo];
+    if(part->begin != NULL) {
+        azp_pool_part_begin(run, part);
+    }
+    if(__atomic_load_n(&part->error, __ATOMIC_RELAXED) == 0) {
+        int ret = part->job(part->ctx, job - run->first[lo]);
+        if(ret != 0) {
+            int none = 0;
+            __atomic_compare_exchange_n(&part->error, &none, ret, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+    }
+    /* Whoever finishes the last job tears the part down */
+    if(part->end != NULL && __atomic_add_fetch(&part->done, 1, __ATOMIC_ACQ_REL) == part->job_count) {
+        part->end(part->ctx, __atomic_load_n(&part->error, __ATOMIC_RELAXED));
+    }
+    return 0;
+}
+
+int azp_pool_run_parts(unsigned threads, azpPoolPart_t *parts, uint32_t part_count) {
+    if(part_count == 0) {
+        return 0;
+    }
+    azpPoolParts_t run = {
+        .parts = parts,
+        .first = malloc(part_count * sizeof(uint32_t)),
+        .part_count = part_count
+    };
+    if(run.first == NULL) {
+        return -1;
+    }
+    uint32_t job_count = 0;
+    for(uint32_t i = 0; i < part_count; ++i) {
+        run.first[i] = job_count;
+        job_count += parts[i].job_count;
+        parts[i].error = 0;
+        parts[i].state = AZP_PART_IDLE;
+        parts[i].done = 0;
+    }
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.cond, NULL);
+    int ret = azp_pool_run(threads, NULL, job_count, azp_pool_part_job, &run);
+    for(uint32_t i = 0; ret == 0 && i < part_count; ++i) {
+        ret = parts[i].error;
+    }
+    pthread_cond_destroy(&run.cond);
+    pthread_mutex_destroy(&run.lock);
+    free(run.first);
+    return ret;
+}
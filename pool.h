@@ -0,0 +1,62 @@
+/*
+ * worker pool for running independent archive jobs on many threads
+ *
+ * Licenced under GPLv3
+*/
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stdint.h>
+
+/*
+ * Job callback
+ * ctx - context pointer passed to azp_pool_run
+ * job - job number taken from the order list
+ * returns 0 if ok, anything else stops handing out new jobs
+ */
+typedef int (*azpJob_t)(void *ctx, uint32_t job);
+
+/*
+ * Returns the number of online CPUs, at least 1
+ */
+unsigned azp_pool_default_threads(void);
+
+/*
+ * Runs jobs on a pool of worker threads
+ * threads - number of workers, 0 for azp_pool_default_threads()
+ * order - job numbers in the order they are handed out, NULL for 0..job_count-1
+ * job_count - number of jobs
+ * job - callback run for every job
+ * ctx - passed to the callback
+ * returns 0 if all jobs finished ok, otherwise the first error a job returned
+ */
+int azp_pool_run(unsigned threads, const uint32_t *order, uint32_t job_count, azpJob_t job, void *ctx);
+
+/*
+ * Jobs of one archive in a run shared by several archives
+ */
+typedef struct azpPoolPart_t {
+    azpJob_t job;
+    void *ctx;
+    uint32_t job_count;
+    int error;          // first error a job of this part returned, its later jobs are skipped
+    /* Optional, run on ctx by the worker taking the first job of the part before
+       any of them start, an error skips them all */
+    int (*begin)(void *ctx);
+    /* Optional, run on ctx with the part's error by the worker finishing its last job */
+    void (*end)(void *ctx, int error);
+    int state;          // whether begin ran, used by the pool
+    uint32_t done;      // finished jobs, used by the pool
+} azpPoolPart_t;
+
+/*
+ * Runs the jobs of all parts on one pool, handed out part after part so the
+ * workers move on to the next archive while the last jobs of one are running
+ * A part with begin and end hooks is only set up when the pool reaches it and
+ * torn down as soon as it is done, so only the parts in flight hold resources
+ * An error only stops the part it came from
+ * returns 0 if all parts finished ok
+ */
+int azp_pool_run_parts(unsigned threads, azpPoolPart_t *parts, uint32_t part_count);
+
+#endif
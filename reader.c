@@ -0,0 +1,283 @@
+/*
+ * Random access reads from archive entries
+ *
+ * Inflate can't start in the middle of a stream, so for big entries a pass over
+ * the whole stream remembers the inflate state every span bytes (bit position and
+ * the last 32 KiB of output), like zlib's examples/zran.c. Reads then start from
+ * the closest checkpoint before the wanted offset.
+ *
+ * Licenced under GPLv3
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <zlib.h>
+#include "azp.h"
+
+#define WINSIZE 32768 // deflate window
+#define AZP_READ_SPAN (4u * 1024 * 1024)
+
+/*
+ * Inflate state at a deflate block boundary
+ */
+typedef struct azpPoint_t {
+    size_t out;  // uncompressed offset
+    size_t in;   // compressed offset of the first full byte
+    int bits;    // bits of the byte before in still to be used, 0-7
+    uint8_t window[WINSIZE];
+} azpPoint_t;
+
+/*
+ * Checkpoints of one entry
+ */
+typedef struct azpPoints_t {
+    azpPoint_t *list;
+    uint32_t count;
+} azpPoints_t;
+
+struct azpReader_t {
+    const azpIndex_t *index;
+    const uint8_t *archive;
+    size_t archive_sz;
+    size_t span;
+    azpPoints_t **points; // per entry, NULL until first needed, set once with a CAS
+};
+
+azpReader_t *azp_reader_open(const azpIndex_t *index, const uint8_t *archive, size_t archive_sz, size_t span) {
+    azpReader_t *reader = calloc(1, sizeof(azpReader_t));
+    if(reader == NULL) {
+        return NULL;
+    }
+    reader->points = calloc(index->count + 1, sizeof(azpPoints_t*));
+    if(reader->points == NULL) {
+        free(reader->points);
+        free(reader);
+        return NULL;
+    }
+    reader->index = index;
+    reader->archive = archive;
+    reader->archive_sz = archive_sz;
+    reader->span = span != 0 ? span : AZP_READ_SPAN;
+    return reader;
+}
+
+void azp_reader_close(azpReader_t *reader) {
+    if(reader == NULL) {
+        return;
+    }
+    for(uint32_t i = 0; i < reader->index->count; ++i) {
+        if(reader->points[i] != NULL) {
+            free(reader->points[i]->list);
+            free(reader->points[i]);
+        }
+    }
+    free(reader->points);
+    free(reader);
+}
+
+/*
+ * Adds a checkpoint, window is the circular output buffer with left bytes unused at its end
+ * returns 0 if ok
+ */
+static int azp_add_point(azpPoints_t *points, int bits, size_t in, size_t out, unsigned left, const uint8_t *window) {
+    azpPoint_t *list = realloc(points->list, (points->count + 1) * sizeof(azpPoint_t));
+    if(list == NULL) {
+        return Z_MEM_ERROR;
+    }
+    points->list = list;
+
+    azpPoint_t *next = &list[points->count++];
+    next->bits = bits;
+    next->in = in;
+    next->out = out;
+    if(left) {
+        memcpy(next->window, window + WINSIZE - left, left);
+    }
+    if(left < WINSIZE) {
+        memcpy(next->window + left, window, WINSIZE - left);
+    }
+    return Z_OK;
+}
+
+/*
+ * Inflates the whole entry once, noting a checkpoint every span bytes of output
+ * returns 0 if ok, zlib errors if not
+ */
+static int azp_build_points(const azpReader_t *reader, uint32_t entry, azpPoints_t *points) {
+    const uint8_t *data = reader->archive + reader->index->offset[entry];
+    uint8_t window[WINSIZE] = { 0 };
+    size_t last = 0;
+    z_stream strm;
+    int ret;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    ret = inflateInit(&strm);
+    if(ret != Z_OK) {
+        return ret;
+    }
+
+    /* Whole compressed entry is in memory */
+    strm.next_in = (uint8_t*)data;
+    strm.avail_in = reader->index->compressed_size[entry];
+    strm.avail_out = 0;
+    do {
+        if(strm.avail_out == 0) {
+            strm.avail_out = WINSIZE;
+            strm.next_out = window;
+        }
+        /* stop at end of every deflate block */
+        ret = inflate(&strm, Z_BLOCK);
+        if(ret == Z_NEED_DICT || ret == Z_BUF_ERROR) {
+            ret = Z_DATA_ERROR;
+        }
+        if(ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
+            break;
+        }
+        /* At a block boundary that is not the last one */
+        if(ret != Z_STREAM_END && (strm.data_type & 128) && !(strm.data_type & 64)
+           && (strm.total_out == 0 || strm.total_out - last > reader->span)) {
+            ret = azp_add_point(points, strm.data_type & 7, strm.total_in, strm.total_out, strm.avail_out, window);
+            if(ret != Z_OK) {
+                break;
+            }
+            last = strm.total_out;
+        }
+    } while(ret != Z_STREAM_END);
+    (void)inflateEnd(&strm);
+
+    return ret == Z_STREAM_END ? Z_OK : ret;
+}
+
+/*
+ * Gets the checkpoints of an entry, building them on first use
+ * Nothing is held while building, reads of other entries never wait for it. Threads
+ * that need the same entry at once each build it, the first one to publish wins
+ * returns NULL on error
+ */
+static const azpPoints_t *azp_get_points(azpReader_t *reader, uint32_t entry) {
+    azpPoints_t *points = __atomic_load_n(&reader->points[entry], __ATOMIC_ACQUIRE);
+    if(points != NULL) {
+        return points;
+    }
+    points = calloc(1, sizeof(azpPoints_t));
+    if(points == NULL) {
+        return NULL;
+    }
+    if(azp_build_points(reader, entry, points) != Z_OK || points->count == 0) {
+        free(points->list);
+        free(points);
+        return NULL;
+    }
+    azpPoints_t *published = NULL;
+    if(!__atomic_compare_exchange_n(&reader->points[entry], &published, points, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(points->list);
+        free(points);
+        points = published;
+    }
+    return points;
+}
+
+int64_t azp_read(azpReader_t *reader, uint32_t entry, size_t offset, size_t len, void *buf) {
+    const azpIndex_t *index = reader->index;
+    if(entry >= index->count
+       || (size_t)index->offset[entry] + index->compressed_size[entry] > reader->archive_sz) {
+        return -1;
+    }
+    if(offset >= index->uncompressed_size[entry]) {
+        return 0;
+    }
+    if(len > index->uncompressed_size[entry] - offset) {
+        len = index->uncompressed_size[entry] - offset;
+    }
+    if(len == 0) {
+        return 0;
+    }
+
+    const uint8_t *data = reader->archive + index->offset[entry];
+    size_t data_sz = index->compressed_size[entry];
+    uint8_t discard[WINSIZE];
+    z_stream strm;
+    int ret;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+
+    if(offset < reader->span) {
+        /* Close to the start, just inflate from the beginning */
+        ret = inflateInit(&strm);
+        if(ret != Z_OK) {
+            return -1;
+        }
+        strm.next_in = (uint8_t*)data;
+        strm.avail_in = data_sz;
+    } else {
+        const azpPoints_t *points = azp_get_points(reader, entry);
+        if(points == NULL) {
+            return -1;
+        }
+
+        /* Last checkpoint at or before offset */
+        const azpPoint_t *here = points->list;
+        for(uint32_t i = 1; i < points->count && points->list[i].out <= offset; ++i) {
+            here = &points->list[i];
+        }
+
+        ret = inflateInit2(&strm, -15); // raw inflate, no zlib header in the middle
+        if(ret != Z_OK) {
+            return -1;
+        }
+        size_t start = here->in - (here->bits ? 1 : 0);
+        strm.next_in = (uint8_t*)data + start;
+        strm.avail_in = data_sz - start;
+        if(here->bits) {
+            (void)inflatePrime(&strm, here->bits, data[start] >> (8 - here->bits));
+            ++strm.next_in;
+            --strm.avail_in;
+        }
+        (void)inflateSetDictionary(&strm, here->window, WINSIZE);
+        offset -= here->out;
+    }
+
+    /* Inflate into the discard buffer until at offset, then into buf */
+    bool skip = true;
+    do {
+        if(offset == 0 && skip) {
+            strm.avail_out = len;
+            strm.next_out = buf;
+            skip = false;
+        }
+        if(offset > WINSIZE) {
+            strm.avail_out = WINSIZE;
+            strm.next_out = discard;
+            offset -= WINSIZE;
+        } else if(offset != 0) {
+            strm.avail_out = (unsigned)offset;
+            strm.next_out = discard;
+            offset = 0;
+        }
+
+        /* uncompress until avail_out filled, or end of stream */
+        do {
+            ret = inflate(&strm, Z_NO_FLUSH);
+            if(ret == Z_NEED_DICT || ret == Z_BUF_ERROR) {
+                ret = Z_DATA_ERROR;
+            }
+            if(ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
+                (void)inflateEnd(&strm);
+                return -1;
+            }
+        } while(ret != Z_STREAM_END && strm.avail_out != 0);
+    } while(skip && ret != Z_STREAM_END);
+    (void)inflateEnd(&strm);
+
+    /* len was cut to the size in the TOC, data ending before offset or short of len is corrupt */
+    return skip || strm.avail_out != 0 ? -1 : (int64_t)len;
+}
@@ -0,0 +1,284 @@
+/*
+ * Parallel directory walker
+ *
+ * The tree is read level by level: every directory of a level is one pool job,
+ * the subdirectories it finds make up the next level. Jobs only write into their
+ * own slot, so the result does not depend on which thread read what, and the
+ * file list is sorted at the end.
+ *
+ * Licenced under GPLv3
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "pool.h"
+#include "scan.h"
+
+#define AZP_SCAN_BUFFER (32 * 1024)
+
+/*
+ * Directory read by one job, what it found waits here until the level is done
+ */
+typedef struct azpScanDir_t {
+    char *path;            // relative to the root, "" for the root itself
+    azpScanFile_t *files;
+    uint32_t file_count;
+    uint32_t file_cap;
+    char **dirs;           // subdirectories, read on the next level
+    uint32_t dir_count;
+    uint32_t dir_cap;
+} azpScanDir_t;
+
+typedef struct azpScanJob_t {
+    int root_fd;
+    const char *root;
+    azpScanDir_t *dirs;    // directories of the current level
+} azpScanJob_t;
+
+/*
+ * Returns dir/name in a new string or NULL if out of memory
+ */
+static char *azp_scan_join(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+    if(path == NULL) {
+        return NULL;
+    }
+    if(dir_len > 0) {
+        memcpy(path, dir, dir_len);
+        path[dir_len++] = '/';
+    }
+    memcpy(path + dir_len, name, name_len + 1);
+    return path;
+}
+
+static bool azp_scan_add_file(azpScanDir_t *dir, char *path, size_t size) {
+    if(dir->file_count == dir->file_cap) {
+        uint32_t cap = dir->file_cap == 0 ? 16 : dir->file_cap * 2;
+        azpScanFile_t *files = realloc(dir->files, cap * sizeof(azpScanFile_t));
+        if(files == NULL) {
+            return false;
+        }
+        dir->files = files;
+        dir->file_cap = cap;
+    }
+    dir->files[dir->file_count].path = path;
+    dir->files[dir->file_count].size = size;
+    ++dir->file_count;
+    return true;
+}
+
+static bool azp_scan_add_dir(azpScanDir_t *dir, char *path) {
+    if(dir->dir_count == dir->dir_cap) {
+        uint32_t cap = dir->dir_cap == 0 ? 4 : dir->dir_cap * 2;
+        char **dirs = realloc(dir->dirs, cap * sizeof(char*));
+        if(dirs == NULL) {
+            return false;
+        }
+        dir->dirs = dirs;
+        dir->dir_cap = cap;
+    }
+    dir->dirs[dir->dir_count++] = path;
+    return true;
+}
+
+static int azp_scan_job(void *ctx, uint32_t index) {
+    azpScanJob_t *job = ctx;
+    azpScanDir_t *dir = &job->dirs[index];
+
+    int fd = openat(job->root_fd, dir->path[0] != '\0' ? dir->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1) {
+        fprintf(stderr, "Error opening directory %s/%s: %s\n", job->root, dir->path, strerror(errno));
+        return -1;
+    }
+    uint8_t *buf = malloc(AZP_SCAN_BUFFER);
+    if(buf == NULL) {
+        perror("Error allocating directory buffer");
+        close(fd);
+        return -1;
+    }
+
+    int ret = 0;
+    while(ret == 0) {
+        ssize_t n = getdents64(fd, buf, AZP_SCAN_BUFFER);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0) {
+            fprintf(stderr, "Error reading directory %s/%s: %s\n", job->root, dir->path, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if(n == 0) {
+            break;
+        }
+        for(ssize_t pos = 0; ret == 0 && pos < n;) {
+            struct dirent64 *ent = (struct dirent64*)(buf + pos);
+            pos += ent->d_reclen;
+            const char *name = ent->d_name;
+            if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+
+            /* Files need their size anyway, the stat also sorts out unknown types and links */
+            bool is_dir = ent->d_type == DT_DIR;
+            bool is_file = false;
+            struct stat st;
+            if(!is_dir) {
+                bool link = false;
+                int stat_ret = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW);
+                if(stat_ret == 0 && S_ISLNK(st.st_mode)) {
+                    link = true;
+                    stat_ret = fstatat(fd, name, &st, 0);
+                }
+                if(stat_ret != 0) {
+                    fprintf(stderr, "Error reading file %s/%s%s%s: %s\n", job->root, dir->path,
+                            dir->path[0] != '\0' ? "/" : "", name, strerror(errno));
+                    ret = -1;
+                    break;
+                }
+                /* Linked directories are not followed, they could loop */
+                is_dir = S_ISDIR(st.st_mode) && !link;
+                is_file = S_ISREG(st.st_mode);
+            }
+            if(!is_dir && !is_file) {
+                continue;
+            }
+
+            char *path = azp_scan_join(dir->path, name);
+            bool added = path != NULL && (is_dir ? azp_scan_add_dir(dir, path) : azp_scan_add_file(dir, path, st.st_size));
+            if(!added) {
+                perror("Error allocating file list");
+                free(path);
+                ret = -1;
+            }
+        }
+    }
+
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+static int azp_scan_compare(const void *a, const void *b) {
+    return strcmp(((const azpScanFile_t*)a)->path, ((const azpScanFile_t*)b)->path);
+}
+
+/*
+ * Frees what the jobs of a level found
+ * keep - files and subdirectories were moved out, only free the arrays
+ */
+static void azp_scan_free_level(azpScanDir_t *dirs, uint32_t count, bool keep) {
+    for(uint32_t i = 0; i < count; ++i) {
+        if(!keep) {
+            for(uint32_t j = 0; j < dirs[i].file_count; ++j) {
+                free(dirs[i].files[j].path);
+            }
+            for(uint32_t j = 0; j < dirs[i].dir_count; ++j) {
+                free(dirs[i].dirs[j]);
+            }
+        }
+        free(dirs[i].path);
+        free(dirs[i].files);
+        free(dirs[i].dirs);
+    }
+    free(dirs);
+}
+
+int azp_scan_dir(azpScan_t *scan, const char *root, unsigned threads) {
+    scan->files = NULL;
+    scan->count = 0;
+
+    azpScanJob_t job = {
+        .root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+        .root = root,
+        .dirs = calloc(1, sizeof(azpScanDir_t))
+    };
+    if(job.root_fd == -1) {
+        fprintf(stderr, "Error opening directory %s: %s\n", root, strerror(errno));
+        free(job.dirs);
+        return -1;
+    }
+    if(job.dirs == NULL || (job.dirs[0].path = calloc(1, 1)) == NULL) {
+        perror("Error allocating file list");
+        free(job.dirs);
+        close(job.root_fd);
+        return -1;
+    }
+
+    uint32_t level_count = 1;
+    int ret = 0;
+    while(level_count > 0) {
+        ret = azp_pool_run(threads, NULL, level_count, azp_scan_job, &job);
+
+        /* Count what the level found, then move it over */
+        size_t file_count = scan->count;
+        size_t next_count = 0;
+        for(uint32_t i = 0; ret == 0 && i < level_count; ++i) {
+            file_count += job.dirs[i].file_count;
+            next_count += job.dirs[i].dir_count;
+        }
+        if(ret == 0 && (file_count > UINT32_MAX || next_count > UINT32_MAX)) {
+            fprintf(stderr, "Too many files in %s\n", root);
+            ret = -1;
+        }
+        azpScanDir_t *next = NULL;
+        if(ret == 0) {
+            azpScanFile_t *files = realloc(scan->files, (file_count + 1) * sizeof(azpScanFile_t));
+            next = calloc(next_count + 1, sizeof(azpScanDir_t));
+            if(files != NULL) {
+                scan->files = files;
+            }
+            if(files == NULL || next == NULL) {
+                perror("Error allocating file list");
+                ret = -1;
+            }
+        }
+        if(ret != 0) {
+            free(next);
+            azp_scan_free_level(job.dirs, level_count, false);
+            job.dirs = NULL;
+            break;
+        }
+
+        uint32_t next_pos = 0;
+        for(uint32_t i = 0; i < level_count; ++i) {
+            if(job.dirs[i].file_count > 0) {
+                memcpy(scan->files + scan->count, job.dirs[i].files, job.dirs[i].file_count * sizeof(azpScanFile_t));
+            }
+            scan->count += job.dirs[i].file_count;
+            for(uint32_t j = 0; j < job.dirs[i].dir_count; ++j) {
+                next[next_pos++].path = job.dirs[i].dirs[j];
+            }
+        }
+        azp_scan_free_level(job.dirs, level_count, true);
+        job.dirs = next;
+        level_count = next_pos;
+    }
+    free(job.dirs);
+    close(job.root_fd);
+
+    if(ret != 0) {
+        azp_scan_free(scan);
+        return ret;
+    }
+    qsort(scan->files, scan->count, sizeof(azpScanFile_t), azp_scan_compare);
+    return 0;
+}
+
+void azp_scan_free(azpScan_t *scan) {
+    for(uint32_t i = 0; i < scan->count; ++i) {
+        free(scan->files[i].path);
+    }
+    free(scan->files);
+    scan->files = NULL;
+    scan->count = 0;
+}
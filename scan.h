@@ -0,0 +1,45 @@
+/*
+ * parallel directory walker for building file lists
+ *
+ * Licenced under GPLv3
+*/
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Regular file found under the scanned directory
+ */
+typedef struct azpScanFile_t {
+    char *path;  // relative to the scanned directory, '/' separated
+    size_t size;
+} azpScanFile_t;
+
+/*
+ * Result of a scan, files sorted by path
+ */
+typedef struct azpScan_t {
+    azpScanFile_t *files;
+    uint32_t count;
+} azpScan_t;
+
+/*
+ * Collects every regular file below a directory
+ * Each level of the tree is read on the worker pool, a directory per job, with
+ * getdents64 and fstatat relative to the open root. Symlinks to files are
+ * followed, symlinks to directories are not. Other file types are skipped
+ * scan - filled with the files found, free with azp_scan_free
+ * root - directory to scan
+ * threads - number of workers, 0 for one per CPU
+ * returns 0 if ok, prints what went wrong if not
+ */
+int azp_scan_dir(azpScan_t *scan, const char *root, unsigned threads);
+
+/*
+ * Frees the files of a scan
+ */
+void azp_scan_free(azpScan_t *scan);
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * SHA-256 digests
+ *
+ * Licenced under GPLv3
+*/
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define AZP_SHA256_SIZE 32
+
+typedef struct azpSha256_t {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[64];
+    size_t used;
+} azpSha256_t;
+
+void azp_sha256_init(azpSha256_t *sha);
+
+void azp_sha256_update(azpSha256_t *sha, const uint8_t *data, size_t len);
+
+/*
+ * Writes the AZP_SHA256_SIZE byte digest
+ */
+void azp_sha256_final(azpSha256_t *sha, uint8_t *digest);
+
+#endif
@@ -0,0 +1,233 @@
+/*
+ * Phase timings, resource usage and progress output
+ *
+ * Phases are summed over all threads, so a parallel phase can take more time than
+ * the whole run. Allocations are counted when linked with --wrap=malloc and friends
+ * (AZP_COUNT_ALLOCS), only calls made by azp code itself are seen.
+ *
+ * Licenced under GPLv3
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+#define AZP_PROGRESS_TTY_NS 100000000ll  // terminal line is redrawn up to 10 times a second
+#define AZP_PROGRESS_LOG_NS 1000000000ll // otherwise a new line every second at most
+
+bool azpStatsEnabled = false;
+static azpVerbosity_t azpVerbosity = AZP_PROGRESS;
+static azpPhaseStats_t azpPhases[AZP_PHASE_COUNT];
+static int64_t azpStatsStart;
+static struct rusage azpStatsUsage;
+
+static const char *azpPhaseNames[AZP_PHASE_COUNT] = {
+    "header", "toc", "read", "inflate", "deflate", "files", "archive"
+};
+
+int64_t azp_wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+int64_t azp_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+/*
+ *      A L L O C A T I O N S
+ */
+
+#ifdef AZP_COUNT_ALLOCS
+static uint64_t azpAllocs;
+static uint64_t azpAllocBytes;
+static uint64_t azpFrees;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static inline void azp_count_alloc(size_t size) {
+    if(azpStatsEnabled) {
+        __atomic_add_fetch(&azpAllocs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&azpAllocBytes, size, __ATOMIC_RELAXED);
+    }
+}
+
+void *__wrap_malloc(size_t size) {
+    azp_count_alloc(size);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    azp_count_alloc(count * size);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    azp_count_alloc(size);
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+    if(azpStatsEnabled && ptr != NULL) {
+        __atomic_add_fetch(&azpFrees, 1, __ATOMIC_RELAXED);
+    }
+    __real_free(ptr);
+}
+#endif
+
+/*
+ *      S T A T S
+ */
+
+void azp_stats_enable(void) {
+    memset(azpPhases, 0, sizeof(azpPhases));
+    azpStatsStart = azp_wall_ns();
+    getrusage(RUSAGE_SELF, &azpStatsUsage);
+    azpStatsEnabled = true;
+}
+
+void azp_span_add(const azpSpan_t *span, azpPhase_t phase, uint64_t bytes_in, uint64_t bytes_out, uint32_t entries) {
+    azpPhaseStats_t *stats = &azpPhases[phase];
+    __atomic_add_fetch(&stats->wall_ns, azp_wall_ns() - span->wall, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->cpu_ns, azp_cpu_ns() - span->cpu, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->entries, entries, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->bytes_in, bytes_in, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->bytes_out, bytes_out, __ATOMIC_RELAXED);
+}
+
+static double azp_timeval_s(struct timeval end, struct timeval start) {
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) * 1e-6;
+}
+
+void azp_stats_print(bool json) {
+    if(!azpStatsEnabled) {
+        return;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double wall = (azp_wall_ns() - azpStatsStart) * 1e-9;
+    double user = azp_timeval_s(usage.ru_utime, azpStatsUsage.ru_utime);
+    double sys = azp_timeval_s(usage.ru_stime, azpStatsUsage.ru_stime);
+    long minflt = usage.ru_minflt - azpStatsUsage.ru_minflt;
+    long majflt = usage.ru_majflt - azpStatsUsage.ru_majflt;
+
+    if(json) {
+        fprintf(stderr, "{\"wall_s\":%.6f,\"user_s\":%.6f,\"sys_s\":%.6f,\"peak_rss_kib\":%ld,\"minor_faults\":%ld,\"major_faults\":%ld",
+                wall, user, sys, usage.ru_maxrss, minflt, majflt);
+#ifdef AZP_COUNT_ALLOCS
+        fprintf(stderr, ",\"allocations\":%llu,\"allocated_bytes\":%llu,\"frees\":%llu",
+                (unsigned long long)azpAllocs, (unsigned long long)azpAllocBytes, (unsigned long long)azpFrees);
+#endif
+        fprintf(stderr, ",\"phases\":{");
+    } else {
+        fprintf(stderr, "%-8s %10s %10s %8s %8s %12s %12s %10s %12s\n",
+                "Phase", "Time s", "CPU s", "Calls", "Entries", "In MiB", "Out MiB", "MB/s", "Entries/s");
+    }
+
+    bool first = true;
+    for(int phase = 0; phase < AZP_PHASE_COUNT; ++phase) {
+        const azpPhaseStats_t *stats = &azpPhases[phase];
+        if(stats->calls == 0) {
+            continue;
+        }
+        double time = stats->wall_ns * 1e-9;
+        double rate = time > 0 ? 1.0 / time : 0;
+        /* Throughput on the uncompressed side */
+        uint64_t bytes = stats->bytes_in > stats->bytes_out ? stats->bytes_in : stats->bytes_out;
+        if(json) {
+            fprintf(stderr, "%s\"%s\":{\"time_s\":%.6f,\"cpu_s\":%.6f,\"calls\":%llu,\"entries\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,"
+                    "\"mb_per_s\":%.2f,\"entries_per_s\":%.1f}",
+                    first ? "" : ",", azpPhaseNames[phase], time, stats->cpu_ns * 1e-9,
+                    (unsigned long long)stats->calls, (unsigned long long)stats->entries,
+                    (unsigned long long)stats->bytes_in, (unsigned long long)stats->bytes_out,
+                    bytes * rate / 1e6, stats->entries * rate);
+        } else {
+            fprintf(stderr, "%-8s %10.3f %10.3f %8llu %8llu %12.1f %12.1f %10.1f %12.1f\n",
+                    azpPhaseNames[phase], time, stats->cpu_ns * 1e-9,
+                    (unsigned long long)stats->calls, (unsigned long long)stats->entries,
+                    stats->bytes_in / 1048576.0, stats->bytes_out / 1048576.0,
+                    bytes * rate / 1e6, stats->entries * rate);
+        }
+        first = false;
+    }
+
+    if(json) {
+        fprintf(stderr, "}}\n");
+        return;
+    }
+    fprintf(stderr, "Wall %.3f s, user %.3f s, sys %.3f s, peak RSS %.1f MiB, page faults %ld minor, %ld major\n",
+            wall, user, sys, usage.ru_maxrss / 1024.0, minflt, majflt);
+#ifdef AZP_COUNT_ALLOCS
+    fprintf(stderr, "Allocations %llu (%.1f MiB), frees %llu\n",
+            (unsigned long long)azpAllocs, azpAllocBytes / 1048576.0, (unsigned long long)azpFrees);
+#endif
+}
+
+/*
+ *      P R O G R E S S
+ */
+
+void azp_set_verbosity(azpVerbosity_t verbosity) {
+    azpVerbosity = verbosity;
+}
+
+void azp_progress_start(azpProgress_t *progress, const char *verb, uint32_t total) {
+    memset(progress, 0, sizeof(azpProgress_t));
+    progress->verb = verb;
+    progress->total = total;
+    progress->out = stdout;
+    progress->tty = isatty(STDOUT_FILENO);
+    progress->start = azp_wall_ns();
+    progress->next = progress->start + (progress->tty ? AZP_PROGRESS_TTY_NS : AZP_PROGRESS_LOG_NS);
+}
+
+void azp_progress_to_stderr(azpProgress_t *progress) {
+    progress->out = stderr;
+    progress->tty = isatty(STDERR_FILENO);
+}
+
+void azp_progress_step(azpProgress_t *progress, const char *name, uint64_t bytes) {
+    uint32_t done = __atomic_add_fetch(&progress->done, 1, __ATOMIC_RELAXED);
+    uint64_t done_bytes = __atomic_add_fetch(&progress->bytes, bytes, __ATOMIC_RELAXED);
+    if(azpVerbosity == AZP_VERBOSE) {
+        fprintf(progress->out, "%6u/%-6u %s file %s (%llu bytes)\n", done, progress->total, progress->verb, name, (unsigned long long)bytes);
+        return;
+    }
+    if(azpVerbosity == AZP_QUIET) {
+        return;
+    }
+
+    /* Whoever moves next forward gets to print */
+    int64_t now = azp_wall_ns();
+    int64_t next = __atomic_load_n(&progress->next, __ATOMIC_RELAXED);
+    if(now < next || !__atomic_compare_exchange_n(&progress->next, &next,
+                                                  now + (progress->tty ? AZP_PROGRESS_TTY_NS : AZP_PROGRESS_LOG_NS),
+                                                  false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    double elapsed = (now - progress->start) * 1e-9;
+    fprintf(progress->out, "%s%6u/%-6u %s %.1f MiB (%.1f MB/s)%s", progress->tty ? "\r" : "", done, progress->total, progress->verb,
+           done_bytes / 1048576.0, done_bytes / elapsed / 1e6, progress->tty ? "" : "\n");
+    fflush(progress->out);
+}
+
+void azp_progress_end(azpProgress_t *progress) {
+    if(azpVerbosity == AZP_QUIET) {
+        return;
+    }
+    double elapsed = (azp_wall_ns() - progress->start) * 1e-9;
+    fprintf(progress->out, "%s%s %u files, %.1f MiB in %.2f s (%.1f MB/s)\n", progress->tty ? "\r\033[K" : "", progress->verb,
+           progress->done, progress->bytes / 1048576.0, elapsed, elapsed > 0 ? progress->bytes / elapsed / 1e6 : 0.0);
+    fflush(progress->out);
+}
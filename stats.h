@@ -0,0 +1,99 @@
+/*
+ * Phase timings and progress output
+ *
+ * Licenced under GPLv3
+*/
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "azp.h"
+
+/*
+ * Time spent in one phase, summed over all threads
+ */
+typedef struct azpPhaseStats_t {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;     // thread CPU time
+    uint64_t calls;
+    uint64_t entries;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} azpPhaseStats_t;
+
+/*
+ * Start of a timed span
+ */
+typedef struct azpSpan_t {
+    int64_t wall;
+    int64_t cpu;
+} azpSpan_t;
+
+extern bool azpStatsEnabled;
+
+int64_t azp_wall_ns(void);
+int64_t azp_cpu_ns(void);
+
+/*
+ * Starts timing, does nothing while stats are off
+ */
+static inline void azp_span_begin(azpSpan_t *span) {
+    if(azpStatsEnabled) {
+        span->wall = azp_wall_ns();
+        span->cpu = azp_cpu_ns();
+    } else {
+        span->wall = span->cpu = 0;
+    }
+}
+
+void azp_span_add(const azpSpan_t *span, azpPhase_t phase, uint64_t bytes_in, uint64_t bytes_out, uint32_t entries);
+
+/*
+ * Adds the time since azp_span_begin to a phase
+ * bytes_in - bytes read by the phase
+ * bytes_out - bytes produced by the phase
+ * entries - archive entries or files handled
+ */
+static inline void azp_span_end(const azpSpan_t *span, azpPhase_t phase, uint64_t bytes_in, uint64_t bytes_out, uint32_t entries) {
+    if(azpStatsEnabled) {
+        azp_span_add(span, phase, bytes_in, bytes_out, entries);
+    }
+}
+
+/*
+ * Rate limited "done/total" output for a run over many entries
+ * Thread safe, lines are printed at most a few times a second unless verbose
+ */
+typedef struct azpProgress_t {
+    const char *verb;  // "Extracted", "Compressed"...
+    uint32_t total;
+    uint32_t done;
+    uint64_t bytes;
+    int64_t start;
+    int64_t next;      // earliest time of the next line
+    FILE *out;         // stdout unless it carries data
+    bool tty;          // out is a terminal, the line is redrawn in place
+} azpProgress_t;
+
+void azp_progress_start(azpProgress_t *progress, const char *verb, uint32_t total);
+
+/*
+ * Prints the lines to stderr instead, for when stdout carries the extracted data
+ */
+void azp_progress_to_stderr(azpProgress_t *progress);
+
+/*
+ * Counts one finished entry
+ * name - printed in verbose mode
+ * bytes - uncompressed size of the entry
+ */
+void azp_progress_step(azpProgress_t *progress, const char *name, uint64_t bytes);
+
+/*
+ * Prints the final count and throughput
+ */
+void azp_progress_end(azpProgress_t *progress);
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * Extraction from archives that can only be read front to back
+ *
+ * Header and TOC come first in an archive, so after reading them the entries can be
+ * done in the order their data is stored. Data is read through one fixed buffer and
+ * inflated through another, gaps between blobs are read past. Works on pipes and
+ * sockets and never needs the archive in the address space.
+ *
+ * Licenced under GPLv3
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "azp.h"
+#include "outdir.h"
+#include "stats.h"
+
+#define AZP_SEQ_BUFFER (1024 * 1024)
+/* Biggest TOC record, only the low byte of the name length counts */
+#define AZP_TOC_RECORD_MAX (16 + UINT8_MAX)
+
+/*
+ * Buffered front to back reading
+ */
+typedef struct azpSeqReader_t {
+    int fd;
+    uint8_t *buf;
+    size_t len;    // bytes in buf
+    size_t used;   // bytes of buf already consumed
+    uint64_t pos;  // archive offset of buf[used]
+} azpSeqReader_t;
+
+/*
+ * Where the data of one blob goes, all entries sharing it
+ */
+typedef struct azpSeqOut_t {
+    int *fds;               // output files, -1 if it couldn't be created
+    uint32_t count;
+    azpFdWriter_t *writer;  // or everything into one writer
+    FILE *copy;             // inflated data kept for the other entries in writer mode
+} azpSeqOut_t;
+
+/*
+ * Entry in data order
+ */
+typedef struct azpSeqItem_t {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t index;
+} azpSeqItem_t;
+
+static int azp_seq_cmp(const void *a, const void *b) {
+    const azpSeqItem_t *ia = a;
+    const azpSeqItem_t *ib = b;
+    if(ia->offset != ib->offset) {
+        return ia->offset < ib->offset ? -1 : 1;
+    }
+    if(ia->size != ib->size) {
+        return ia->size < ib->size ? -1 : 1;
+    }
+    return ia->index < ib->index ? -1 : (ia->index > ib->index);
+}
+
+/*
+ * Reads until len bytes are in or the file ends
+ * returns bytes read, -1 on error
+ */
+static ssize_t azp_read_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t n = read(fd, (uint8_t*)buf + done, len - done);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if(n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * Makes sure there is unread data in the buffer
+ * returns bytes available, 0 at end of file, -1 on error
+ */
+static ssize_t azp_seq_fill(azpSeqReader_t *reader) {
+    if(reader->used < reader->len) {
+        return reader->len - reader->used;
+    }
+    azpSpan_t span;
+    azp_span_begin(&span);
+    ssize_t n;
+    do {
+        n = read(reader->fd, reader->buf, AZP_SEQ_BUFFER);
+    } while(n < 0 && errno == EINTR);
+    azp_span_end(&span, AZP_PHASE_READ, n > 0 ? n : 0, 0, 0);
+    reader->len = n > 0 ? n : 0;
+    reader->used = 0;
+    return n;
+}
+
+/*
+ * Reads past len bytes
+ * returns true if ok
+ */
+static bool azp_seq_skip(azpSeqReader_t *reader, uint64_t len) {
+    while(len > 0) {
+        ssize_t n = azp_seq_fill(reader);
+        if(n <= 0) {
+            return false;
+        }
+        size_t step = (uint64_t)n < len ? (size_t)n : len;
+        reader->used += step;
+        reader->pos += step;
+        len -= step;
+    }
+    return true;
+}
+
+static int azp_write_full(int fd, const uint8_t *data, size_t len) {
+    while(len > 0) {
+        ssize_t n = write(fd, data, len);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Hands inflated data to every output of the blob
+ * returns 0 if ok
+ */
+static int azp_seq_emit(azpSeqOut_t *out, const uint8_t *data, size_t len) {
+    if(out->writer != NULL) {
+        if(azp_fdwriter_write(out->writer, data, len) != 0) {
+            return -1;
+        }
+        return out->copy != NULL && fwrite(data, 1, len, out->copy) != len ? -1 : 0;
+    }
+    azpSpan_t span;
+    azp_span_begin(&span);
+    int ret = 0;
+    for(uint32_t i = 0; i < out->count; ++i) {
+        if(out->fds[i] != -1 && azp_write_full(out->fds[i], data, len) != 0) {
+            ret = -1;
+        }
+    }
+    azp_span_end(&span, AZP_PHASE_FILES, len, len * out->count, 0);
+    return ret;
+}
+
+/*
+ * Inflates one blob from the reader into its outputs
+ * buf - AZP_SEQ_BUFFER bytes of scratch
+ * why - filled with a description of the problem
+ * returns 0 if ok, 1 if the blob is bad but the reader is past it, -1 if reading or writing failed
+ */
+static int azp_seq_inflate(azpSeqReader_t *reader, uint32_t compressed_size, uint32_t uncompressed_size, azpSeqOut_t *out,
+                           uint8_t *buf, char *why, size_t why_sz) {
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    int ret = inflateInit(&strm);
+    if(ret != Z_OK) {
+        snprintf(why, why_sz, "cannot start inflate (%d)", ret);
+        return 1;
+    }
+
+    azpSpan_t span;
+    azp_span_begin(&span);
+    uint64_t end = reader->pos + compressed_size;
+    bool too_big = false;
+    while(ret == Z_OK && !too_big) {
+        ssize_t avail = azp_seq_fill(reader);
+        if(avail <= 0) {
+            if(avail == 0) {
+                snprintf(why, why_sz, "archive ends inside the entry");
+            } else {
+                snprintf(why, why_sz, "read error: %s", strerror(errno));
+            }
+            (void)inflateEnd(&strm);
+            return -1;
+        }
+        size_t take = (uint64_t)avail < end - reader->pos ? (size_t)avail : end - reader->pos;
+        if(take == 0) {
+            /* Whole blob went in and the stream did not end */
+            ret = Z_BUF_ERROR;
+            break;
+        }
+        strm.next_in = reader->buf + reader->used;
+        strm.avail_in = take;
+        do {
+            strm.next_out = buf;
+            strm.avail_out = AZP_SEQ_BUFFER;
+            ret = inflate(&strm, Z_NO_FLUSH);
+            if(ret == Z_BUF_ERROR) {
+                /* Output was full right as the input ran out, needs more input */
+                ret = Z_OK;
+                break;
+            }
+            if(ret != Z_OK && ret != Z_STREAM_END) {
+                break;
+            }
+            if(strm.total_out > uncompressed_size) {
+                too_big = true;
+                break;
+            }
+            if(azp_seq_emit(out, buf, AZP_SEQ_BUFFER - strm.avail_out) != 0) {
+                snprintf(why, why_sz, "write error: %s", strerror(errno));
+                (void)inflateEnd(&strm);
+                return -1;
+            }
+        } while(ret == Z_OK && strm.avail_out == 0);
+        size_t consumed = take - strm.avail_in;
+        reader->used += consumed;
+        reader->pos += consumed;
+    }
+    azp_span_end(&span, AZP_PHASE_INFLATE, compressed_size, strm.total_out, 1);
+
+    int result = 1;
+    if(too_big) {
+        snprintf(why, why_sz, "inflates to more than the %u bytes the TOC says", uncompressed_size);
+    } else if(ret == Z_BUF_ERROR) {
+        snprintf(why, why_sz, "truncated zlib stream, %lu bytes inflated", strm.total_out);
+    } else if(ret != Z_STREAM_END) {
+        snprintf(why, why_sz, "%s (%d)", strm.msg != NULL ? strm.msg : "inflate error", ret);
+    } else if(strm.total_out != uncompressed_size) {
+        snprintf(why, why_sz, "inflates to %lu bytes, the TOC says %u", strm.total_out, uncompressed_size);
+    } else {
+        result = 0;
+    }
+    (void)inflateEnd(&strm);
+
+    /* Anything left of the blob, on error or junk after the stream */
+    if(!azp_seq_skip(reader, end - reader->pos)) {
+        snprintf(why, why_sz, "archive ends inside the entry");
+        return -1;
+    }
+    return result;
+}
+
+/*
+ * Writes the kept copy of a shared blob for the other entries
+ * returns 0 if ok
+ */
+static int azp_seq_replay(azpSeqOut_t *out, uint32_t times, uint8_t *buf) {
+    for(uint32_t i = 0; i < times; ++i) {
+        rewind(out->copy);
+        size_t n;
+        while((n = fread(buf, 1, AZP_SEQ_BUFFER, out->copy)) > 0) {
+            if(azp_fdwriter_write(out->writer, buf, n) != 0) {
+                return -1;
+            }
+        }
+        if(ferror(out->copy)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+bool azp_index_read(azpIndex_t *index, azpHeader_t *header, int fd) {
+    uint8_t head[sizeof(azpHeader_t)];
+    if(azp_read_full(fd, head, sizeof(head)) != sizeof(head) || !azp_check_header(header, head, sizeof(head))
+       || azp_index_size(header) == 0) {
+        return false;
+    }
+    /* Nothing is allocated for a TOC bigger than its records can be */
+    if(header->fields.data_offset - sizeof(azpHeader_t) > (uint64_t)header->fields.file_count * AZP_TOC_RECORD_MAX) {
+        return false;
+    }
+
+    /*
+     * Decoding wants the TOC where it is in the archive, right after the header. The
+     * buffer grows as the TOC arrives, a header claiming more than the stream holds
+     * gets no more memory than twice what was actually sent.
+     */
+    size_t toc_end = header->fields.data_offset;
+    size_t have = sizeof(head);
+    size_t cap = AZP_SEQ_BUFFER < toc_end ? AZP_SEQ_BUFFER : toc_end;
+    uint8_t *toc = malloc(cap);
+    if(toc == NULL) {
+        return false;
+    }
+    memcpy(toc, head, sizeof(head));
+    bool ok = true;
+    while(ok && have < toc_end) {
+        if(have == cap) {
+            cap = cap < toc_end / 2 ? cap * 2 : toc_end;
+            uint8_t *grown = realloc(toc, cap);
+            if(grown == NULL) {
+                ok = false;
+                break;
+            }
+            toc = grown;
+        }
+        ok = azp_read_full(fd, toc + have, cap - have) == (ssize_t)(cap - have);
+        have = cap;
+    }
+    ok = ok && azp_index_decode(index, header, toc, toc_end, NULL, 0);
+    free(toc);
+    return ok;
+}
+
+bool azp_extract_sequential(const azpHeader_t *header, const azpIndex_t *index, int fd, const uint32_t *list, uint32_t count, azpFdWriter_t *writer) {
+    if(count == 0) {
+        return true;
+    }
+    azpSeqItem_t *items = malloc(count * sizeof(azpSeqItem_t));
+    int *fds = malloc(count * sizeof(int));
+    azpSeqReader_t reader = {
+        .fd = fd,
+        .buf = malloc(AZP_SEQ_BUFFER),
+        .pos = header->fields.data_offset
+    };
+    uint8_t *buf = malloc(AZP_SEQ_BUFFER);
+    azpOutDir_t *outdir = writer == NULL ? azp_outdir_open(NULL, index, list, count) : NULL;
+    if(items == NULL || fds == NULL || reader.buf == NULL || buf == NULL || (writer == NULL && outdir == NULL)) {
+        fprintf(stderr, "Out of memory\n");
+        free(items);
+        free(fds);
+        free(reader.buf);
+        free(buf);
+        azp_outdir_close(outdir);
+        return false;
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        items[i].index = list != NULL ? list[i] : i;
+        items[i].offset = index->offset[items[i].index];
+        items[i].size = index->compressed_size[items[i].index];
+    }
+    qsort(items, count, sizeof(azpSeqItem_t), azp_seq_cmp);
+
+    bool ok = true;
+    azpProgress_t progress;
+    azp_progress_start(&progress, "Extracted", count);
+    if(writer != NULL) {
+        /* Standard output may be the data itself */
+        azp_progress_to_stderr(&progress);
+    }
+    for(uint32_t i = 0; i < count;) {
+        /* Entries sharing this blob */
+        uint32_t group = 1;
+        while(i + group < count && items[i + group].offset == items[i].offset && items[i + group].size == items[i].size) {
+            ++group;
+        }
+        const azpSeqItem_t *item = &items[i];
+        if(item->offset < reader.pos) {
+            for(uint32_t g = 0; g < group; ++g) {
+                fprintf(stderr, "Error extracting file %s: data lies before data already read, the archive has to be seekable\n",
+                        azp_index_name(index, item[g].index));
+            }
+            ok = false;
+            i += group;
+            continue;
+        }
+        if(!azp_seq_skip(&reader, item->offset - reader.pos)) {
+            fprintf(stderr, "Archive ends before %s, %u files not extracted\n", azp_index_name(index, item->index), count - i);
+            ok = false;
+            break;
+        }
+
+        azpSeqOut_t out = {
+            .fds = fds,
+            .count = group,
+            .writer = writer,
+            .copy = NULL
+        };
+        if(writer != NULL && group > 1 && (out.copy = tmpfile()) == NULL) {
+            perror("Error creating temporary file");
+            ok = false;
+            break;
+        }
+        for(uint32_t g = 0; writer == NULL && g < group; ++g) {
+            azpSpan_t span;
+            azp_span_begin(&span);
+            fds[g] = azp_outdir_create(outdir, item[g].index);
+            azp_span_end(&span, AZP_PHASE_FILES, 0, 0, 1);
+            if(fds[g] == -1) {
+                fprintf(stderr, "Error extracting file %s: %s\n", azp_index_name(index, item[g].index), strerror(errno));
+                ok = false;
+            }
+        }
+
+        char why[128];
+        int ret = azp_seq_inflate(&reader, item->size, index->uncompressed_size[item->index], &out, buf, why, sizeof(why));
+        if(ret == 0 && out.copy != NULL && azp_seq_replay(&out, group - 1, buf) != 0) {
+            snprintf(why, sizeof(why), "write error: %s", strerror(errno));
+            ret = -1;
+        }
+        if(out.copy != NULL) {
+            fclose(out.copy);
+        }
+        for(uint32_t g = 0; writer == NULL && g < group; ++g) {
+            if(fds[g] != -1 && close(fds[g]) != 0 && ret == 0) {
+                snprintf(why, sizeof(why), "write error: %s", strerror(errno));
+                ret = -1;
+            }
+        }
+        for(uint32_t g = 0; g < group; ++g) {
+            if(ret != 0) {
+                fprintf(stderr, "Error extracting file %s: %s\n", azp_index_name(index, item[g].index), why);
+            } else if(writer != NULL || fds[g] != -1) {
+                azp_progress_step(&progress, azp_index_name(index, item[g].index), index->uncompressed_size[item[g].index]);
+            }
+        }
+        if(ret != 0) {
+            ok = false;
+            if(ret < 0) {
+                break;
+            }
+        }
+        i += group;
+    }
+    azp_progress_end(&progress);
+
+    azp_outdir_close(outdir);
+    free(items);
+    free(fds);
+    free(reader.buf);
+    free(buf);
+    return ok;
+}
@@ -0,0 +1,137 @@
+/*
+ * Minimal io_uring rings made with the raw syscalls, no liburing needed
+ *
+ * Licenced under GPLv3
+*/
+#define _GNU_SOURCE
+#include "uring.h"
+
+#ifdef AZP_HAVE_URING
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+bool azp_uring_init(azpUring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(azpUring_t));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0) {
+        return false;
+    }
+
+    ring->sq_map_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+    /* Newer kernels map both rings in one go */
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_map_sz > ring->sq_map_sz) {
+            ring->sq_map_sz = ring->cq_map_sz;
+        }
+        ring->cq_map_sz = 0;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        azp_uring_exit(ring);
+        return false;
+    }
+    ring->cq_map = ring->sq_map;
+    if(ring->cq_map_sz != 0) {
+        ring->cq_map = mmap(NULL, ring->cq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            azp_uring_exit(ring);
+            return false;
+        }
+    }
+    ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        azp_uring_exit(ring);
+        return false;
+    }
+
+    uint8_t *sq = ring->sq_map;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    uint8_t *cq = ring->cq_map;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+void azp_uring_exit(azpUring_t *ring) {
+    if(ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_sz);
+    }
+    if(ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_sz);
+    }
+    if(ring->sq_map != NULL) {
+        munmap(ring->sq_map, ring->sq_map_sz);
+    }
+    if(ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(azpUring_t));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *azp_uring_sqe(azpUring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->sq_queued;
+    if(tail - head > *ring->sq_mask) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ++ring->sq_queued;
+    return sqe;
+}
+
+int azp_uring_submit(azpUring_t *ring, unsigned wait) {
+    /* Entries are used in ring order, so the index array is just the identity */
+    unsigned tail = *ring->sq_tail;
+    for(unsigned i = 0; i < ring->sq_queued; ++i) {
+        ring->sq_array[(tail + i) & *ring->sq_mask] = (tail + i) & *ring->sq_mask;
+    }
+    __atomic_store_n(ring->sq_tail, tail + ring->sq_queued, __ATOMIC_RELEASE);
+
+    unsigned to_submit = ring->sq_queued;
+    ring->sq_queued = 0;
+    for(;;) {
+        long n = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait, wait != 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if((unsigned)n >= to_submit) {
+            return 0;
+        }
+        to_submit -= n;
+    }
+}
+
+bool azp_uring_cqe(azpUring_t *ring, struct io_uring_cqe *cqe) {
+    unsigned head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#endif
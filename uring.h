@@ -0,0 +1,77 @@
+/*
+ * Minimal io_uring rings made with the raw syscalls, no liburing needed
+ *
+ * Licenced under GPLv3
+*/
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Build with -DAZP_NO_URING to always use plain syscalls */
+#if defined(__linux__) && defined(__has_include) && !defined(AZP_NO_URING)
+#if __has_include(<linux/io_uring.h>)
+#define AZP_HAVE_URING
+#endif
+#endif
+
+#ifdef AZP_HAVE_URING
+#include <linux/io_uring.h>
+
+typedef struct azpUring_t {
+    int fd;
+    /* submission queue, shared with the kernel */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_queued; // filled in but not yet handed to the kernel
+    /* completion queue, shared with the kernel */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* mappings */
+    void *sq_map;
+    size_t sq_map_sz;
+    void *cq_map;
+    size_t cq_map_sz;
+    size_t sqes_sz;
+} azpUring_t;
+
+/*
+ * Sets up a ring
+ * entries - submission queue size
+ * returns false if io_uring is not available (old kernel, seccomp, ...)
+ */
+bool azp_uring_init(azpUring_t *ring, unsigned entries);
+
+/*
+ * Tears down a ring set up by azp_uring_init
+ */
+void azp_uring_exit(azpUring_t *ring);
+
+/*
+ * Gets the next free submission entry, cleared
+ * returns NULL if the queue is full
+ */
+struct io_uring_sqe *azp_uring_sqe(azpUring_t *ring);
+
+/*
+ * Submits the queued entries and waits for completions
+ * wait - number of completions to wait for
+ * returns 0 if ok, -errno if not
+ */
+int azp_uring_submit(azpUring_t *ring, unsigned wait);
+
+/*
+ * Takes the next completion off the queue
+ * returns false if there is none
+ */
+bool azp_uring_cqe(azpUring_t *ring, struct io_uring_cqe *cqe);
+
+#endif
+
+#endif